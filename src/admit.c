@@ -0,0 +1,263 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Admission control.
+ *
+ * Done by the main process right after accept, so a refused client
+ * costs a single send() instead of a fork. The request is peeked at
+ * without reading it, to learn which service it is for; when it has
+ * not arrived within a millisecond, only the global limits apply and
+ * the client is refused only when the box is saturated already.
+ *
+ * Once a second the main process measures the rate of every client
+ * from the statistics segment. A new client of a service is expected
+ * to cost what its viewers measured so far, or the configured bitrate
+ * for services nobody has watched yet. Clients admitted in the last
+ * couple of seconds are counted with that expected cost until they
+ * show up in the measurement.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+/* Seconds an admitted client counts with its expected cost */
+#define ADMIT_PENDING_TIME 2
+#define ADMIT_PENDING 256 /* must be a power of two */
+/* Clients are told to come back after this to twice this seconds */
+#define ADMIT_RETRY 5
+
+struct admit_pending_s {
+	time_t time;
+	uint64_t cost; /* bytes per second */
+	const struct services_s *service;
+};
+
+static struct admit_pending_s pending[ADMIT_PENDING];
+static unsigned int npending = 0;
+
+static uint64_t *prevbytes = NULL;
+static pid_t *prevpid = NULL;
+static uint64_t egress = 0; /* bytes per second, measured */
+static int cpubusy = 0; /* percent */
+static unsigned long long cpuprev[2]; /* busy, total */
+
+/*
+ * Service of a client slot or request path, by its last component
+ */
+static struct services_s* pathService(const char *path) {
+	const char *name = rindex(path, '/');
+	return name ? findService(name + 1) : NULL;
+}
+
+static void measureCpu(void) {
+	unsigned long long v[8], busy, total;
+	FILE *f;
+	int n;
+
+	f = fopen("/proc/stat", "r");
+	if (f == NULL)
+		return;
+	n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+	fclose(f);
+	if (n != 8)
+		return;
+	/* idle and iowait are not busy */
+	total = v[0] + v[1] + v[2] + v[3] + v[4] + v[5] + v[6] + v[7];
+	busy = total - v[3] - v[4];
+	if (cpuprev[1] && total > cpuprev[1])
+		cpubusy = (busy - cpuprev[0]) * 100 / (total - cpuprev[1]);
+	cpuprev[0] = busy;
+	cpuprev[1] = total;
+}
+
+/*
+ * Measure the egress and the rate of every service. Called by the
+ * main process once a second.
+ */
+void admitCheck(void) {
+	struct stats_client_s *c;
+	struct services_s *service;
+	uint64_t bytes, rate, sum = 0;
+	uint32_t i;
+
+	if (conf_cpulimit)
+		measureCpu();
+	if (!stats)
+		return;
+	if (prevbytes == NULL) {
+		prevbytes = calloc(stats->nclients, sizeof(uint64_t));
+		prevpid = calloc(stats->nclients, sizeof(pid_t));
+		if (prevbytes == NULL || prevpid == NULL) {
+			logger(LOG_FATAL, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < stats->nclients; i++) {
+		c = &stats->clients[i];
+		if (STATS_GET(c->state) != SLOT_USED || c->url[0] == '\0') {
+			prevpid[i] = 0;
+			continue;
+		}
+		bytes = STATS_GET(c->bytes);
+		if (prevpid[i] != c->pid) { /* new client in the slot */
+			prevpid[i] = c->pid;
+			prevbytes[i] = bytes;
+			continue;
+		}
+		rate = bytes - prevbytes[i];
+		prevbytes[i] = bytes;
+		/* Young clients still count as pending, this also skips the
+		 * burst at the start, from timeshift or relays */
+		if (time(NULL) - c->start <= ADMIT_PENDING_TIME)
+			continue;
+		sum += rate;
+		service = pathService(c->url);
+		if (service && rate > 0)
+			service->rate = service->rate ?
+				service->rate - service->rate / 8 + rate / 8 :
+				rate;
+	}
+	egress = sum;
+}
+
+/*
+ * Write a 503 with Retry-After, without ever blocking the main process
+ */
+static void refuse(int s, int tls, const char *why) {
+	char buf[512];
+	int len;
+
+	if (stats)
+		STATS_ADD(stats->rejected, 1);
+	logger(LOG_INFO, "Refusing client: %s\n", why);
+	/* There is no way to say it in plaintext on HTTPS */
+	if (tls)
+		return;
+	len = overloadResponse(buf, sizeof(buf),
+		ADMIT_RETRY + rand() % (ADMIT_RETRY + 1));
+	send(s, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/*
+ * Decide on an accepted connection, before forking a client for it.
+ * @returns 1 when admitted, 0 when refused and the socket is to be
+ * closed
+ */
+int admitClient(int s, const struct sockaddr_storage *ss, int tls) {
+	char req[512], path[256] = "";
+	struct services_s *service = NULL;
+	struct admit_pending_s *p;
+	struct stats_client_s *c;
+	time_t now = time(NULL);
+	uint64_t cost, budget, load;
+	int n, viewers = 0, ipclients = 0;
+	uint32_t i;
+
+	if (!tls) {
+		/* Never wait for the request, the acceptor must not stall.
+		 * Without it only the global limits apply. */
+		n = recv(s, req, sizeof(req) - 1, MSG_PEEK | MSG_DONTWAIT);
+		if (n > 0) {
+			req[n] = '\0';
+			if (sscanf(req, "%*s %255[^ ?\r\n]", path) == 1) {
+				/* Control requests are always served */
+				if (strcmp(path, "/status") == 0 ||
+				    strcmp(path, "/metrics") == 0 ||
+				    strcmp(path, "/record") == 0 ||
+				    strcmp(path, "/relay") == 0)
+					return 1;
+				service = pathService(path);
+			}
+		}
+	}
+
+	if (clientcount >= conf_maxclients) {
+		refuse(s, tls, "maxclients reached");
+		return 0;
+	}
+	if (conf_cpulimit && cpubusy >= conf_cpulimit) {
+		refuse(s, tls, "CPU busy");
+		return 0;
+	}
+
+	/* Without the request only a saturated box refuses */
+	if (service)
+		cost = service->rate ? service->rate :
+			(uint64_t) service->bitrate * 1000 / 8;
+	else
+		cost = path[0] ? (uint64_t) 8000 * 1000 / 8 : 0;
+	load = egress;
+	for (i = 0; i < ADMIT_PENDING && i < npending; i++) {
+		p = &pending[(npending - 1 - i) & (ADMIT_PENDING - 1)];
+		if (now - p->time > ADMIT_PENDING_TIME)
+			break;
+		load += p->cost;
+		if (service && p->service == service)
+			viewers++;
+	}
+	budget = (uint64_t) (conf_admitrate ? conf_admitrate :
+		conf_egressrate) * 1000 / 8;
+	if (budget && (load + cost > budget || load >= budget)) {
+		refuse(s, tls, "egress budget exhausted");
+		return 0;
+	}
+
+	if (stats && ((service && service->maxclients) || conf_ipclients)) {
+		for (i = 0; i < stats->nclients; i++) {
+			c = &stats->clients[i];
+			if (STATS_GET(c->state) != SLOT_USED)
+				continue;
+			if (conf_ipclients && sameAddress(&c->ss, ss))
+				ipclients++;
+			if (service && now - c->start > ADMIT_PENDING_TIME &&
+			    c->url[0] && pathService(c->url) == service)
+				viewers++;
+		}
+		if (conf_ipclients && ipclients >= conf_ipclients) {
+			refuse(s, tls, "too many clients from the address");
+			return 0;
+		}
+		if (service && service->maxclients &&
+		    viewers >= service->maxclients) {
+			refuse(s, tls, "service full");
+			return 0;
+		}
+	}
+
+	p = &pending[npending++ & (ADMIT_PENDING - 1)];
+	p->time = now;
+	p->cost = cost;
+	p->service = service;
+	return 1;
+}
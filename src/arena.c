@@ -0,0 +1,138 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Packet buffer arena.
+ *
+ * Datagrams are received straight into fixed size slabs of an arena
+ * backed by hugepages where the system has them, and whoever keeps the
+ * packet, or a slice of it such as the RTP payload, holds a reference
+ * to its slab instead of a copy. A slab goes back to the free list when
+ * its last reference is dropped, so neither malloc() nor memcpy() is on
+ * the packet path. Every process has its own arena and free list, which
+ * needs no locking as each of them runs on one core at a time.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#define ARENA_HUGEPAGE (2 * 1024 * 1024)
+
+static uint8_t *slabs = NULL;
+static uint32_t nslabs;
+static uint16_t *refs;
+static uint32_t *nextfree;
+static uint32_t freehead = ARENA_NONE;
+static uint32_t nfree;
+
+/*
+ * Map an arena of at least the given number of slabs, rounded up to
+ * whole hugepages.
+ * @returns 0 on success
+ */
+int arenaInit(uint32_t count) {
+	size_t size;
+	uint32_t i;
+
+	if (slabs)
+		return 0;
+	size = ((size_t) count * ARENA_SLAB + ARENA_HUGEPAGE - 1) /
+		ARENA_HUGEPAGE * ARENA_HUGEPAGE;
+	slabs = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (slabs == MAP_FAILED) {
+		/* No reserved hugepages, ask for transparent ones */
+		slabs = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slabs == MAP_FAILED) {
+			logger(LOG_ERROR, "Cannot map packet arena: %s\n",
+					strerror(errno));
+			slabs = NULL;
+			return -1;
+		}
+		madvise(slabs, size, MADV_HUGEPAGE);
+	}
+	nslabs = size / ARENA_SLAB;
+	refs = calloc(nslabs, sizeof(uint16_t));
+	nextfree = malloc(nslabs * sizeof(uint32_t));
+	if (refs == NULL || nextfree == NULL) {
+		logger(LOG_ERROR, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < nslabs; i++)
+		nextfree[i] = i + 1 < nslabs ? i + 1 : ARENA_NONE;
+	freehead = 0;
+	nfree = nslabs;
+	return 0;
+}
+
+int arenaEnabled(void) {
+	return slabs != NULL;
+}
+
+/*
+ * Take a free slab with one reference
+ * @returns its number, or ARENA_NONE when all are in use
+ */
+uint32_t arenaAlloc(void) {
+	uint32_t s = freehead;
+
+	if (s == ARENA_NONE)
+		return ARENA_NONE;
+	freehead = nextfree[s];
+	nfree--;
+	refs[s] = 1;
+	return s;
+}
+
+uint8_t* arenaData(uint32_t slab) {
+	return slabs + (size_t) slab * ARENA_SLAB;
+}
+
+void arenaRef(uint32_t slab) {
+	refs[slab]++;
+}
+
+void arenaUnref(uint32_t slab) {
+	if (--refs[slab] > 0)
+		return;
+	nextfree[slab] = freehead;
+	freehead = slab;
+	nfree++;
+}
+
+/*
+ * Slabs left, for callers that would rather release some first
+ */
+uint32_t arenaFree(void) {
+	return nfree;
+}
@@ -0,0 +1,297 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Cluster of nodes behind one name.
+ *
+ * Every service is owned by one node, chosen by rendezvous hashing of
+ * the service name over the live nodes, so a node going down or coming
+ * back only moves the services it owns. Requests for services owned
+ * elsewhere are redirected there, and each multicast group is joined
+ * by a single node.
+ *
+ * Nodes are listed in the [cluster] section. The main process sends a
+ * heartbeat datagram to all of them once a second, to the UDP port of
+ * the same number as their HTTP port, and a node not heard from for
+ * CLUSTER_TIMEOUT seconds is left out of the hashing. Clients are
+ * forked with the view of the main process at that moment.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#define CLUSTER_TIMEOUT 3
+#define CLUSTER_MAGIC "RTP2HTTPD-NODE "
+
+struct cluster_node_s {
+	char *name;
+	char *host;
+	char *port;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	time_t seen;
+	struct cluster_node_s *next;
+};
+
+static struct cluster_node_s *nodes = NULL;
+static struct cluster_node_s *self = NULL;
+static int sock = -1;
+
+void clusterConfigure(const char *name, const char *host, const char *port) {
+	struct cluster_node_s *n;
+
+	n = malloc(sizeof(struct cluster_node_s));
+	memset(n, 0, sizeof(*n));
+	n->name = strdup(name);
+	n->host = strdup(host);
+	n->port = strdup(port);
+	n->next = nodes;
+	nodes = n;
+}
+
+/*
+ * Resolve the nodes and open the heartbeat socket. Called by the main
+ * process before forking anything.
+ */
+void clusterInit(void) {
+	struct addrinfo hints, *res;
+	struct cluster_node_s *n;
+	struct sockaddr_storage any, bound;
+	socklen_t len;
+	int r;
+
+	if (nodes == NULL)
+		return;
+	if (conf_clusternode == NULL) {
+		logger(LOG_ERROR, "Cluster configured without clusternode, "
+			"serving all services here\n");
+		return;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	for (n = nodes; n; n = n->next) {
+		r = getaddrinfo(n->host, n->port, &hints, &res);
+		if (r) {
+			logger(LOG_ERROR, "Cluster node %s: %s\n", n->name,
+				gai_strerror(r));
+			continue;
+		}
+		memcpy(&n->addr, res->ai_addr, res->ai_addrlen);
+		n->addrlen = res->ai_addrlen;
+		freeaddrinfo(res);
+		/* Everybody is up until proven otherwise */
+		n->seen = time(NULL);
+		if (strcmp(n->name, conf_clusternode) == 0)
+			self = n;
+	}
+	if (self == NULL || self->addrlen == 0) {
+		logger(LOG_ERROR, "Node %s is not in the cluster, "
+			"serving all services here\n", conf_clusternode);
+		self = NULL;
+		return;
+	}
+
+	memset(&any, 0, sizeof(any));
+	any.ss_family = self->addr.ss_family;
+	if (any.ss_family == AF_INET)
+		((struct sockaddr_in *) &any)->sin_port =
+			((struct sockaddr_in *) &self->addr)->sin_port;
+	else
+		((struct sockaddr_in6 *) &any)->sin6_port =
+			((struct sockaddr_in6 *) &self->addr)->sin6_port;
+
+	/* After an upgrade the children still hold the socket bound */
+	if (upgradeTake("cluster", &sock) && sock >= 0) {
+		len = sizeof(bound);
+		if (getsockname(sock, (struct sockaddr *) &bound, &len) < 0 ||
+		    len != self->addrlen || memcmp(&bound, &any, len) != 0) {
+			close(sock);
+			sock = -1;
+		}
+	}
+	if (sock < 0) {
+		sock = socket(self->addr.ss_family, SOCK_DGRAM |
+			SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (sock < 0 || bind(sock, (struct sockaddr *) &any,
+				self->addrlen) < 0) {
+			logger(LOG_ERROR, "Cannot bind cluster socket: %s\n",
+				strerror(errno));
+			if (sock >= 0)
+				close(sock);
+			sock = -1;
+			return;
+		}
+	}
+	upgradeKeep(sock, "cluster");
+	logger(LOG_INFO, "Cluster node %s on port %s\n", self->name,
+		self->port);
+}
+
+static in_port_t portOf(const struct sockaddr_storage *ss) {
+	if (ss->ss_family == AF_INET)
+		return ((const struct sockaddr_in *) ss)->sin_port;
+	if (ss->ss_family == AF_INET6)
+		return ((const struct sockaddr_in6 *) ss)->sin6_port;
+	return 0;
+}
+
+/*
+ * Send and receive heartbeats. Called by the main process once a
+ * second.
+ */
+void clusterCheck(void) {
+	struct cluster_node_s *n;
+	struct sockaddr_storage from;
+	socklen_t fromlen = sizeof(from);
+	char buf[256];
+	int len;
+	time_t now = time(NULL);
+
+	if (sock < 0)
+		return;
+	while ((len = recvfrom(sock, buf, sizeof(buf) - 1, 0,
+			(struct sockaddr *) &from, &fromlen)) > 0) {
+		buf[len] = '\0';
+		fromlen = sizeof(from);
+		if (strncmp(buf, CLUSTER_MAGIC, strlen(CLUSTER_MAGIC)) != 0)
+			continue;
+		for (n = nodes; n; n = n->next) {
+			if (strcmp(n->name, buf + strlen(CLUSTER_MAGIC)) != 0)
+				continue;
+			/* Only the node itself vouches for being up */
+			if (n->addrlen == 0 || !sameAddress(&from, &n->addr) ||
+			    portOf(&from) != portOf(&n->addr)) {
+				logger(LOG_DEBUG, "Heartbeat of %s from a "
+					"foreign address\n", n->name);
+				continue;
+			}
+			if (now - n->seen > CLUSTER_TIMEOUT)
+				logger(LOG_INFO, "Cluster node %s is up\n",
+					n->name);
+			n->seen = now;
+		}
+	}
+	self->seen = now;
+	len = snprintf(buf, sizeof(buf), CLUSTER_MAGIC "%s", self->name);
+	for (n = nodes; n; n = n->next) {
+		if (n == self || n->addrlen == 0)
+			continue;
+		sendto(sock, buf, len, 0, (struct sockaddr *) &n->addr,
+			n->addrlen);
+		if (now - n->seen == CLUSTER_TIMEOUT + 1)
+			logger(LOG_INFO, "Cluster node %s is down\n", n->name);
+	}
+}
+
+/* FNV-1a of the node and the service name, then a final mix */
+static uint64_t score(const char *node, const char *service) {
+	uint64_t h = 14695981039346656037ULL;
+
+	for (; *node; node++)
+		h = (h ^ (uint8_t) *node) * 1099511628211ULL;
+	h = (h ^ '/') * 1099511628211ULL;
+	for (; *service; service++)
+		h = (h ^ (uint8_t) *service) * 1099511628211ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ * Node owning the service.
+ * @returns NULL when it is this node or clustering is off
+ */
+static struct cluster_node_s* owner(const char *service) {
+	struct cluster_node_s *n, *best = NULL;
+	uint64_t s, bestscore = 0;
+	time_t now = time(NULL);
+
+	if (self == NULL)
+		return NULL;
+	for (n = nodes; n; n = n->next) {
+		if (n->addrlen == 0 || now - n->seen > CLUSTER_TIMEOUT)
+			continue;
+		s = score(n->name, service);
+		if (best == NULL || s > bestscore) {
+			best = n;
+			bestscore = s;
+		}
+	}
+	return best == self ? NULL : best;
+}
+
+/*
+ * Where to send the client when the service is owned by another node.
+ * @returns absolute URL in a static buffer, or NULL to serve it here
+ */
+const char* clusterRedirect(const char *service, const char *path,
+		const char *query) {
+	static char location[1024];
+	struct cluster_node_s *n;
+	int v6;
+
+	/* Once redirected, a request is served, even if the views differ */
+	if (query && strstr(query, "cluster=") != NULL)
+		return NULL;
+	n = owner(service);
+	if (n == NULL)
+		return NULL;
+	v6 = index(n->host, ':') != NULL;
+	snprintf(location, sizeof(location), "http://%s%s%s:%s%s?%s%scluster=%s",
+		v6 ? "[" : "", n->host, v6 ? "]" : "", n->port, path,
+		query ? query : "", query ? "&" : "", self->name);
+	return location;
+}
+
+/*
+ * Write the membership in Prometheus text exposition format
+ */
+void clusterPrometheus(FILE *f) {
+	struct cluster_node_s *n;
+	time_t now = time(NULL);
+
+	if (self == NULL)
+		return;
+	fprintf(f, "# HELP rtp2httpd_cluster_node_up Whether the node takes "
+		"part in the hashing of services.\n"
+		"# TYPE rtp2httpd_cluster_node_up gauge\n");
+	for (n = nodes; n; n = n->next) {
+		fprintf(f, "rtp2httpd_cluster_node_up{node=\"");
+		labelEscape(f, n->name);
+		fprintf(f, "\"} %d\n", n->addrlen && now - n->seen <=
+			CLUSTER_TIMEOUT);
+	}
+}
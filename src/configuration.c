@@ -30,8 +30,10 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <net/if.h>
 #include <ctype.h>
 #include <getopt.h>
+#include <time.h>
 
 #include "rtp2httpd.h"
 
@@ -39,7 +41,7 @@
 #include "config.h"
 #endif /* HAVE_CONFIG_H */
 
-#define MAX_LINE 150
+#define MAX_LINE 1024
 
 /* GLOBAL CONFIGURATION VARIABLES */
 
@@ -48,7 +50,28 @@ enum loglevel conf_verbosity;
 int conf_daemonise;
 int conf_udpxy;
 int conf_maxclients;
+int conf_backlog;
 char *conf_hostname = NULL;
+char *conf_statusfile = NULL;
+char *conf_timeshiftdir = NULL;
+char *conf_recorddir = NULL;
+char *conf_hlsdir = NULL;
+int conf_recordapi;
+int conf_relayapi;
+int conf_fanout;
+int conf_joinrate;
+int conf_pinworkers;
+int conf_clientrate;
+int conf_iprate;
+int conf_egressrate;
+char *conf_tlscert = NULL;
+char *conf_logfile = NULL;
+char *conf_tlskey = NULL;
+int conf_trace;
+char *conf_clusternode = NULL;
+int conf_admitrate;
+int conf_cpulimit;
+int conf_ipclients;
 
 /* *** */
 
@@ -62,12 +85,14 @@ enum section_e {
 	SEC_NONE = 0,
 	SEC_BIND,
 	SEC_SERVICES,
-	SEC_GLOBAL
+	SEC_GLOBAL,
+	SEC_RECORDINGS,
+	SEC_CLUSTER
 };
 
 
 void parseBindSec(char *line) {
-	int i, j;
+	int i, j, tls;
 	char *node, *service;
 	struct bindaddr_s *ba;
 
@@ -84,30 +109,179 @@ void parseBindSec(char *line) {
 		j++;
 	service = strndup(line+i, j-i);
 
+	i=j;
+	while (isspace(line[i]))
+		i++;
+	j=i;
+	while (line[j] && !isspace(line[j]))
+		j++;
+	tls = j - i == 3 && strncasecmp("tls", line+i, 3) == 0;
+
 	if (strcmp("*", node) == 0) {
 		free(node);
 		node = NULL;
 	}
-	logger(LOG_DEBUG, "node: %s, port: %s\n",node, service);
+	logger(LOG_DEBUG, "node: %s, port: %s%s\n",node, service,
+			tls ? " (TLS)" : "");
 
 	ba = malloc(sizeof(struct bindaddr_s));
 	ba->node = node;
 	ba->service = service;
+	ba->tls = tls;
 	ba->next = bindaddr;
 	bindaddr = ba;
 }
 
+/*
+ * Parse optional key=value settings following the service definition
+ */
+static void parseServiceOptions(struct services_s *service, char *line) {
+	int i, j;
+	char *opt, *value;
+
+	i = 0;
+	while (1) {
+		while (isspace(line[i]))
+			i++;
+		if (line[i] == '\0' || line[i] == '#' || line[i] == ';')
+			break;
+		j = i;
+		while (line[j] != '\0' && !isspace(line[j]))
+			j++;
+		opt = strndupa(line+i, j-i);
+		i = j;
+
+		value = index(opt, '=');
+		if (value == NULL) {
+			logger(LOG_ERROR, "Service %s: invalid option %s\n",
+					service->url, opt);
+			continue;
+		}
+		*value++ = '\0';
+
+		if (strcasecmp("timeshift", opt) == 0) {
+			service->timeshift = atoi(value);
+			continue;
+		}
+		if (strcasecmp("bitrate", opt) == 0) {
+			if (atoi(value) < 1) {
+				logger(LOG_ERROR, "Service %s: invalid "
+					"bitrate! Ignoring.\n",
+					service->url);
+				continue;
+			}
+			service->bitrate = atoi(value);
+			continue;
+		}
+		if (strcasecmp("weight", opt) == 0) {
+			if (atoi(value) < 1) {
+				logger(LOG_ERROR, "Service %s: invalid "
+					"weight! Ignoring.\n",
+					service->url);
+				continue;
+			}
+			service->weight = atoi(value);
+			continue;
+		}
+		if (strcasecmp("maxclients", opt) == 0) {
+			if (atoi(value) < 0) {
+				logger(LOG_ERROR, "Service %s: invalid "
+					"maxclients! Ignoring.\n",
+					service->url);
+				continue;
+			}
+			service->maxclients = atoi(value);
+			continue;
+		}
+		if (strcasecmp("linger", opt) == 0) {
+			if (atoi(value) < 1) {
+				logger(LOG_ERROR, "Service %s: invalid "
+					"linger! Ignoring.\n",
+					service->url);
+				continue;
+			}
+			service->linger = atoi(value);
+			continue;
+		}
+		if (strcasecmp("loop", opt) == 0) {
+			service->loop = atoi(value) > 0;
+			continue;
+		}
+		if (strcasecmp("speed", opt) == 0) {
+			if (atoi(value) < 0) {
+				logger(LOG_ERROR, "Service %s: invalid "
+					"speed! Ignoring.\n",
+					service->url);
+				continue;
+			}
+			service->speed = atoi(value);
+			continue;
+		}
+		if (strcasecmp("slate", opt) == 0) {
+			service->slate = strdup(value);
+			continue;
+		}
+		if (strcasecmp("if", opt) == 0) {
+			/* May come up later, joins retry until it does */
+			if (if_nametoindex(value) == 0)
+				logger(LOG_ERROR, "Service %s: no interface "
+					"%s yet\n", service->url, value);
+			service->ifname = strdup(value);
+			continue;
+		}
+		if (strcasecmp("transport", opt) == 0) {
+			if (strcasecmp(value, "tcp") != 0 &&
+			    strcasecmp(value, "udp") != 0) {
+				logger(LOG_ERROR, "Service %s: invalid "
+					"transport! Ignoring.\n",
+					service->url);
+				continue;
+			}
+			service->interleaved = strcasecmp(value, "tcp") == 0;
+			continue;
+		}
+		if (strcasecmp("pace", opt) == 0) {
+			if (atoi(value) < 0 || atoi(value) > 900) {
+				logger(LOG_ERROR, "Service %s: invalid "
+					"pace! Ignoring.\n",
+					service->url);
+				continue;
+			}
+			service->pace = atoi(value);
+			continue;
+		}
+		if (strcasecmp("relay", opt) == 0) {
+			relayConfigure(service->url, value);
+			continue;
+		}
+		if (strcasecmp("hls", opt) == 0) {
+			service->hls = atoi(value);
+			continue;
+		}
+		if (strcasecmp("hlswindow", opt) == 0) {
+			if (atoi(value) < 1 || atoi(value) > HLS_SEGMENTS - 4) {
+				logger(LOG_ERROR, "Service %s: invalid "
+					"hlswindow! Ignoring.\n",
+					service->url);
+				continue;
+			}
+			service->hlswindow = atoi(value);
+			continue;
+		}
+		logger(LOG_ERROR, "Service %s: unknown option %s\n",
+				service->url, opt);
+	}
+}
+
 void parseServicesSec(char *line) {
 	int i, j, r, rr;
-	struct addrinfo hints;
 	char *servname, *type, *maddr, *mport, *msrc="", *msaddr="", *msport="";
+	char *options, *afteraddr;
+	char *host, *port, *path;
 	struct services_s *service;
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_socktype = SOCK_DGRAM;
-
 	j=i=0;
-	while (!isspace(line[j]))
+	while (line[j] && !isspace(line[j]))
 		j++;
 	servname = strndup(line, j);
 
@@ -115,7 +289,7 @@ void parseServicesSec(char *line) {
 	while (isspace(line[i]))
 		i++;
 	j=i;
-	while (!isspace(line[j]))
+	while (line[j] && !isspace(line[j]))
 		j++;
 	type = strndupa(line+i, j-i);
 
@@ -123,17 +297,89 @@ void parseServicesSec(char *line) {
 	while (isspace(line[i]))
 		i++;
 	j=i;
-	while (!isspace(line[j]))
+	while (line[j] && !isspace(line[j]))
 		j++;
 	maddr = strndupa(line+i, j-i);
+	afteraddr = line+j;
 
 	i=j;
 	while (isspace(line[i]))
 		i++;
 	j=i;
-	while (!isspace(line[j]))
+	while (line[j] && !isspace(line[j]))
 		j++;
 	mport = strndupa(line+i, j-i);
+	options = line+j;
+
+	if (strcasecmp("HTTP", type) == 0 || strcasecmp("RTSP", type) == 0) {
+		/* NAME TYPE URL [options], none of the multicast syntax */
+		if (upstreamParse(maddr, &host, &port, &path) < 0) {
+			logger(LOG_ERROR, "Service %s: invalid URL %s\n",
+					servname, maddr);
+			free(servname);
+			return;
+		}
+		service = malloc(sizeof(struct services_s));
+		memset(service, 0, sizeof(*service));
+		r = resolveNumeric(host, port, SOCK_STREAM, &(service->addr));
+		free(path);
+		if (service->addr == NULL && r == 0) {
+			/* Looked up in the background */
+			service->host = host;
+			service->port = port;
+		} else {
+			free(host);
+			free(port);
+		}
+		if (r) {
+			logger(LOG_ERROR, "Cannot init service %s. GAI: %s\n",
+					servname, gai_strerror(r));
+			free(servname);
+			free(service);
+			return;
+		}
+		service->service_type = strcasecmp("RTSP", type) == 0 ?
+			SERVICE_RTSP : SERVICE_HTTP;
+		service->upstream = strdup(maddr);
+		service->url = servname;
+		service->msrc = strdup("");
+		service->bitrate = 8000;
+		service->hlswindow = 6;
+		service->weight = 1;
+		parseServiceOptions(service, afteraddr);
+		service->next = services;
+		services = service;
+		return;
+	}
+
+	if (strcasecmp("FILE", type) == 0) {
+		/* NAME FILE PATH [options], read by the clients */
+		if (access(maddr, R_OK) < 0) {
+			logger(LOG_ERROR, "Service %s: cannot read %s\n",
+					servname, maddr);
+			free(servname);
+			return;
+		}
+		service = malloc(sizeof(struct services_s));
+		memset(service, 0, sizeof(*service));
+		service->service_type = SERVICE_FILE;
+		service->file = strdup(maddr);
+		service->url = servname;
+		service->msrc = strdup("");
+		service->bitrate = 8000;
+		service->hlswindow = 6;
+		service->weight = 1;
+		service->speed = 1;
+		parseServiceOptions(service, afteraddr);
+		if (service->timeshift > 0 || service->hls > 0) {
+			logger(LOG_ERROR, "Service %s: no timeshift or HLS "
+				"of files\n", servname);
+			service->timeshift = service->hls = 0;
+		}
+		service->next = services;
+		services = service;
+		return;
+	}
 
 	if (strstr(maddr, "@") != NULL) {
 		char *split;
@@ -181,10 +427,20 @@ void parseServicesSec(char *line) {
 	service = malloc(sizeof(struct services_s));
 	memset(service, 0, sizeof(*service));
 
-	r = getaddrinfo(maddr, mport, &hints, &(service->addr));
+	/* Host names are looked up in the background */
+	r = resolveNumeric(maddr, mport, SOCK_DGRAM, &(service->addr));
+	if (r == 0 && service->addr == NULL) {
+		service->host = strdup(maddr);
+		service->port = strdup(mport);
+	}
 	rr = 0;
 	if (strcmp(msrc, "") != 0 && msrc != NULL) {
-		rr = getaddrinfo(msaddr, msport, &hints, &(service->msrc_addr));
+		rr = resolveNumeric(msaddr, msport, SOCK_DGRAM,
+				&(service->msrc_addr));
+		if (rr == 0 && service->msrc_addr == NULL) {
+			service->srchost = strdup(msaddr);
+			service->srcport = strdup(msport);
+		}
 	}
 	if (r || rr) {
 		if (r) {
@@ -200,10 +456,10 @@ void parseServicesSec(char *line) {
 		free(service);
 		return;
 	}
-	if (service->addr->ai_next != NULL) {
+	if (service->addr && service->addr->ai_next != NULL) {
 		logger(LOG_ERROR, "Warning: maddr is ambiguos.\n");
 	}
-	if (strcmp(msrc, "") != 0 && msrc != NULL) {
+	if (strcmp(msrc, "") != 0 && msrc != NULL && service->msrc_addr) {
 		if (service->msrc_addr->ai_next != NULL) {
 			logger(LOG_ERROR, "Warning: msrc is ambiguos.\n");
 		}
@@ -217,10 +473,98 @@ void parseServicesSec(char *line) {
 
 	service->url = servname;
 	service->msrc = strdup(msrc);
+	service->bitrate = 8000;
+	service->hlswindow = 6;
+	service->weight = 1;
+	parseServiceOptions(service, options);
 	service->next = services;
 	services = service;
 }
 
+void parseClusterSec(char *line) {
+	int i, j;
+	char *name, *host, *port;
+
+	j=i=0;
+	while (!isspace(line[j]))
+		j++;
+	name = strndupa(line, j);
+
+	i=j;
+	while (isspace(line[i]))
+		i++;
+	j=i;
+	while (!isspace(line[j]))
+		j++;
+	host = strndupa(line+i, j-i);
+
+	i=j;
+	while (isspace(line[i]))
+		i++;
+	j=i;
+	while (line[j] != '\0' && !isspace(line[j]))
+		j++;
+	port = strndupa(line+i, j-i);
+
+	if (host[0] == '\0' || port[0] == '\0') {
+		logger(LOG_ERROR, "Invalid cluster node: %s\n", line);
+		return;
+	}
+	logger(LOG_DEBUG, "cluster node: %s, host: %s, port: %s\n",
+			name, host, port);
+	clusterConfigure(name, host, port);
+}
+
+void parseRecordingsSec(char *line) {
+	int i, j;
+	char *service, *start, *minutes, *file;
+	struct tm tm;
+
+	j=i=0;
+	while (!isspace(line[j]))
+		j++;
+	service = strndupa(line, j);
+
+	i=j;
+	while (isspace(line[i]))
+		i++;
+	j=i;
+	while (!isspace(line[j]))
+		j++;
+	start = strndupa(line+i, j-i);
+
+	i=j;
+	while (isspace(line[i]))
+		i++;
+	j=i;
+	while (!isspace(line[j]))
+		j++;
+	minutes = strndupa(line+i, j-i);
+
+	i=j;
+	while (isspace(line[i]))
+		i++;
+	j=i;
+	while (line[j] != '\0' && !isspace(line[j]))
+		j++;
+	file = j > i ? strndupa(line+i, j-i) : NULL;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_isdst = -1;
+	if (strptime(start, "%Y-%m-%dT%H:%M", &tm) == NULL ||
+	    atoi(minutes) < 1) {
+		logger(LOG_ERROR, "Invalid recording: %s\n", line);
+		return;
+	}
+	if (file && (file[0] == '.' || index(file, '/'))) {
+		logger(LOG_ERROR, "Invalid recording file name: %s\n", file);
+		return;
+	}
+	logger(LOG_DEBUG, "recording: %s, start: %s, minutes: %s\n",
+			service, start, minutes);
+	recordSchedule(service, mktime(&tm), atoi(minutes), file);
+}
+
 void parseGlobalSec(char *line){
 	int i, j;
 	char *param, *value;
@@ -280,6 +624,14 @@ void parseGlobalSec(char *line){
 		}
 		return;
 	}
+	if (strcasecmp("backlog", param) == 0) {
+		if (atoi(value) < 1) {
+			logger(LOG_ERROR, "Invalid backlog! Ignoring.\n");
+			return;
+		}
+		conf_backlog = atoi(value);
+		return;
+	}
 	if (strcasecmp("udpxy", param) == 0) {
 		if (!cmd_udpxy_set) {
 			if ((strcasecmp("on", value) == 0) ||
@@ -299,6 +651,125 @@ void parseGlobalSec(char *line){
 		conf_hostname = strdup(value);
 		return;
 	}
+	if (strcasecmp("statusfile", param) == 0) {
+		conf_statusfile = strdup(value);
+		return;
+	}
+	if (strcasecmp("timeshiftdir", param) == 0) {
+		conf_timeshiftdir = strdup(value);
+		return;
+	}
+	if (strcasecmp("recorddir", param) == 0) {
+		conf_recorddir = strdup(value);
+		return;
+	}
+	if (strcasecmp("hlsdir", param) == 0) {
+		conf_hlsdir = strdup(value);
+		return;
+	}
+	if (strcasecmp("recordapi", param) == 0) {
+		if ((strcasecmp("on", value) == 0) ||
+		    (strcasecmp("true", value) == 0) ||
+		    (strcasecmp("yes", value) == 0) ||
+		    (strcasecmp("1", value) == 0)) {
+			conf_recordapi = 1;
+		} else {
+			conf_recordapi = 0;
+		}
+		return;
+	}
+
+	if (strcasecmp("fanout", param) == 0) {
+		if ((strcasecmp("on", value) == 0) ||
+		    (strcasecmp("true", value) == 0) ||
+		    (strcasecmp("yes", value) == 0) ||
+		    (strcasecmp("1", value) == 0)) {
+			conf_fanout = 1;
+		} else {
+			conf_fanout = 0;
+		}
+		return;
+	}
+
+	if (strcasecmp("pinworkers", param) == 0) {
+		if ((strcasecmp("on", value) == 0) ||
+		    (strcasecmp("true", value) == 0) ||
+		    (strcasecmp("yes", value) == 0) ||
+		    (strcasecmp("1", value) == 0)) {
+			conf_pinworkers = 1;
+		} else {
+			conf_pinworkers = 0;
+		}
+		return;
+	}
+
+	if (strcasecmp("clientrate", param) == 0) {
+		conf_clientrate = atoi(value);
+		return;
+	}
+	if (strcasecmp("iprate", param) == 0) {
+		conf_iprate = atoi(value);
+		return;
+	}
+	if (strcasecmp("egressrate", param) == 0) {
+		conf_egressrate = atoi(value);
+		return;
+	}
+	if (strcasecmp("joinrate", param) == 0) {
+		conf_joinrate = atoi(value);
+		return;
+	}
+	if (strcasecmp("logfile", param) == 0) {
+		conf_logfile = strdup(value);
+		return;
+	}
+	if (strcasecmp("tlscert", param) == 0) {
+		conf_tlscert = strdup(value);
+		return;
+	}
+	if (strcasecmp("tlskey", param) == 0) {
+		conf_tlskey = strdup(value);
+		return;
+	}
+	if (strcasecmp("admitrate", param) == 0) {
+		conf_admitrate = atoi(value);
+		return;
+	}
+	if (strcasecmp("cpulimit", param) == 0) {
+		if (atoi(value) < 0 || atoi(value) > 100) {
+			logger(LOG_ERROR, "Invalid cpulimit! Ignoring.\n");
+			return;
+		}
+		conf_cpulimit = atoi(value);
+		return;
+	}
+	if (strcasecmp("ipclients", param) == 0) {
+		conf_ipclients = atoi(value);
+		return;
+	}
+	if (strcasecmp("clusternode", param) == 0) {
+		conf_clusternode = strdup(value);
+		return;
+	}
+	if (strcasecmp("trace", param) == 0) {
+		if (atoi(value) < 0) {
+			logger(LOG_ERROR, "Invalid trace! Ignoring.\n");
+			return;
+		}
+		conf_trace = atoi(value);
+		return;
+	}
+	if (strcasecmp("relayapi", param) == 0) {
+		if ((strcasecmp("on", value) == 0) ||
+		    (strcasecmp("true", value) == 0) ||
+		    (strcasecmp("yes", value) == 0) ||
+		    (strcasecmp("1", value) == 0)) {
+			conf_relayapi = 1;
+		} else {
+			conf_relayapi = 0;
+		}
+		return;
+	}
 
 	logger(LOG_ERROR,"Unknown config parameter: %s\n", param);
 }
@@ -341,6 +812,14 @@ int parseConfigFile(char *path) {
 					section = SEC_GLOBAL;
 					continue;
 				}
+				if (strcasecmp("recordings", secname) == 0) {
+					section = SEC_RECORDINGS;
+					continue;
+				}
+				if (strcasecmp("cluster", secname) == 0) {
+					section = SEC_CLUSTER;
+					continue;
+				}
 				logger(LOG_ERROR,"Invalid section name: %s\n", secname);
 				continue;
 			} else {
@@ -367,6 +846,12 @@ int parseConfigFile(char *path) {
 			case SEC_GLOBAL:
 				parseGlobalSec(line+i);
 				break;
+			case SEC_RECORDINGS:
+				parseRecordingsSec(line+i);
+				break;
+			case SEC_CLUSTER:
+				parseClusterSec(line+i);
+				break;
 			default:
 				logger(LOG_ERROR, "Unrecognised config line: %s\n",line);
 		}
@@ -402,14 +887,35 @@ void restoreConfDefaults() {
 	struct bindaddr_s *bindtmp;
 
 	conf_verbosity = LOG_ERROR;
+	conf_logfile = NULL;
 	cmd_verbosity_set = 0;
 	conf_daemonise = 0;
 	cmd_daemonise_set = 0;
 	conf_maxclients = 5;
 	cmd_maxclients_set = 0;
+	conf_backlog = 1024;
+	conf_statusfile = NULL;
 	conf_udpxy = 1;
 	cmd_udpxy_set = 0;
 	cmd_bind_set = 0;
+	conf_timeshiftdir = "/var/tmp";
+	conf_recorddir = "/var/tmp";
+	conf_hlsdir = "/dev/shm";
+	conf_recordapi = 0;
+	conf_relayapi = 0;
+	conf_clientrate = 0;
+	conf_iprate = 0;
+	conf_egressrate = 0;
+	conf_admitrate = 0;
+	conf_cpulimit = 0;
+	conf_ipclients = 0;
+	conf_tlscert = NULL;
+	conf_tlskey = NULL;
+	conf_trace = 0;
+	conf_clusternode = NULL;
+	conf_fanout = 0;
+	conf_joinrate = 0;
+	conf_pinworkers = 0;
 
 	while (services != NULL) {
 		servtmp = services;
@@ -488,6 +994,7 @@ void parseBindCmd(char *optarg) {
 	ba = malloc(sizeof(struct bindaddr_s));
 	ba->node = node;
 	ba->service = service;
+	ba->tls = 0;
 	ba->next = bindaddr;
 	bindaddr = ba;
 }
@@ -0,0 +1,457 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <poll.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#define UDPBUFLEN 2000
+/* Datagrams received in one go before the outputs are flushed */
+#define FEEDER_BURST 64
+
+/* Seconds to wait before a dead feeder is started again */
+#define FEEDER_RESTART 1
+/* Seconds an on demand feeder runs after the last request */
+#define FEEDER_IDLE 30
+/* Seconds of stream in the ring of HTTP services without timeshift */
+#define FEEDER_LIVE_RING 10
+
+/**
+ * Linked list of feeders
+ */
+struct feeder_s {
+	struct services_s *service;
+	pid_t pid; /* 0 if not running */
+	time_t died;
+	struct feeder_s *next;
+};
+
+static struct feeder_s *feeders = NULL;
+
+/*
+ * Time of the last client request, per service, for the services fed
+ * on demand. Shared by all processes.
+ */
+static time_t *demand = NULL;
+static int ndemand;
+
+static time_t* demandOf(const struct services_s *service) {
+	const struct services_s *servi;
+	int i = 0;
+
+	if (demand == NULL)
+		return NULL;
+	for (servi = services; servi && i < ndemand; servi = servi->next, i++) {
+		if (servi == service)
+			return &demand[i];
+	}
+	return NULL;
+}
+
+static int demanded(const struct services_s *service, time_t now) {
+	time_t *d = demandOf(service);
+
+	return d && now - __atomic_load_n(d, __ATOMIC_RELAXED) <
+		(service->linger > 0 ? service->linger : FEEDER_IDLE);
+}
+
+/*
+ * Note that a client wants the output of the feeder. The main
+ * process starts the feeder if it is not running.
+ */
+void feederDemand(const struct services_s *service) {
+	time_t *d = demandOf(service);
+
+	if (d)
+		__atomic_store_n(d, time(NULL), __ATOMIC_RELAXED);
+}
+
+/*
+ * File name of the ring of the service. Caller frees.
+ */
+char* ringPath(const struct services_s *service) {
+	char *path;
+
+	if (asprintf(&path, "%s/" PACKAGE "-%s.ring",
+			conf_timeshiftdir, service->url) < 0)
+		return NULL;
+	return path;
+}
+
+/*
+ * Hand received payload to all outputs of the feeder
+ */
+static void feederOutput(struct ring_s *ring, const uint8_t *buf, int len) {
+	int rap = tsRandomAccess(buf, len);
+
+	if (ring)
+		ringWrite(ring, buf, len, rap);
+	hlsWrite(buf, len, rap);
+	recordWrite(buf, len);
+}
+
+/*
+ * Feeder is needed as long as it has a ring to fill, something
+ * to record or relay, or HLS clients.
+ */
+static int feederNeeded(const struct services_s *service) {
+	return service->timeshift > 0 || recordActive() > 0 ||
+		recordNeeded(service) || relayNeeded(service) ||
+		((service->hls > 0 || SERVICE_RING(service)) &&
+		 demanded(service, time(NULL)));
+}
+
+/*
+ * Main loop of the feeder process. Receive the service and write
+ * the payload into the ring and recordings.
+ */
+static void feederRun(struct services_s *service) {
+	struct ring_s *ring = NULL;
+	char *path;
+	int sock, r, n;
+	uint8_t buf[UDPBUFLEN];
+	uint8_t *payload, *packet;
+	int actualr, payloadlength, k;
+	uint16_t seqn, oldseqn = 0, notfirst = 0;
+	uint64_t size;
+	struct pollfd pfd;
+	time_t lastcheck = 0;
+
+	closeListeners();
+	signal(SIGCHLD, SIG_DFL);
+	/* Do not outlive the main process */
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+	if (service->timeshift > 0 || SERVICE_RING(service)) {
+		/* Clients read the live stream from it too */
+		n = service->timeshift > 0 ? service->timeshift * 60 :
+			FEEDER_LIVE_RING;
+		size = (uint64_t) n * service->bitrate * 1000 / 8;
+		path = ringPath(service);
+		ring = ringCreate(path, size, n, 0);
+		if (ring == NULL)
+			exit(RETVAL_RTP_FAILED);
+		logger(LOG_INFO, "Feeding %s into %s (%llu MB)\n",
+				service->url, path,
+				(unsigned long long) (size >> 20));
+		free(path);
+	}
+	if (service->hls > 0)
+		hlsStart(service);
+
+	if (SERVICE_PULLED(service)) {
+		sock = -1; /* connected in the loop, again when it fails */
+	} else {
+		if (serviceResolve(service) < 0)
+			exit(RETVAL_RTP_FAILED);
+		/* Feeders somebody watches join first */
+		sock = joinOpen(service, demanded(service, time(NULL)));
+		if (sock < 0)
+			exit(RETVAL_RTP_FAILED);
+		mcastPin(service);
+	}
+	pfd.events = POLLIN;
+
+	while (1) {
+		if (time(NULL) != lastcheck) {
+			lastcheck = time(NULL);
+			recordTick(service);
+			relayTick(service);
+			if (service->service_type == SERVICE_RTSP)
+				rtspTick(&sock, service);
+			if (!feederNeeded(service)) {
+				logger(LOG_INFO, "Feeder of %s not needed "
+					"anymore\n", service->url);
+				if (service->service_type == SERVICE_RTSP)
+					rtspClose(&sock);
+				exit(RETVAL_CLEAN);
+			}
+		}
+		if (sock < 0 && service->service_type == SERVICE_HTTP)
+			sock = upstreamConnect(service);
+		if (sock < 0 && service->service_type == SERVICE_RTSP)
+			sock = rtspConnect(service);
+		pfd.fd = sock;
+		if (SERVICE_PULLED(service)) {
+			r = poll(&pfd, 1, 1000);
+		} else {
+			n = joinWait();
+			r = poll(&pfd, 1, n < 1000 ? n : 1000);
+			if (r == 0)
+				joinRetry(sock);
+		}
+		if (r <= 0)
+			continue;
+
+		if (service->service_type == SERVICE_HTTP) {
+			actualr = upstreamRead(&sock, service, &payload);
+			if (actualr <= 0)
+				continue;
+			/* Relays get datagrams of the usual size */
+			for (k = 0; k < actualr; k += 7 * TS_PACKET_LEN)
+				relayWrite(payload + k, actualr - k < 7 *
+					TS_PACKET_LEN ? actualr - k :
+					7 * TS_PACKET_LEN);
+			relayFlush();
+			feederOutput(ring, payload, actualr);
+			continue;
+		}
+
+		/* Drain the socket, so the relay sends whole batches */
+		for (n = 0; n < FEEDER_BURST; n++) {
+			if (service->service_type == SERVICE_RTSP) {
+				actualr = rtspRead(&sock, service, &packet);
+				if (actualr <= 0)
+					break;
+			} else {
+				actualr = recv(sock, buf, sizeof(buf),
+						MSG_DONTWAIT);
+				packet = buf;
+				if (actualr > 0)
+					joinPacket();
+			}
+			if (actualr < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				exit(RETVAL_SOCK_READ_FAILED);
+			}
+			relayWrite(packet, actualr);
+			if (service->service_type == SERVICE_MUDP) {
+				feederOutput(ring, packet, actualr);
+				continue;
+			}
+
+			payloadlength = rtpPayload(packet, actualr, &payload,
+					&seqn);
+			if (payloadlength < 0)
+				continue;
+			if (notfirst && seqn == oldseqn)
+				continue;
+			oldseqn = seqn;
+			notfirst = 1;
+			feederOutput(ring, payload, payloadlength);
+		}
+		relayFlush();
+	}
+}
+
+static void feederStart(struct feeder_s *f) {
+	pid_t child;
+
+	child = fork();
+	if (child < 0) {
+		logger(LOG_ERROR, "Cannot fork feeder: %s\n", strerror(errno));
+		f->died = time(NULL);
+		return;
+	}
+	if (child == 0)
+		feederRun(f->service);
+	f->pid = child;
+}
+
+static struct feeder_s* feederAdd(struct services_s *service) {
+	struct feeder_s *f;
+
+	f = malloc(sizeof(struct feeder_s));
+	f->service = service;
+	f->pid = 0;
+	f->died = 0;
+	f->next = feeders;
+	feeders = f;
+	return f;
+}
+
+/*
+ * Take over the feeders of the image before an upgrade, by the URL
+ * of their service. Those of services gone from the configuration
+ * are stopped.
+ */
+static void feedersAdopt(void) {
+	struct services_s *servi;
+	struct feeder_s *f;
+	const char *args;
+	int pid, n;
+
+	while ((args = upgradeTake("feeder", NULL)) != NULL) {
+		if (sscanf(args, "%d %n", &pid, &n) < 1 || pid <= 0)
+			continue;
+		for (servi = services; servi; servi = servi->next) {
+			if (strcmp(servi->url, args + n) == 0)
+				break;
+		}
+		for (f = feeders; servi && f; f = f->next) {
+			if (f->service == servi)
+				break;
+		}
+		f = feederAdd(f == NULL ? servi : NULL);
+		f->pid = pid;
+		if (f->service) {
+			logger(LOG_INFO, "Took over feeder %d of %s\n", pid,
+					args + n);
+		} else {
+			logger(LOG_INFO, "Stopping feeder %d of %s\n", pid,
+					args + n);
+			kill(pid, SIGTERM);
+		}
+	}
+}
+
+/*
+ * Start feeders of all services with timeshift enabled.
+ * Called by the main process before any client is forked.
+ */
+void feedersStart(void) {
+	struct services_s *servi;
+	struct feeder_s *f;
+	uint32_t hash = 2166136261u;
+	const char *c;
+	char name[32];
+	int fresh;
+
+	/* The table is indexed by position, take over only the one of
+	 * the same list of services */
+	for (servi = services; servi; servi = servi->next) {
+		for (c = servi->url; *c; c++)
+			hash = (hash ^ (uint8_t) *c) * 16777619u;
+		hash = (hash ^ '\n') * 16777619u;
+		ndemand++;
+	}
+	if (ndemand > 0) {
+		snprintf(name, sizeof(name), "demand-%08x", hash);
+		demand = sharedMap(name, ndemand * sizeof(time_t), -1, &fresh);
+	}
+
+	feedersAdopt();
+	for (servi = services; servi; servi = servi->next) {
+		if (servi->timeshift == 0)
+			continue;
+		for (f = feeders; f; f = f->next) {
+			if (f->service == servi)
+				break;
+		}
+		if (f == NULL)
+			feederStart(feederAdd(servi));
+	}
+}
+
+/*
+ * Hand the running feeders over to the next image. Called by the main
+ * process right before the upgrade.
+ */
+void feedersUpgrade(void) {
+	struct feeder_s *f;
+
+	for (f = feeders; f; f = f->next) {
+		if (f->pid)
+			upgradeKeep(-1, "feeder %d %s", (int) f->pid,
+				f->service ? f->service->url : "");
+	}
+}
+
+/*
+ * Make sure the service has a running feeder.
+ * Called by the main process.
+ */
+void feederEnsure(struct services_s *service) {
+	struct feeder_s *f;
+
+	/* Files are read by their clients */
+	if (service->service_type == SERVICE_FILE)
+		return;
+	for (f = feeders; f; f = f->next) {
+		if (f->service == service)
+			break;
+	}
+	if (f == NULL)
+		f = feederAdd(service);
+	if (f->pid == 0 && time(NULL) - f->died >= FEEDER_RESTART) {
+		logger(LOG_INFO, "Starting feeder of %s\n", service->url);
+		feederStart(f);
+	}
+}
+
+/*
+ * Restart feeders which died and start the ones clients asked for.
+ * Called periodically by the main process.
+ */
+void feedersCheck(void) {
+	struct feeder_s *f;
+	struct services_s *servi;
+	time_t now = time(NULL);
+
+	for (servi = services; servi; servi = servi->next) {
+		if ((servi->hls > 0 || SERVICE_RING(servi)) &&
+		    servi->timeshift == 0 && demanded(servi, now))
+			feederEnsure(servi);
+	}
+
+	for (f = feeders; f; f = f->next) {
+		if (f->pid == 0 && f->service && f->service->timeshift > 0 &&
+		    now - f->died >= FEEDER_RESTART) {
+			logger(LOG_INFO, "Restarting feeder of %s\n",
+					f->service->url);
+			feederStart(f);
+		}
+	}
+	recordsCheck();
+	relaysCheck();
+}
+
+/*
+ * Check whether reaped child was a feeder.
+ * Called from SIGCHLD handler.
+ * @returns 1 if it was
+ */
+int feederReaped(pid_t pid) {
+	struct feeder_s *f, **prev;
+
+	for (prev = &feeders; (f = *prev) != NULL; prev = &f->next) {
+		if (f->pid != pid)
+			continue;
+		recordFeederDied(pid);
+		if (f->service == NULL) {
+			/* Stopped after an upgrade */
+			*prev = f->next;
+			free(f);
+			return 1;
+		}
+		f->pid = 0;
+		f->died = time(NULL);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,237 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * File sources.
+ *
+ * A FILE service plays a TS file to each of its clients as if it was
+ * live. The file goes out with sendfile() in stretches from one PCR of
+ * the PCR PID to the next, each released when the clock of the client
+ * reaches its PCR divided by the speed of the service. The clock is
+ * rebased at the start, on PCR discontinuities and on every loop. Files
+ * without PCR are paced at the bitrate of the service.
+ *
+ * The same playout shows the slate of a multicast service to its
+ * clients while the group is silent, instead of dropping them.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+/* Sent at once at most, when PCRs are far apart or not paced */
+#define FILE_CHUNK (TS_PACKET_LEN * 7 * 64)
+/* Rebase the clock when a PCR is this far from where it should be */
+#define FILE_RESYNC_US 1000000
+#define PCR_WRAP ((1ULL << 33) * 300)
+
+struct file_s {
+	int fd;
+	const uint8_t *map;
+	size_t start; /* first packet */
+	size_t end; /* after the last whole packet */
+	int pcrpid; /* -1 when there is no PCR */
+};
+
+static int64_t monoUs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int fileOpen(const char *path, struct file_s *f) {
+	struct stat st;
+	uint64_t pcr;
+	size_t i;
+
+	f->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (f->fd < 0 || fstat(f->fd, &st) < 0) {
+		logger(LOG_ERROR, "Cannot open %s: %s\n", path,
+				strerror(errno));
+		return -1;
+	}
+	f->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, f->fd, 0);
+	if (st.st_size < 2 * TS_PACKET_LEN || f->map == MAP_FAILED) {
+		logger(LOG_ERROR, "Cannot map %s\n", path);
+		close(f->fd);
+		return -1;
+	}
+	madvise((void *) f->map, st.st_size, MADV_SEQUENTIAL);
+
+	for (i = 0; i < TS_PACKET_LEN; i++) {
+		if (f->map[i] == TS_SYNC && f->map[i + TS_PACKET_LEN] == TS_SYNC)
+			break;
+	}
+	if (i == TS_PACKET_LEN) {
+		logger(LOG_ERROR, "%s is not a transport stream\n", path);
+		munmap((void *) f->map, st.st_size);
+		close(f->fd);
+		return -1;
+	}
+	f->start = i;
+	f->end = i + (st.st_size - i) / TS_PACKET_LEN * TS_PACKET_LEN;
+
+	f->pcrpid = -1;
+	for (i = f->start; i < f->end && f->pcrpid < 0; i += TS_PACKET_LEN) {
+		if (tsPCR(f->map + i, &pcr))
+			f->pcrpid = tsPID(f->map + i);
+	}
+	if (f->pcrpid < 0)
+		logger(LOG_INFO, "No PCR in %s, pacing by bitrate\n", path);
+	return 0;
+}
+
+static int hasPCR(const struct file_s *f, size_t pos, uint64_t *pcr) {
+	return f->pcrpid >= 0 && tsPID(f->map + pos) == f->pcrpid &&
+		tsPCR(f->map + pos, pcr);
+}
+
+/*
+ * Play the file to the client until its end, or for ever when looping.
+ * @param speed multiple of the PCR rate, 0 for as fast as possible
+ * @param sock stop as soon as it is readable, -1 for never
+ * @returns 1 when sock became readable, 0 at the end of the file
+ */
+static int play(int client, const struct file_s *f,
+		const struct services_s *service, int speed, int loop, int sock) {
+	struct pollfd pfd[2];
+	size_t pos = f->start, end;
+	uint64_t pcr, basepcr = 0, sent = 0;
+	int64_t basetime = 0, due, now;
+	int clockbase = 0;
+	off_t off;
+	ssize_t n;
+
+	pfd[0].fd = client;
+	pfd[0].events = POLLIN | POLLRDHUP;
+	pfd[1].fd = sock; /* ignored by poll() when negative */
+	pfd[1].events = POLLIN;
+
+	while (1) {
+		if (pos >= f->end) {
+			if (!loop)
+				return 0;
+			pos = f->start;
+			clockbase = 0;
+		}
+		/* The stretch up to the next PCR */
+		end = pos + TS_PACKET_LEN;
+		while (end < f->end && end - pos < FILE_CHUNK &&
+		    !hasPCR(f, end, &pcr))
+			end += TS_PACKET_LEN;
+
+		now = monoUs();
+		due = 0;
+		if (speed > 0 && f->pcrpid >= 0 &&
+		    hasPCR(f, pos, &pcr)) {
+			due = basetime + (int64_t) (((pcr - basepcr + PCR_WRAP) %
+				PCR_WRAP) / 27 / speed);
+			if (!clockbase || due > now + FILE_RESYNC_US ||
+			    due < now - FILE_RESYNC_US) {
+				/* Start, loop or discontinuity */
+				clockbase = 1;
+				basepcr = pcr;
+				basetime = now;
+				due = now;
+			}
+		} else if (speed > 0 && f->pcrpid < 0) {
+			if (!clockbase) {
+				clockbase = 1;
+				basetime = now;
+				sent = 0;
+			}
+			due = basetime + (int64_t) (sent * 8000 /
+				service->bitrate / speed);
+		}
+
+		/* Sleep until due, watching the client and the group */
+		do {
+			if (poll(pfd, 2, due > now ? (due - now + 999) / 1000 :
+					0) > 0) {
+				if (pfd[0].revents)
+					exit(RETVAL_WRITE_FAILED);
+				if (pfd[1].revents)
+					return 1;
+			}
+			now = monoUs();
+		} while (now < due);
+
+		shapeAcquire(end - pos);
+		off = pos;
+		while ((size_t) off < end) {
+			n = sendfile(client, f->fd, &off, end - off);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				exit(RETVAL_WRITE_FAILED);
+		}
+		zapSent(f->map + pos, end - pos);
+		statsPacket(end - pos);
+		statsQueue(client);
+		sent += end - pos;
+		pos = end;
+	}
+}
+
+/*
+ * Play the file of a FILE service and finish
+ */
+void fileStream(int client, const struct services_s *service) {
+	struct file_s f;
+
+	if (fileOpen(service->file, &f) < 0)
+		exit(RETVAL_RTP_FAILED);
+	zapMark(ZAP_JOINED);
+	play(client, &f, service, service->speed, service->loop, -1);
+	exit(RETVAL_CLEAN);
+}
+
+/*
+ * Play the slate of a multicast service until its group is readable
+ * again. Exits when there is no slate to play.
+ */
+void fileSlate(int client, const struct services_s *service, int sock) {
+	static struct file_s f;
+	static int opened = 0;
+
+	if (!opened && fileOpen(service->slate, &f) < 0)
+		exit(RETVAL_SOCK_READ_FAILED);
+	opened = 1;
+	logger(LOG_INFO, "Group of %s silent, playing %s\n", service->url,
+			service->slate);
+	play(client, &f, service, 1, 1, sock);
+	logger(LOG_INFO, "Group of %s is back\n", service->url);
+}
@@ -0,0 +1,330 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * HLS output.
+ *
+ * The feeder of a service cuts the received transport stream into
+ * segments at random access points and appends them to a ring of its
+ * own, in hlsdir. Each segment starts with the last seen PAT and PMT,
+ * so it can be decoded alone. The segment table lives in the extension
+ * area of the ring. Clients only map the ring and send playlists and
+ * segments out of it, so a segment is stored once for all viewers.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/sendfile.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#define min(a,b) ((a)<(b) ? (a):(b))
+
+/* Cut even without a random access point after this many targets */
+#define HLS_FORCE_CUT 3
+/* Segments kept in the ring besides the playlist window */
+#define HLS_SPARE 4
+/* At most this many PMTs are repeated at segment starts */
+#define HLS_MAX_PMT 8
+
+static struct ring_s *ring = NULL;
+static struct hls_index_s *idx = NULL;
+
+/* Writer state, used by the feeder only */
+static uint8_t pat[TS_PACKET_LEN];
+static uint8_t pmt[HLS_MAX_PMT][TS_PACKET_LEN];
+static int pmtpid[HLS_MAX_PMT];
+static int havepat, npmt;
+static int64_t segstart = -1, firstdata = -1;
+static uint64_t segpos;
+
+static char* hlsPath(const struct services_s *service) {
+	char *path;
+
+	if (asprintf(&path, "%s/" PACKAGE "-%s.hls",
+			conf_hlsdir, service->url) < 0)
+		return NULL;
+	return path;
+}
+
+/*
+ * Monotonic time in milliseconds, segment durations must not jump
+ */
+static int64_t monoMs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Create the HLS ring of the service. Called by the feeder.
+ */
+void hlsStart(const struct services_s *service) {
+	char *path;
+	uint64_t size;
+	uint32_t seconds;
+
+	seconds = (service->hlswindow + HLS_SPARE) * service->hls;
+	/* Twice the expected size, bitrate is only a guess */
+	size = (uint64_t) seconds * service->bitrate * 1000 / 8 * 2;
+	path = hlsPath(service);
+	if (path == NULL)
+		return;
+	ring = ringCreate(path, size, seconds, sizeof(struct hls_index_s));
+	if (ring == NULL) {
+		free(path);
+		return;
+	}
+	idx = ringExt(ring);
+	idx->target = service->hls;
+	idx->window = service->hlswindow;
+	logger(LOG_INFO, "HLS of %s into %s (%llu MB)\n", service->url, path,
+			(unsigned long long) (size >> 20));
+	free(path);
+}
+
+/*
+ * Remember PAT and PMT packets, so they can be repeated at the start
+ * of each segment.
+ */
+static void hlsCachePSI(const uint8_t *buf, size_t len) {
+	size_t i;
+	int pid, j, pids[HLS_MAX_PMT], n;
+
+	for (i = 0; i + TS_PACKET_LEN <= len; i += TS_PACKET_LEN) {
+		if (buf[i] != TS_SYNC || !(buf[i+1] & 0x40))
+			continue;
+		pid = tsPID(buf + i);
+		if (pid == 0) {
+			n = tsPMTPids(buf + i, pids, HLS_MAX_PMT);
+			if (n < 0)
+				continue;
+			memcpy(pat, buf + i, TS_PACKET_LEN);
+			havepat = 1;
+			if (n != npmt || memcmp(pids, pmtpid, n * sizeof(int))) {
+				memcpy(pmtpid, pids, n * sizeof(int));
+				for (j = 0; j < HLS_MAX_PMT; j++)
+					pmt[j][0] = 0;
+				npmt = n;
+			}
+			continue;
+		}
+		for (j = 0; j < npmt; j++) {
+			if (pmtpid[j] == pid) {
+				memcpy(pmt[j], buf + i, TS_PACKET_LEN);
+				break;
+			}
+		}
+	}
+}
+
+static void hlsOpenSegment(int64_t now) {
+	int j;
+
+	segpos = ringHead(ring);
+	segstart = now;
+	if (!havepat)
+		return;
+	ringWrite(ring, pat, TS_PACKET_LEN, 0);
+	for (j = 0; j < npmt; j++) {
+		if (pmt[j][0] == TS_SYNC)
+			ringWrite(ring, pmt[j], TS_PACKET_LEN, -1);
+	}
+}
+
+static void hlsCloseSegment(int64_t now) {
+	struct hls_segment_s *seg;
+	uint64_t head = ringHead(ring);
+
+	if (head == segpos)
+		return;
+	seg = &idx->seg[idx->seq % HLS_SEGMENTS];
+	seg->pos = segpos;
+	seg->len = head - segpos;
+	seg->duration = now - segstart;
+	__atomic_store_n(&idx->seq, idx->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Append received payload to the current segment, cutting a new one
+ * at a random access point once the target duration is reached.
+ * Called by the feeder.
+ *
+ * @param rap offset of a random access point in buf or -1
+ */
+void hlsWrite(const uint8_t *buf, size_t len, int rap) {
+	int64_t now, elapsed;
+	size_t cut;
+
+	if (ring == NULL)
+		return;
+	hlsCachePSI(buf, len);
+	now = monoMs();
+
+	if (segstart < 0) {
+		/* Wait for the first random access point, unless the
+		 * stream does not seem to signal them at all */
+		if (firstdata < 0)
+			firstdata = now;
+		if (rap < 0 && now - firstdata <
+				HLS_FORCE_CUT * 1000 * idx->target)
+			return;
+		cut = rap < 0 ? 0 : rap;
+		hlsOpenSegment(now);
+		ringWrite(ring, buf + cut, len - cut, 0);
+		return;
+	}
+
+	elapsed = now - segstart;
+	if ((rap >= 0 && elapsed >= 1000 * idx->target) ||
+			elapsed >= HLS_FORCE_CUT * 1000 * idx->target) {
+		cut = rap < 0 ? 0 : rap;
+		if (cut > 0)
+			ringWrite(ring, buf, cut, -1);
+		hlsCloseSegment(now);
+		hlsOpenSegment(now);
+		ringWrite(ring, buf + cut, len - cut, 0);
+		return;
+	}
+	ringWrite(ring, buf, len, rap);
+}
+
+/*
+ * Open the HLS ring of the service, waiting for the feeder to
+ * produce the first segment. Called by clients.
+ *
+ * @returns 0 when ready, -1 on timeout
+ */
+int hlsOpen(const struct services_s *service) {
+	char *path;
+	int64_t deadline;
+
+	path = hlsPath(service);
+	if (path == NULL)
+		return -1;
+	/* Feeder may be just started by the main process */
+	deadline = monoMs() + (HLS_FORCE_CUT * service->hls + 2) * 1000;
+	while (1) {
+		ring = ringOpen(path);
+		if (ring) {
+			idx = ringExt(ring);
+			if (idx && kill(ring->hdr->writer, 0) == 0 &&
+			    __atomic_load_n(&idx->seq, __ATOMIC_ACQUIRE) > 0)
+				break;
+			ringClose(ring);
+			ring = NULL;
+		}
+		if (monoMs() > deadline) {
+			logger(LOG_ERROR, "HLS of %s not available\n",
+					service->url);
+			free(path);
+			return -1;
+		}
+		usleep(200000);
+	}
+	free(path);
+	return 0;
+}
+
+/*
+ * Write the live playlist of the opened ring
+ */
+void hlsPlaylist(FILE *f) {
+	uint64_t seq, first, i, tail;
+	const struct hls_segment_s *seg;
+	uint32_t target = idx->target;
+
+	seq = __atomic_load_n(&idx->seq, __ATOMIC_ACQUIRE);
+	first = seq > idx->window ? seq - idx->window : 0;
+	tail = ringTail(ring);
+	while (first < seq && idx->seg[first % HLS_SEGMENTS].pos < tail)
+		first++;
+	for (i = first; i < seq; i++) {
+		seg = &idx->seg[i % HLS_SEGMENTS];
+		if ((seg->duration + 999) / 1000 > target)
+			target = (seg->duration + 999) / 1000;
+	}
+
+	fprintf(f, "#EXTM3U\n"
+		"#EXT-X-VERSION:3\n"
+		"#EXT-X-TARGETDURATION:%u\n"
+		"#EXT-X-MEDIA-SEQUENCE:%llu\n",
+		target, (unsigned long long) first);
+	for (i = first; i < seq; i++) {
+		seg = &idx->seg[i % HLS_SEGMENTS];
+		fprintf(f, "#EXTINF:%u.%03u,\n%llu.ts\n",
+			seg->duration / 1000, seg->duration % 1000,
+			(unsigned long long) i);
+	}
+}
+
+/*
+ * Find a segment in the opened ring.
+ * @returns 0 if the segment is available, -1 otherwise
+ */
+int hlsSegment(uint64_t seq, uint64_t *pos, size_t *len) {
+	uint64_t cur = __atomic_load_n(&idx->seq, __ATOMIC_ACQUIRE);
+	const struct hls_segment_s *seg;
+
+	/* The oldest entries may be being rewritten */
+	if (seq >= cur || seq + HLS_SEGMENTS - 1 < cur)
+		return -1;
+	seg = &idx->seg[seq % HLS_SEGMENTS];
+	*pos = seg->pos;
+	*len = seg->len;
+	if (*pos < ringTail(ring))
+		return -1;
+	return 0;
+}
+
+/*
+ * Send a segment straight from the page cache
+ */
+void hlsSend(int client, uint64_t pos, size_t len) {
+	uint64_t size = ring->hdr->size;
+	off_t off;
+	size_t chunk;
+	ssize_t n;
+
+	while (len > 0) {
+		chunk = min(len, size - pos % size);
+		shapeAcquire(chunk);
+		off = ring->hdr->dataoff + pos % size;
+		n = sendfile(client, ring->fd, &off, chunk);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			exit(RETVAL_WRITE_FAILED);
+		pos += n;
+		len -= n;
+		statsPacket(n);
+	}
+}
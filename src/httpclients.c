@@ -30,6 +30,9 @@
 #include <signal.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <net/if.h>
+#include <ctype.h>
+#include <time.h>
 
 #include "rtp2httpd.h"
 
@@ -37,9 +40,11 @@
 #include "config.h"
 #endif /* HAVE_CONFIG_H */
 
-#define BUFLEN 50
+#define BUFLEN 1024
 #define UDPBUFLEN 2000
 
+#define max(a,b) ((a)>(b) ? (a):(b))
+
 static const char unimplemented[] =
 "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
 "<html><head>\r\n"
@@ -74,6 +79,17 @@ static const char serviceNotFound[] =
 "<address>Server " PACKAGE " version " VERSION "</address>\r\n"
 "</body></html>\r\n";
 
+static const char rangeNotSatisfiable[] =
+"<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
+"<html><head>\r\n"
+"<title>416 Range Not Satisfiable</title>\r\n"
+"</head><body>\r\n"
+"<h1>416 Range Not Satisfiable</h1>\r\n"
+"<p>Sorry, this part of the stream is not available.</p>\r\n"
+"<hr>\r\n"
+"<address>Server " PACKAGE " version " VERSION "</address>\r\n"
+"</body></html>\r\n";
+
 static const char serviceUnavailable[] =
 "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
 "<html><head>\r\n"
@@ -92,6 +108,9 @@ static const char *responseCodes[] = {
 	"HTTP/1.1 400 Bad Request\r\n",		/* 2 */
 	"HTTP/1.1 501 Not Implemented\r\n",	/* 3 */
 	"HTTP/1.1 503 Service Unavailable\r\n",	/* 4 */
+	"HTTP/1.1 206 Partial Content\r\n",	/* 5 */
+	"HTTP/1.1 416 Range Not Satisfiable\r\n",	/* 6 */
+	"HTTP/1.1 302 Found\r\n",		/* 7 */
 };
 
 #define STATUS_200 0
@@ -99,6 +118,9 @@ static const char *responseCodes[] = {
 #define STATUS_400 2
 #define STATUS_501 3
 #define STATUS_503 4
+#define STATUS_206 5
+#define STATUS_416 6
+#define STATUS_302 7
 
 static const char *contentTypes[] = {
 	"Content-Type: application/octet-stream\r\n",	/* 0 */
@@ -106,6 +128,9 @@ static const char *contentTypes[] = {
 	"Content-Type: text/html; charset=utf-8\r\n",	/* 2 */
 	"Content-Type: video/mpeg\r\n",		/* 3 */
 	"Content-Type: audio/mpeg\r\n",		/* 4 */
+	"Content-Type: text/plain; version=0.0.4\r\n",	/* 5 */
+	"Content-Type: application/vnd.apple.mpegurl\r\n",	/* 6 */
+	"Content-Type: video/mp2t\r\n",		/* 7 */
 };
 
 #define CONTENT_OSTREAM 0
@@ -113,6 +138,9 @@ static const char *contentTypes[] = {
 #define CONTENT_HTMLUTF 2
 #define CONTENT_MPEGV 3
 #define CONTENT_MPEGA 4
+#define CONTENT_TEXT 5
+#define CONTENT_M3U8 6
+#define CONTENT_MP2T 7
 
 static const char staticHeaders[] =
 "Server: " PACKAGE "/" VERSION "\r\n"
@@ -145,16 +173,32 @@ static void writeToClient(int s,const uint8_t *buf, const size_t buflen) {
  * @params s socket
  * @params status index to responseCodes[] array
  * @params type index to contentTypes[] array
+ * @params extra additional CRLF terminated header lines or NULL
  */
-static void headers(int s, int status, int type) {
+static void headers(int s, int status, int type, const char *extra) {
 	writeToClient(s, (uint8_t*) responseCodes[status],
 			strlen(responseCodes[status]));
 	writeToClient(s, (uint8_t*) contentTypes[type],
 			strlen(contentTypes[type]));
+	if (extra)
+		writeToClient(s, (uint8_t*) extra, strlen(extra));
 	writeToClient(s, (uint8_t*) staticHeaders,
 			sizeof(staticHeaders)-1);
 }
 
+/*
+ * Format a complete 503 response asking the client to retry later,
+ * for the main process to send without forking
+ * @returns length of the response
+ */
+int overloadResponse(char *buf, size_t len, int retry) {
+	int n;
+
+	n = snprintf(buf, len, "%s%sRetry-After: %d\r\nConnection: close\r\n%s%s",
+		responseCodes[STATUS_503], contentTypes[CONTENT_HTML], retry,
+		staticHeaders, serviceUnavailable);
+	return n < (int) len ? n : (int) len - 1;
+}
 
 void sigpipe_handler(int signum) {
 	exit(RETVAL_WRITE_FAILED);
@@ -283,6 +327,7 @@ static struct services_s* udpxy_parse(char* url) {
 	res_ai.ai_canonname = NULL;
 	res_ai.ai_next = NULL;
 	serv.addr = &res_ai;
+	freeaddrinfo(res);
 
 	if (strcmp(msrc, "") != 0 && msrc != NULL) {
 		/* Copy result into statically allocated structs */
@@ -292,149 +337,342 @@ static struct services_s* udpxy_parse(char* url) {
 		msrc_res_ai.ai_canonname = NULL;
 		msrc_res_ai.ai_next = NULL;
 		serv.msrc_addr = &msrc_res_ai;
+		freeaddrinfo(msrc_res);
 	}
 
 	serv.msrc = strdup(msrc);
+	serv.bitrate = 8000;
+	serv.weight = 1;
 
 	return &serv;
 }
 
 
+/*
+ * Find a configured service by its name
+ */
+struct services_s* findService(const char *name) {
+	struct services_s *servi;
+
+	for (servi = services; servi; servi=servi->next) {
+		if (strcmp(name, servi->url) == 0)
+			break;
+	}
+	return servi;
+}
+
+
 static void startRTPstream(int client, struct services_s *service){
-	int sock, level;
+	int sock;
 	int r;
-	struct group_req gr;
-	struct group_source_req gsr;
-	uint8_t buf[UDPBUFLEN];
+	uint8_t stackbuf[UDPBUFLEN];
+	uint8_t *buf = stackbuf, *payload;
+	uint32_t slab = ARENA_NONE; /* of buf when paced */
 	int actualr;
-	uint16_t seqn, oldseqn, notfirst=0;
-	int payloadstart, payloadlength;
+	uint16_t seqn, oldseqn=0, notfirst=0;
+	int16_t seqd;
+	int payloadlength;
 	fd_set rfds;
 	struct timeval timeout;
-	int on = 1;
-
-	sock = socket(service->addr->ai_family, service->addr->ai_socktype,
-			service->addr->ai_protocol);
-        r = setsockopt(sock, SOL_SOCKET,
-                        SO_REUSEADDR, &on, sizeof(on));
-        if (r) {
-                logger(LOG_ERROR, "SO_REUSEADDR "
-                "failed: %s\n", strerror(errno));
-        }
-
-	r = bind(sock,(struct sockaddr *) service->addr->ai_addr, service->addr->ai_addrlen);
-	if (r) {
-		logger(LOG_ERROR, "Cannot bind: %s\n",
-				strerror(errno));
-		exit(RETVAL_RTP_FAILED);
-	}
+	time_t lastdata = time(NULL);
+	int next = -1, wait;
 
-	memcpy(&(gr.gr_group), service->addr->ai_addr, service->addr->ai_addrlen);
-
-	switch (service->addr->ai_family) {
-		case AF_INET:
-			level = SOL_IP;
-			gr.gr_interface = 0;
-			break;
-
-		case AF_INET6:
-			level = SOL_IPV6;
-			gr.gr_interface = ((const struct sockaddr_in6 *)
-				(service->addr->ai_addr))->sin6_scope_id;
-			break;
-		default:
-			logger(LOG_ERROR, "Address family don't support mcast.\n");
-			exit(RETVAL_SOCK_READ_FAILED);
-	}
-
-	if (strcmp(service->msrc, "") != 0 && service->msrc != NULL) {
-		gsr.gsr_group = gr.gr_group;
-		gsr.gsr_interface = gr.gr_interface;
-		memcpy(&(gsr.gsr_source), service->msrc_addr->ai_addr, service->msrc_addr->ai_addrlen);
-		r = setsockopt(sock, level,
-			MCAST_JOIN_SOURCE_GROUP, &gsr, sizeof(gsr));
-	} else {
-		r = setsockopt(sock, level,
-			MCAST_JOIN_GROUP, &gr, sizeof(gr));
-	}
-
-	if (r) {
-		logger(LOG_ERROR, "Cannot join mcast group: %s\n",
-				strerror(errno));
+	sock = joinOpen(service, 1);
+	if (sock < 0)
 		exit(RETVAL_RTP_FAILED);
-	}
-
-
+	mcastPin(service);
+	zapMark(ZAP_JOINED);
+	if (service->pace > 0)
+		paceInit(client, service->pace);
+	else
+		traceStart(sock, client);
 
 	while(1) {
 		FD_ZERO(&rfds);
 		FD_SET(sock, &rfds);
 		FD_SET(client, &rfds); /* Will be set if connection to client lost.*/
-		timeout.tv_sec = 5;
-		timeout.tv_usec = 0;
+		/* Wake up to join again while the group is silent */
+		wait = joinWait();
+		if (next >= 0 && next < wait) /* or for next paced release */
+			wait = next;
+		timeout.tv_sec = wait / 1000;
+		timeout.tv_usec = (wait % 1000) * 1000;
 
 		/* We use select to get rid of recv stuck if
 		 * multicast group is unoperated.
 		 */
-		r=select(sock+1, &rfds, NULL, NULL, &timeout);
+		r=select(max(sock, client)+1, &rfds, NULL, NULL, &timeout);
 		if (r<0 && errno==EINTR)
 			continue;
-		if (r==0) { /* timeout reached */
-			exit(RETVAL_SOCK_READ_FAILED);
+		if (r == 0)
+			joinRetry(sock);
+		if (r==0 && time(NULL) - lastdata >= 5) { /* timeout reached */
+			if (service->slate == NULL)
+				exit(RETVAL_SOCK_READ_FAILED);
+			fileSlate(client, service, sock);
+			lastdata = time(NULL);
+			notfirst = 0;
+			continue;
 		}
-		if (FD_ISSET(client, &rfds)) { /* client written stg, or conn. lost	 */
+		if (r > 0 && FD_ISSET(client, &rfds) && /* client written stg, or conn. lost	 */
+				!traceClient(client)) { /* not just TX timestamps */
 			exit(RETVAL_WRITE_FAILED);
 		}
+		if (paceEnabled())
+			next = paceRun(client);
+		if (r <= 0 || !FD_ISSET(sock, &rfds))
+			continue;
+		lastdata = time(NULL);
 
-		actualr = recv(sock, buf, sizeof(buf), 0);
+		/* Paced datagrams are queued in place, without a copy */
+		if (paceEnabled() && slab == ARENA_NONE)
+			buf = paceBuffer(client, &slab);
+		actualr = traceRecv(sock, buf, UDPBUFLEN);
 		if (actualr < 0){
 			exit(RETVAL_SOCK_READ_FAILED);
 		}
-		if (service->service_type == SERVICE_MUDP) {
-			writeToClient(client, buf, sizeof(buf));
+		zapMark(ZAP_FIRST_PACKET);
+		joinPacket();
+		if (service->service_type == SERVICE_MUDP && paceEnabled()) {
+			paceQueue(client, slab, buf, actualr, 0, 0);
+			slab = ARENA_NONE;
+			next = paceRun(client);
 			continue;
 		}
-
-		if (actualr < 12 || (buf[0]&0xC0) != 0x80) {
-			/*malformed RTP/UDP/IP packet*/
-			logger(LOG_DEBUG,"Malformed RTP packet received\n");
+		if (service->service_type == SERVICE_MUDP) {
+			shapeAcquire(actualr);
+			if (!traceSend(client, buf, actualr))
+				writeToClient(client, buf, actualr);
+			zapSent(buf, actualr);
+			statsPacket(actualr);
+			statsQueue(client);
 			continue;
 		}
 
-		payloadstart = 12; /* basic RTP header length */
-		payloadstart += (buf[0]&0x0F) * 4; /*CRSC headers*/
-		if (buf[0]&0x10) { /*Extension header*/
-			payloadstart += 4 + 4*ntohs(*((uint16_t *)(buf+payloadstart+2)));
-		}
-		payloadlength = actualr - payloadstart;
-		if (buf[0]&0x20) { /*Padding*/
-			payloadlength -= buf[actualr];
-			/*last octet indicate padding length*/
-		}
-		if(payloadlength<0) {
+		payloadlength = rtpPayload(buf, actualr, &payload, &seqn);
+		if (payloadlength < 0) {
 			logger(LOG_DEBUG,"Malformed RTP packet received\n");
 			continue;
 		}
-		seqn = ntohs(*((uint16_t *)(buf+2)));
-		if (notfirst && seqn==oldseqn) {
+		seqd = (int16_t) (seqn - oldseqn);
+		if (notfirst && seqd == 0) {
 			logger(LOG_DEBUG,"Duplicated RTP packet "
 				"received (seqn %d)\n", seqn);
 			continue;
 		}
-		if (notfirst && (seqn != ((oldseqn+1)&0xFFFF))) {
+		if (notfirst && seqd != 1) {
 			logger(LOG_DEBUG,"Congestion - expected %d, "
 				"received %d\n", (oldseqn+1)&0xFFFF, seqn);
+			/* Only gaps ahead are losses, late packets are not */
+			if (seqd > 1)
+				statsDrops(seqd - 1);
 		}
-		oldseqn=seqn;
+		if (!notfirst || seqd > 0)
+			oldseqn=seqn;
 		notfirst=1;
 
-		writeToClient(client, buf+payloadstart, payloadlength);
+		if (paceEnabled()) {
+			paceQueue(client, slab, payload, payloadlength,
+					rtpTimestamp(buf), 1);
+			slab = ARENA_NONE;
+			next = paceRun(client);
+			continue;
+		}
+		shapeAcquire(payloadlength);
+		if (!traceSend(client, payload, payloadlength))
+			writeToClient(client, payload, payloadlength);
+		zapSent(payload, payloadlength);
+		statsPacket(payloadlength);
+		statsQueue(client);
 	}
 
 	/*SHOULD NEVER REACH THIS*/
 	return;
 }
 
+/*
+ * Check whether the URL path is equal to given one, ignoring query string
+ */
+static int isPath(const char *url, const char *path) {
+	size_t len = strlen(path);
+	return strncmp(url, path, len) == 0 &&
+		(url[len] == '\0' || url[len] == '?');
+}
+
+/*
+ * Find a parameter in URL query string.
+ * @returns newly allocated value or NULL if not present
+ */
+char* queryParam(const char *query, const char *name) {
+	size_t len = strlen(name);
+	const char *p = query, *end;
+
+	while (p && *p) {
+		if (strncmp(p, name, len) == 0 && p[len] == '=') {
+			p += len + 1;
+			end = strchrnul(p, '&');
+			return strndup(p, end - p);
+		}
+		p = index(p, '&');
+		if (p)
+			p++;
+	}
+	return NULL;
+}
+
+/*
+ * Send the status page or Prometheus metrics and finish
+ */
+static void sendStatus(int s, int numfields, int prometheus) {
+	char *page = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	f = open_memstream(&page, &len);
+	if (f == NULL)
+		exit(RETVAL_WRITE_FAILED);
+	if (prometheus)
+		statsPrometheus(f);
+	else
+		statsHTML(f);
+	fclose(f);
+
+	if (numfields == 3)
+		headers(s, STATUS_200, prometheus ? CONTENT_TEXT : CONTENT_HTML, NULL);
+	writeToClient(s, (uint8_t*) page, len);
+	free(page);
+	exit(RETVAL_CLEAN);
+}
+
+/*
+ * Handle recording control request and finish
+ */
+static void sendRecordControl(int s, int numfields, const char *query) {
+	char *page = NULL;
+	size_t len = 0;
+	FILE *f;
+	int r;
+
+	f = open_memstream(&page, &len);
+	if (f == NULL)
+		exit(RETVAL_WRITE_FAILED);
+	r = recordControl(query, f);
+	fclose(f);
+
+	if (r < 0) {
+		if (numfields == 3)
+			headers(s, STATUS_400, CONTENT_HTML, NULL);
+		writeToClient(s, (uint8_t*) badrequest, sizeof(badrequest)-1);
+		exit(RETVAL_BAD_REQUEST);
+	}
+	if (numfields == 3)
+		headers(s, STATUS_200, CONTENT_TEXT, NULL);
+	writeToClient(s, (uint8_t*) page, len);
+	free(page);
+	exit(RETVAL_CLEAN);
+}
+
+/*
+ * Handle relay control request and finish
+ */
+static void sendRelayControl(int s, int numfields, const char *query) {
+	char *page = NULL;
+	size_t len = 0;
+	FILE *f;
+	int r;
+
+	f = open_memstream(&page, &len);
+	if (f == NULL)
+		exit(RETVAL_WRITE_FAILED);
+	r = relayControl(query, f);
+	fclose(f);
+
+	if (r < 0) {
+		if (numfields == 3)
+			headers(s, STATUS_400, CONTENT_HTML, NULL);
+		writeToClient(s, (uint8_t*) badrequest, sizeof(badrequest)-1);
+		exit(RETVAL_BAD_REQUEST);
+	}
+	if (numfields == 3)
+		headers(s, STATUS_200, CONTENT_TEXT, NULL);
+	writeToClient(s, (uint8_t*) page, len);
+	free(page);
+	exit(RETVAL_CLEAN);
+}
+
+/*
+ * Send HLS playlist or segment and finish
+ * @params path part of URL after /hls/, i.e. <service>/<file>
+ */
+static void sendHLS(int s, int numfields, const char *path) {
+	struct services_s *servi;
+	const char *file;
+	char *page = NULL;
+	size_t len = 0;
+	unsigned long long seq;
+	uint64_t pos;
+	char extra[128];
+	FILE *f;
+
+	file = index(path, '/');
+	for (servi = services; servi && file; servi = servi->next) {
+		if (servi->hls > 0 && strlen(servi->url) == file - path &&
+		    strncmp(path, servi->url, file - path) == 0)
+			break;
+	}
+	if (servi == NULL) {
+		if (numfields == 3)
+			headers(s, STATUS_404, CONTENT_HTML, NULL);
+		writeToClient(s, (uint8_t*) serviceNotFound, sizeof(serviceNotFound)-1);
+		exit(RETVAL_CLEAN);
+	}
+	file++;
+
+	feederDemand(servi);
+	if (hlsOpen(servi) < 0) {
+		if (numfields == 3)
+			headers(s, STATUS_503, CONTENT_HTML, NULL);
+		writeToClient(s, (uint8_t*) serviceUnavailable, sizeof(serviceUnavailable)-1);
+		exit(RETVAL_CLEAN);
+	}
+
+	if (strcmp(file, "index.m3u8") == 0) {
+		f = open_memstream(&page, &len);
+		if (f == NULL)
+			exit(RETVAL_WRITE_FAILED);
+		hlsPlaylist(f);
+		fclose(f);
+		if (numfields == 3) {
+			snprintf(extra, sizeof(extra),
+				"Content-Length: %zu\r\n"
+				"Cache-Control: no-cache\r\n", len);
+			headers(s, STATUS_200, CONTENT_M3U8, extra);
+		}
+		writeToClient(s, (uint8_t*) page, len);
+		free(page);
+		exit(RETVAL_CLEAN);
+	}
+
+	if (sscanf(file, "%llu.ts", &seq) != 1 ||
+	    hlsSegment(seq, &pos, &len) < 0) {
+		if (numfields == 3)
+			headers(s, STATUS_404, CONTENT_HTML, NULL);
+		writeToClient(s, (uint8_t*) serviceNotFound, sizeof(serviceNotFound)-1);
+		exit(RETVAL_CLEAN);
+	}
+	if (numfields == 3) {
+		/* Segments never change, let them be cached */
+		snprintf(extra, sizeof(extra),
+			"Content-Length: %zu\r\n"
+			"Cache-Control: max-age=%d\r\n",
+			len, servi->hls * servi->hlswindow);
+		headers(s, STATUS_200, CONTENT_MP2T, extra);
+	}
+	shapeStart(s, servi->weight);
+	hlsSend(s, pos, len);
+	exit(RETVAL_CLEAN);
+}
+
 /*
  * Service for connected client.
  * Run in forked thread.
@@ -446,11 +684,19 @@ void clientService(int s) {
 	char *method, *url, httpver;
 	char *hostname;
 	char *urlfrom;
+	char *statsurl;
+	char *query, *param;
+	const char *location;
 	struct services_s *servi;
+	long offset = 0;
+	long long range = -1;
+	uint64_t pos;
+	int configured;
+	char extra[1100]; /* fits a Location */
 
 	signal(SIGPIPE, &sigpipe_handler);
 
-	client = fdopen(s, "r");
+	client = tlsActive() ? tlsRequest() : fdopen(s, "r");
 	/*read only one line*/
 	if (fgets(buf, sizeof(buf), client) == NULL) {
 		exit(RETVAL_READ_FAILED);
@@ -470,51 +716,170 @@ void clientService(int s) {
 					hostname = strndup(buf+6, hostname-buf-6);
 					logger(LOG_DEBUG, "Host header: %s\n", hostname);
 				}
+			if (strncasecmp("Range: bytes=", buf, 13) == 0 &&
+			    isdigit(buf[13])) {
+				range = strtoll(buf+13, NULL, 10);
+				logger(LOG_DEBUG, "Range header: %lld\n", range);
+			}
 			}
 		}
 
+	zapMark(ZAP_REQUEST);
+
 	if (strcmp(method, "GET") != 0) {
 		if (numfields == 3)
-			headers(s, STATUS_501, CONTENT_HTML);
+			headers(s, STATUS_501, CONTENT_HTML, NULL);
 		writeToClient(s, (uint8_t*) unimplemented, sizeof(unimplemented)-1);
 		exit(RETVAL_UNKNOWN_METHOD);
 	}
 	free(method); method=NULL;
 
+	query = index(url, '?');
+	if (query) {
+		*query++ = '\0';
+		query = strdupa(query);
+	}
+
 	urlfrom = rindex(url, '/');
 	if (urlfrom == NULL || (conf_hostname && strcasecmp(conf_hostname, hostname)!=0)) {
 		if (numfields == 3)
-			headers(s, STATUS_400, CONTENT_HTML);
+			headers(s, STATUS_400, CONTENT_HTML, NULL);
 		writeToClient(s, (uint8_t*) badrequest, sizeof(badrequest)-1);
 		exit(RETVAL_BAD_REQUEST);
 	}
 
-	for (servi = services; servi; servi=servi->next) {
-		if (strcmp(urlfrom+1, servi->url) == 0)
-			break;
-	}
-
-	if (servi == NULL && conf_udpxy)
+	servi = findService(urlfrom+1);
+	configured = servi != NULL;
+
+	if (servi == NULL && isPath(url, "/status"))
+		sendStatus(s, numfields, 0);
+	if (servi == NULL && isPath(url, "/metrics"))
+		sendStatus(s, numfields, 1);
+	if (servi == NULL && isPath(url, "/record"))
+		sendRecordControl(s, numfields, query);
+	if (servi == NULL && isPath(url, "/relay"))
+		sendRelayControl(s, numfields, query);
+	if (servi == NULL && strncmp(url, "/hls/", 5) == 0)
+		sendHLS(s, numfields, url+5);
+
+	statsurl = strdupa(url);
+	if (servi == NULL && conf_udpxy) {
 		servi = udpxy_parse(url);
+		/* Interface to join on, as in ?if=eth1 */
+		if (servi && query &&
+		    (param = queryParam(query, "if")) != NULL) {
+			if (if_nametoindex(param) == 0) {
+				if (numfields == 3)
+					headers(s, STATUS_400, CONTENT_HTML, NULL);
+				writeToClient(s, (uint8_t*) badrequest,
+						sizeof(badrequest)-1);
+				exit(RETVAL_BAD_REQUEST);
+			}
+			servi->ifname = param;
+		}
+	}
 
 	free(url); url=NULL;
 
 	if (servi == NULL) {
 		if (numfields == 3)
-			headers(s, STATUS_404, CONTENT_HTML);
+			headers(s, STATUS_404, CONTENT_HTML, NULL);
 		writeToClient(s, (uint8_t*) serviceNotFound, sizeof(serviceNotFound)-1);
 		exit(RETVAL_CLEAN);
 	}
+	zapMark(ZAP_RESOLVED);
 
-	if (clientcount > conf_maxclients) { /*Too much clients*/
+	location = clusterRedirect(rindex(statsurl, '/') + 1, statsurl, query);
+	if (location) {
+		logger(LOG_DEBUG, "Redirecting to %s\n", location);
+		snprintf(extra, sizeof(extra), "Location: %s\r\n", location);
 		if (numfields == 3)
-			headers(s, STATUS_503, CONTENT_HTML);
-		writeToClient(s, (uint8_t*) serviceUnavailable, sizeof(serviceUnavailable)-1);
+			headers(s, STATUS_302, CONTENT_HTML, extra);
+		exit(RETVAL_CLEAN);
+	}
+
+	/* Unless the main process has looked the name up already */
+	if (serviceResolve(servi) < 0) {
+		if (numfields == 3)
+			headers(s, STATUS_503, CONTENT_HTML, NULL);
+		writeToClient(s, (uint8_t*) serviceUnavailable,
+				sizeof(serviceUnavailable)-1);
 		exit(RETVAL_CLEAN);
 	}
 
+	statsSetService(statsurl, servi);
+	zapService(statsurl);
+	shapeStart(s, servi->weight);
+
+	if (servi->timeshift > 0 && query &&
+	    (param = queryParam(query, "offset")) != NULL) {
+		offset = atol(param);
+		free(param);
+		if (offset > 0)
+			offset = -offset;
+	}
+	if (servi->timeshift > 0 && (offset < 0 || range >= 0)) {
+		switch (timeshiftOpen(servi, offset, range, &pos)) {
+			case 0:
+				if (numfields == 3 && range >= 0) {
+					/* Stream keeps growing, report what
+					 * is available right now */
+					snprintf(extra, sizeof(extra),
+						"Content-Range: bytes %llu-%llu/*\r\n",
+						(unsigned long long) pos,
+						(unsigned long long) (timeshiftLive() > pos ?
+							timeshiftLive()-1 : pos));
+					headers(s, STATUS_206, CONTENT_OSTREAM, extra);
+				} else if (numfields == 3) {
+					snprintf(extra, sizeof(extra),
+						"X-Stream-Position: %llu\r\n",
+						(unsigned long long) pos);
+					headers(s, STATUS_200, CONTENT_OSTREAM, extra);
+				}
+				timeshiftStream(s, pos);
+				/* SHOULD NEVER REACH HERE */
+				exit(RETVAL_CLEAN);
+			case TIMESHIFT_BADRANGE:
+				if (numfields == 3)
+					headers(s, STATUS_416, CONTENT_HTML, NULL);
+				writeToClient(s, (uint8_t*) rangeNotSatisfiable,
+						sizeof(rangeNotSatisfiable)-1);
+				exit(RETVAL_CLEAN);
+			default:
+				/* Ring not available, fall back to live stream */
+				break;
+		}
+	}
+
+	if (servi->service_type == SERVICE_FILE) {
+		if (numfields == 3)
+			headers(s, STATUS_200, CONTENT_OSTREAM, NULL);
+		fileStream(s, servi);
+		/* SHOULD NEVER REACH HERE */
+		exit(RETVAL_CLEAN);
+	}
+
+	/* Services of udpxy style URLs have no feeder */
+	if (configured && SERVICE_RING(servi)) {
+		if (timeshiftLiveOpen(servi, &pos) == 0) {
+			if (numfields == 3)
+				headers(s, STATUS_200, CONTENT_OSTREAM, NULL);
+			timeshiftStream(s, pos);
+			/* SHOULD NEVER REACH HERE */
+			exit(RETVAL_CLEAN);
+		}
+		/* Multicast can still be received here without the feeder */
+		if (SERVICE_PULLED(servi)) {
+			if (numfields == 3)
+				headers(s, STATUS_503, CONTENT_HTML, NULL);
+			writeToClient(s, (uint8_t*) serviceUnavailable,
+					sizeof(serviceUnavailable)-1);
+			exit(RETVAL_CLEAN);
+		}
+	}
+
 	if (numfields == 3)
-		headers(s, STATUS_200, CONTENT_OSTREAM);
+		headers(s, STATUS_200, CONTENT_OSTREAM, NULL);
 	startRTPstream(s, servi);
 	/* SHOULD NEVER REACH HERE */
 	exit(RETVAL_CLEAN);
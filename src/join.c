@@ -0,0 +1,360 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Multicast join scheduling.
+ *
+ * Only the first socket joining a group on the host makes the kernel
+ * send a membership report, and only the last one leaving it sends a
+ * leave, so the group slots of the statistics segment count the sockets
+ * joined to each group. The first joiner of a group waits for its turn,
+ * the others wait only until it has joined and then come along for
+ * free. With joinrate set, turns are handed out at that rate to the
+ * joins and leaves of all processes: each one reserves the next free
+ * turn in the segment with a compare-and-swap, and joins of clients
+ * waiting for a picture go before those of feeders nobody watches.
+ *
+ * A join that fails, or a group that stays silent, is joined again
+ * after JOIN_RETRY_MS, doubling up to JOIN_RETRY_MAX_MS, well within the
+ * five seconds after which a client gives up on the group. A silent
+ * group is only joined again by its single member, such as the feeder
+ * with fan-out, as a leave and join of one socket among several goes
+ * unnoticed by the network. Members killed before they could leave are
+ * dropped by the main process as it reaps them. The time from each join
+ * to the first packet goes into a histogram per group.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#define JOIN_RETRY_MS 250
+#define JOIN_RETRY_MAX_MS 2000
+/* Turns given out at once after a quiet period, in time at the rate */
+#define JOIN_BURST_US 100000
+/* Longest wait for the first joiner of a group, before joining anyway */
+#define JOIN_FOLLOW_MS 2000
+/* Longest wait of a viewer for a working join */
+#define JOIN_GIVEUP_MS 5000
+/* Longest wait of a leave for its turn */
+#define JOIN_LEAVE_MS 2000
+
+static struct stats_group_s *mygroup = NULL;
+static struct stats_member_s *mymember = NULL;
+static const struct services_s *myservice;
+static int mysock = -1;
+static int urgent; /* somebody watches */
+static int64_t joinedat = 0; /* of the last join, until a packet came */
+static int retried; /* the last join was a retry */
+static int heard;
+static int64_t due; /* of the next retry */
+static int delay = JOIN_RETRY_MS;
+
+static int64_t monoUs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Wait for a turn to send a join or a leave
+ * @param viewers the join has viewers waiting, it goes first
+ * @param limit_ms give up waiting after this, 0 for never
+ */
+static void joinTurn(int viewers, int limit_ms) {
+	int64_t now, turn, start, until, interval;
+
+	if (conf_joinrate <= 0 || stats == NULL)
+		return;
+	interval = 1000000 / conf_joinrate;
+	now = monoUs();
+	until = limit_ms ? now + (int64_t) limit_ms * 1000 : 0;
+	if (viewers)
+		STATS_ADD(stats->joinwaiting, 1);
+	while (1) {
+		if (!viewers && STATS_GET(stats->joinwaiting) > 0 &&
+		    (until == 0 || now < until)) {
+			usleep(interval);
+			now = monoUs();
+			continue;
+		}
+		turn = __atomic_load_n(&stats->jointurn, __ATOMIC_RELAXED);
+		start = turn > now - JOIN_BURST_US ? turn :
+			now - JOIN_BURST_US;
+		if (__atomic_compare_exchange_n(&stats->jointurn, &turn,
+				start + interval, 0, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED))
+			break;
+	}
+	if (viewers)
+		STATS_SUB(stats->joinwaiting, 1);
+	if (until && start > until)
+		start = until;
+	if (start > now)
+		usleep(start - now);
+}
+
+/*
+ * Record the membership of the process, for joinReaped(). Made after
+ * the member is counted and cleared before it is not, so a process
+ * dying in between leaks a member rather than dropping another one.
+ */
+static void joinMember(void) {
+	pid_t expected;
+	int i;
+
+	for (i = 0; i < STATS_MEMBERS; i++) {
+		expected = 0;
+		if (!__atomic_compare_exchange_n(&stats->members[i].pid,
+				&expected, getpid(), 0, __ATOMIC_ACQUIRE,
+				__ATOMIC_RELAXED))
+			continue;
+		mymember = &stats->members[i];
+		STATS_SET(mymember->group,
+				(int32_t) (mygroup - stats->groups));
+		return;
+	}
+}
+
+static void joinForget(void) {
+	if (mymember == NULL)
+		return;
+	STATS_SET(mymember->group, -1);
+	__atomic_store_n(&mymember->pid, 0, __ATOMIC_RELEASE);
+	mymember = NULL;
+}
+
+/* Leave the group, in turn, as the process exits */
+static void joinLeave(void) {
+	if (mysock < 0 || mygroup == NULL)
+		return;
+	joinForget();
+	if (STATS_SUB(mygroup->members, 1) == 1) {
+		__atomic_store_n(&mygroup->joined, 0, __ATOMIC_RELEASE);
+		joinTurn(0, JOIN_LEAVE_MS);
+	}
+	close(mysock);
+	mysock = -1;
+}
+
+static void joinSent(void) {
+	joinedat = monoUs();
+	due = joinedat + (int64_t) delay * 1000;
+	if (mygroup)
+		STATS_ADD(mygroup->joins, 1);
+}
+
+/*
+ * Open a socket joined to the multicast group of the service, waiting
+ * for the turn of the group and retrying when the join fails.
+ * @param viewers somebody waits for the stream
+ * @returns the socket or -1
+ */
+int joinOpen(const struct services_s *service, int viewers) {
+	int64_t start = monoUs(), follow;
+	int sock, first = 1;
+
+	myservice = service;
+	urgent = viewers;
+	mygroup = statsGroup(service);
+	if (mygroup && STATS_ADD(mygroup->members, 1) > 0) {
+		/* The first joiner sends the report, do not overtake it */
+		follow = start + JOIN_FOLLOW_MS * 1000;
+		while (!__atomic_load_n(&mygroup->joined, __ATOMIC_ACQUIRE) &&
+		    monoUs() < follow)
+			usleep(1000);
+		first = 0;
+	}
+	if (mygroup)
+		joinMember();
+
+	while (1) {
+		if (first)
+			joinTurn(viewers, 0);
+		sock = openMcastSocket(service);
+		if (sock >= 0)
+			break;
+		if (mygroup)
+			STATS_ADD(mygroup->joinfails, 1);
+		if (viewers && monoUs() - start + delay * 1000 >
+		    JOIN_GIVEUP_MS * 1000) {
+			if (mygroup) {
+				joinForget();
+				STATS_SUB(mygroup->members, 1);
+			}
+			return -1;
+		}
+		usleep(delay * 1000);
+		delay = delay * 2 > JOIN_RETRY_MAX_MS ? JOIN_RETRY_MAX_MS :
+			delay * 2;
+		first = 1;
+	}
+	delay = JOIN_RETRY_MS;
+	if (first || mygroup == NULL)
+		joinSent();
+	else
+		due = monoUs() + (int64_t) delay * 1000;
+	if (mygroup)
+		__atomic_store_n(&mygroup->joined, 1, __ATOMIC_RELEASE);
+	mysock = sock;
+	atexit(joinLeave);
+	return sock;
+}
+
+/*
+ * Note a packet from the group. Only the first one after a join costs
+ * more than a store.
+ */
+void joinPacket(void) {
+	heard = 1;
+	if (joinedat == 0)
+		return;
+	if (mygroup)
+		histRecord(&mygroup->join[retried], monoUs() - joinedat);
+	joinedat = 0;
+}
+
+/*
+ * Milliseconds the caller may wait for the next packet before calling
+ * joinRetry()
+ */
+int joinWait(void) {
+	int64_t now = monoUs();
+
+	if (heard) {
+		heard = 0;
+		delay = JOIN_RETRY_MS;
+		due = now + (int64_t) delay * 1000;
+		return delay;
+	}
+	return due > now ? (due - now + 999) / 1000 : 0;
+}
+
+/*
+ * Join the group again when it has been silent for too long. Called
+ * when waiting for a packet timed out.
+ */
+void joinRetry(int sock) {
+	int64_t now = monoUs();
+
+	if (heard || now < due)
+		return;
+	delay = delay * 2 > JOIN_RETRY_MAX_MS ? JOIN_RETRY_MAX_MS : delay * 2;
+	/* Leaving while other sockets stay joined sends nothing */
+	if (mygroup && STATS_GET(mygroup->members) > 1) {
+		due = now + (int64_t) delay * 1000;
+		return;
+	}
+	logger(LOG_DEBUG, "Group of %s silent, joining again\n",
+			myservice->url);
+	joinTurn(urgent, 0);
+	if (mygroup)
+		STATS_ADD(mygroup->retries, 1);
+	if (mcastRejoin(sock, myservice) < 0 && mygroup)
+		STATS_ADD(mygroup->joinfails, 1);
+	retried = 1;
+	joinSent();
+}
+
+/*
+ * Drop the membership of a child which died without leaving, killed
+ * by a signal or crashed, so a later member of its group does not wait
+ * for a join nobody sends. The kernel leaves the group as the socket
+ * is closed.
+ */
+void joinReaped(pid_t pid) {
+	struct stats_member_s *m;
+	int32_t gi;
+	int i;
+
+	if (stats == NULL)
+		return;
+	for (i = 0; i < STATS_MEMBERS; i++) {
+		m = &stats->members[i];
+		if (__atomic_load_n(&m->pid, __ATOMIC_ACQUIRE) != pid)
+			continue;
+		gi = STATS_GET(m->group);
+		STATS_SET(m->group, -1);
+		__atomic_store_n(&m->pid, 0, __ATOMIC_RELEASE);
+		if (gi >= 0 && gi < STATS_GROUPS &&
+		    STATS_SUB(stats->groups[gi].members, 1) == 1)
+			__atomic_store_n(&stats->groups[gi].joined, 0,
+					__ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Write the join counters and histograms in Prometheus text exposition
+ * format
+ */
+void joinPrometheus(FILE *f) {
+	static const char *counters[] = { "joins", "retries", "failures" };
+	static const char *help[] = {
+		"Joins of the group, retries included.",
+		"Joins repeated because the group stayed silent.",
+		"Joins refused by the system."
+	};
+	static const char *attempts[] = { "first", "retry" };
+	struct stats_group_s *g;
+	int i, k;
+
+	for (k = 0; k < 3; k++) {
+		fprintf(f, "# HELP rtp2httpd_group_%s_total %s\n"
+			"# TYPE rtp2httpd_group_%s_total counter\n",
+			counters[k], help[k], counters[k]);
+		for (i = 0; i < STATS_GROUPS; i++) {
+			g = &stats->groups[i];
+			if (STATS_GET(g->state) != SLOT_USED)
+				continue;
+			fprintf(f, "rtp2httpd_group_%s_total{group=\"",
+					counters[k]);
+			labelEscape(f, g->group);
+			fprintf(f, "\"} %llu\n", (unsigned long long)
+				(k == 0 ? STATS_GET(g->joins) :
+				 k == 1 ? STATS_GET(g->retries) :
+				 STATS_GET(g->joinfails)));
+		}
+	}
+	fprintf(f, "# HELP rtp2httpd_join_seconds Time from a join to the "
+		"first packet of the group.\n"
+		"# TYPE rtp2httpd_join_seconds histogram\n");
+	for (i = 0; i < STATS_GROUPS; i++) {
+		g = &stats->groups[i];
+		if (STATS_GET(g->state) != SLOT_USED)
+			continue;
+		for (k = 0; k < 2; k++) {
+			if (STATS_GET(g->join[k].count) == 0)
+				continue;
+			histPrometheus(f, "rtp2httpd_join_seconds", "group",
+				g->group, "attempt", attempts[k], &g->join[k], 0);
+		}
+	}
+}
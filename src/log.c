@@ -0,0 +1,369 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Logging.
+ *
+ * The verbosity check is done inline by the logger() macro. Messages
+ * which pass it are formatted by the calling process into a slot of a
+ * ring shared by all processes and written out by a separate writer
+ * process, so clients never block on stderr, a file or syslog. The
+ * ring is a bounded multi-producer queue: producers claim a slot with
+ * a compare and swap and never wait, a full ring drops the message.
+ *
+ * Each process also limits how often the same message (the same
+ * format string) is logged per second, the rest is only counted.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/prctl.h>
+#include <syslog.h>
+
+/* syslog.h names clash with our levels */
+static const int syslogPrio[] = { LOG_CRIT, LOG_ERR, LOG_INFO, LOG_DEBUG };
+#undef LOG_INFO
+#undef LOG_DEBUG
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#define LOG_SLOTS 1024
+#define LOG_MSGLEN 240
+/* Writer sleep when the ring is empty, in microseconds */
+#define LOG_IDLE_US 20000
+/* Seconds after which a slot never filled by its producer is skipped */
+#define LOG_STUCK 5
+/* Same message logged at most this many times a second per process */
+#define LOG_RATE_BURST 5
+#define LOG_RATE_SLOTS 64
+
+struct log_entry_s {
+	uint64_t seq;
+	time_t time;
+	pid_t pid;
+	int level;
+	char text[LOG_MSGLEN];
+};
+
+struct log_ring_s {
+	uint64_t head; /* next slot to claim, producers */
+	char pad1[56];
+	uint64_t tail; /* next slot to write out, writer */
+	uint64_t dropped;
+	char pad2[48];
+	struct log_entry_s e[LOG_SLOTS];
+};
+
+struct log_rate_s {
+	const char *format;
+	time_t second;
+	int count;
+	int suppressed;
+};
+
+static struct log_ring_s *ring = NULL;
+static pid_t writer = 0;
+static time_t writerdied;
+static FILE *logf = NULL;
+static int use_syslog = 0;
+static struct log_rate_s rates[LOG_RATE_SLOTS];
+
+/*
+ * Write one message to the destination
+ */
+static void logOutput(int level, pid_t pid, time_t t, const char *text) {
+	char stamp[32];
+	size_t len;
+
+	if (use_syslog) {
+		len = strlen(text);
+		if (len > 0 && text[len-1] == '\n')
+			len--;
+		syslog(syslogPrio[level], "[%d] %.*s", pid, (int) len, text);
+		return;
+	}
+	if (logf == NULL) {
+		fputs(text, stderr);
+		return;
+	}
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&t));
+	fprintf(logf, "%s [%d] %s", stamp, pid, text);
+}
+
+/*
+ * Put a message into the ring.
+ * @returns 0 if the ring is full
+ */
+static int logQueue(int level, const char *text) {
+	struct log_entry_s *e;
+	uint64_t pos, seq;
+
+	pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	while (1) {
+		e = &ring->e[pos % LOG_SLOTS];
+		seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&ring->head, &pos,
+					pos + 1, 0, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (seq < pos) {
+			__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+			return 0;
+		} else {
+			pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		}
+	}
+	e->time = time(NULL);
+	e->pid = getpid();
+	e->level = level;
+	strncpy(e->text, text, LOG_MSGLEN - 1);
+	e->text[LOG_MSGLEN - 1] = '\0';
+	__atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static void logDeliver(int level, const char *text) {
+	if (ring && writer > 0 && level != LOG_FATAL) {
+		logQueue(level, text);
+		return;
+	}
+	/* Synchronously before the writer runs, and last words */
+	logOutput(level, getpid(), time(NULL), text);
+	if (logf)
+		fflush(logf);
+}
+
+/*
+ * Rate limit by format string.
+ * @returns 1 if the message may be logged
+ */
+static int logAllowed(int level, const char *format) {
+	struct log_rate_s *r;
+	time_t now;
+	char note[64];
+
+	if (level == LOG_FATAL)
+		return 1;
+	r = &rates[((uintptr_t) format >> 3) % LOG_RATE_SLOTS];
+	now = time(NULL);
+	if (r->format != format) {
+		r->format = format;
+		r->second = now;
+		r->count = 0;
+		r->suppressed = 0;
+	}
+	if (r->second != now) {
+		if (r->suppressed > 0) {
+			snprintf(note, sizeof(note), "(%d similar messages "
+					"suppressed)\n", r->suppressed);
+			logDeliver(level, note);
+		}
+		r->second = now;
+		r->count = 0;
+		r->suppressed = 0;
+	}
+	if (++r->count > LOG_RATE_BURST) {
+		r->suppressed++;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Format and queue a message. Called through the logger() macro,
+ * which already checked the level.
+ */
+int logMessage(enum loglevel level, const char *format, ...) {
+	char text[LOG_MSGLEN];
+	va_list ap;
+	int r;
+
+	if (!logAllowed(level, format))
+		return 0;
+	va_start(ap, format);
+	r = vsnprintf(text, sizeof(text), format, ap);
+	va_end(ap);
+	logDeliver(level, text);
+	return r;
+}
+
+/*
+ * Write out everything in the ring
+ * @returns number of messages written
+ */
+static int logDrain(time_t *stuck) {
+	struct log_entry_s *e;
+	uint64_t tail = ring->tail, dropped;
+	int n = 0;
+	char note[64];
+
+	while (1) {
+		e = &ring->e[tail % LOG_SLOTS];
+		if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != tail + 1) {
+			/* A producer died between claiming and filling */
+			if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) > tail) {
+				if (*stuck == 0)
+					*stuck = time(NULL);
+				if (time(NULL) - *stuck < LOG_STUCK)
+					break;
+			} else {
+				break;
+			}
+		} else {
+			logOutput(e->level, e->pid, e->time, e->text);
+			n++;
+		}
+		*stuck = 0;
+		__atomic_store_n(&e->seq, tail + LOG_SLOTS, __ATOMIC_RELEASE);
+		tail++;
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELAXED);
+	}
+	dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+	if (dropped > 0) {
+		snprintf(note, sizeof(note), "%llu log messages dropped\n",
+				(unsigned long long) dropped);
+		logOutput(LOG_ERROR, getpid(), time(NULL), note);
+		n++;
+	}
+	return n;
+}
+
+static void logWriterRun(void) {
+	time_t stuck = 0;
+
+	closeListeners();
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+	while (1) {
+		if (logDrain(&stuck) > 0) {
+			if (logf)
+				fflush(logf);
+			else if (!use_syslog)
+				fflush(stderr);
+		} else {
+			usleep(LOG_IDLE_US);
+		}
+	}
+}
+
+static void logWriterStart(void) {
+	pid_t child;
+
+	child = fork();
+	if (child < 0) {
+		logger(LOG_ERROR, "Cannot fork log writer: %s\n",
+				strerror(errno));
+		writerdied = time(NULL);
+		return;
+	}
+	if (child == 0) {
+		writer = 0;
+		logWriterRun();
+	}
+	writer = child;
+}
+
+/*
+ * Open the log destination, create the ring and start the writer.
+ * Called by the main process after daemonising, before any fork.
+ */
+void logInit(void) {
+	const char *args;
+	int i, fresh;
+
+	if (conf_logfile && strcasecmp(conf_logfile, "syslog") == 0) {
+		use_syslog = 1;
+	} else if (conf_logfile && strcmp(conf_logfile, "-") != 0) {
+		logf = fopen(conf_logfile, "a");
+		if (logf == NULL) {
+			logger(LOG_FATAL, "Cannot open log file %s: %s\n",
+					conf_logfile, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	} else if (conf_logfile == NULL && conf_daemonise) {
+		/* stderr is gone */
+		use_syslog = 1;
+	}
+	if (use_syslog)
+		openlog(PACKAGE, LOG_NDELAY, LOG_DAEMON);
+
+	ring = sharedMap("log", sizeof(struct log_ring_s), -1, &fresh);
+	if (ring == NULL)
+		return;
+	args = upgradeTake("logwriter", NULL);
+	if (args) {
+		/* Replaced once it is gone, by logCheck(), with the
+		 * destination configured now */
+		writer = atoi(args);
+		kill(writer, SIGTERM);
+	}
+	if (fresh) {
+		for (i = 0; i < LOG_SLOTS; i++)
+			ring->e[i].seq = i;
+	}
+	if (writer == 0)
+		logWriterStart();
+}
+
+/*
+ * Hand the writer over to the next image. Called by the main process
+ * right before the upgrade.
+ */
+void logUpgrade(void) {
+	if (writer)
+		upgradeKeep(-1, "logwriter %d", (int) writer);
+}
+
+/*
+ * Restart the writer if it died. Called periodically by the main
+ * process. Until then, messages wait in the ring.
+ */
+void logCheck(void) {
+	if (ring && writer == 0 && time(NULL) != writerdied)
+		logWriterStart();
+}
+
+/*
+ * Check whether reaped child was the log writer.
+ * Called from SIGCHLD handler.
+ * @returns 1 if it was
+ */
+int logReaped(pid_t pid) {
+	if (pid != writer || pid == 0)
+		return 0;
+	writer = 0;
+	writerdied = time(NULL);
+	return 1;
+}
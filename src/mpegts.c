@@ -0,0 +1,118 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Minimal MPEG transport stream inspection. Only the TS packet headers,
+ * adaptation fields and single packet PATs are looked at.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+/*
+ * Check whether the TS packet has an adaptation field with
+ * some flags in it.
+ */
+static int hasAdaptationFlags(const uint8_t *pkt) {
+	return pkt[0] == TS_SYNC && (pkt[3] & 0x20) && pkt[4] > 0;
+}
+
+/*
+ * Find the first TS packet carrying random_access_indicator.
+ *
+ * @param buf buffer of whole TS packets
+ * @param len buffer length
+ * @returns offset of the packet within buf or -1 if there is none
+ */
+int tsRandomAccess(const uint8_t *buf, size_t len) {
+	size_t i;
+
+	for (i = 0; i + TS_PACKET_LEN <= len; i += TS_PACKET_LEN) {
+		if (hasAdaptationFlags(buf + i) && (buf[i+5] & 0x40))
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Read Program Clock Reference from a single TS packet.
+ *
+ * @param pkt TS packet
+ * @param pcr set to PCR in 27 MHz units
+ * @returns 1 if the packet carries PCR, 0 otherwise
+ */
+int tsPCR(const uint8_t *pkt, uint64_t *pcr) {
+	uint64_t base;
+
+	if (!hasAdaptationFlags(pkt) || pkt[4] < 7 || !(pkt[5] & 0x10))
+		return 0;
+	base = ((uint64_t) pkt[6] << 25) | (pkt[7] << 17) |
+		(pkt[8] << 9) | (pkt[9] << 1) | (pkt[10] >> 7);
+	*pcr = base * 300 + (((pkt[10] & 0x01) << 8) | pkt[11]);
+	return 1;
+}
+
+/*
+ * PID of a TS packet
+ */
+int tsPID(const uint8_t *pkt) {
+	return ((pkt[1] & 0x1F) << 8) | pkt[2];
+}
+
+/*
+ * Read PMT PIDs from a PAT carried in a single TS packet.
+ *
+ * @param pkt TS packet of PID 0 with payload unit start
+ * @param pids array to fill
+ * @param maxpids size of the array
+ * @returns number of PMT PIDs found, -1 if it is not a usable PAT
+ */
+int tsPMTPids(const uint8_t *pkt, int *pids, int maxpids) {
+	int i, n = 0, off, seclen, program;
+
+	if (pkt[0] != TS_SYNC || tsPID(pkt) != 0 || !(pkt[1] & 0x40) ||
+			!(pkt[3] & 0x10))
+		return -1;
+	off = 4;
+	if (pkt[3] & 0x20)
+		off += 1 + pkt[4];
+	if (off >= TS_PACKET_LEN)
+		return -1;
+	off += 1 + pkt[off]; /* pointer field */
+	if (off + 8 > TS_PACKET_LEN || pkt[off] != 0x00)
+		return -1;
+	seclen = ((pkt[off+1] & 0x0F) << 8) | pkt[off+2];
+	if (off + 3 + seclen > TS_PACKET_LEN || seclen < 9)
+		return -1;
+	/* Program loop between the 8 byte header and CRC */
+	for (i = off + 8; i + 4 <= off + 3 + seclen - 4 && n < maxpids; i += 4) {
+		program = (pkt[i] << 8) | pkt[i+1];
+		if (program == 0)
+			continue; /* network PID */
+		pids[n++] = ((pkt[i+2] & 0x1F) << 8) | pkt[i+3];
+	}
+	return n;
+}
@@ -0,0 +1,270 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <dirent.h>
+#include <sched.h>
+#include <limits.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+/*
+ * Join or leave the multicast group of the service on the socket.
+ * @returns 0 on success
+ */
+static int membership(int sock, const struct services_s *service, int join) {
+	int level;
+	struct group_req gr;
+	struct group_source_req gsr;
+
+	memset(&gr, 0, sizeof(gr));
+	memcpy(&(gr.gr_group), service->addr->ai_addr, service->addr->ai_addrlen);
+
+	switch (service->addr->ai_family) {
+		case AF_INET:
+			level = SOL_IP;
+			gr.gr_interface = 0;
+			break;
+
+		case AF_INET6:
+			level = SOL_IPV6;
+			gr.gr_interface = ((const struct sockaddr_in6 *)
+				(service->addr->ai_addr))->sin6_scope_id;
+			break;
+		default:
+			logger(LOG_ERROR, "Address family don't support mcast.\n");
+			errno = EAFNOSUPPORT;
+			return -1;
+	}
+	if (service->ifname) {
+		gr.gr_interface = if_nametoindex(service->ifname);
+		if (gr.gr_interface == 0)
+			return -1;
+	}
+
+	if (service->msrc != NULL && strcmp(service->msrc, "") != 0) {
+		memset(&gsr, 0, sizeof(gsr));
+		gsr.gsr_group = gr.gr_group;
+		gsr.gsr_interface = gr.gr_interface;
+		memcpy(&(gsr.gsr_source), service->msrc_addr->ai_addr, service->msrc_addr->ai_addrlen);
+		return setsockopt(sock, level, join ? MCAST_JOIN_SOURCE_GROUP :
+			MCAST_LEAVE_SOURCE_GROUP, &gsr, sizeof(gsr));
+	}
+	return setsockopt(sock, level, join ? MCAST_JOIN_GROUP :
+		MCAST_LEAVE_GROUP, &gr, sizeof(gr));
+}
+
+/*
+ * Open UDP socket and join the multicast group of the service.
+ * @returns socket or -1 on failure
+ */
+int openMcastSocket(const struct services_s *service) {
+	int sock;
+	int r;
+	int on = 1;
+
+	sock = socket(service->addr->ai_family, service->addr->ai_socktype,
+			service->addr->ai_protocol);
+	if (sock < 0) {
+		logger(LOG_ERROR, "Cannot create socket: %s\n",
+				strerror(errno));
+		return -1;
+	}
+	r = setsockopt(sock, SOL_SOCKET,
+			SO_REUSEADDR, &on, sizeof(on));
+	if (r) {
+		logger(LOG_ERROR, "SO_REUSEADDR "
+		"failed: %s\n", strerror(errno));
+	}
+
+	if (service->ifname) {
+		/* Only what arrives on the interface, not the same group
+		 * joined on another one */
+		r = 0;
+		setsockopt(sock, SOL_IP, IP_MULTICAST_ALL, &r, sizeof(r));
+		if (setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE,
+				service->ifname, strlen(service->ifname)) < 0)
+			logger(LOG_DEBUG, "SO_BINDTODEVICE %s failed: %s\n",
+				service->ifname, strerror(errno));
+	}
+
+	r = bind(sock,(struct sockaddr *) service->addr->ai_addr, service->addr->ai_addrlen);
+	if (r) {
+		logger(LOG_ERROR, "Cannot bind: %s\n",
+				strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	if (membership(sock, service, 1)) {
+		logger(LOG_ERROR, "Cannot join mcast group: %s\n",
+				strerror(errno));
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/*
+ * Leave the group and join it again, so that a new membership report
+ * goes out.
+ * @returns 0 on success
+ */
+int mcastRejoin(int sock, const struct services_s *service) {
+	membership(sock, service, 0);
+	if (membership(sock, service, 1)) {
+		logger(LOG_ERROR, "Cannot join mcast group: %s\n",
+				strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Add a list like 0-3,8 to the set
+ * @returns number of CPUs added
+ */
+static int cpuList(const char *path, cpu_set_t *set) {
+	FILE *f;
+	char buf[1024], *p;
+	long lo, hi;
+	int n = 0;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	if (fgets(buf, sizeof(buf), f) == NULL)
+		buf[0] = '\0';
+	fclose(f);
+	for (p = buf; *p >= '0' && *p <= '9'; ) {
+		lo = hi = strtol(p, &p, 10);
+		if (*p == '-')
+			hi = strtol(p + 1, &p, 10);
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++, n++)
+			CPU_SET(lo, set);
+		if (*p == ',')
+			p++;
+	}
+	return n;
+}
+
+/*
+ * Run the process on the CPUs serving the interrupts of the interface
+ * the service receives on, when pinworkers is set. Where the interrupts
+ * may go anywhere, the CPUs of the NUMA node of the NIC are used.
+ */
+void mcastPin(const struct services_s *service) {
+	cpu_set_t set;
+	char path[PATH_MAX];
+	DIR *dir;
+	struct dirent *de;
+
+	if (!conf_pinworkers || service->ifname == NULL)
+		return;
+	CPU_ZERO(&set);
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs",
+			service->ifname);
+	dir = opendir(path);
+	while (dir && (de = readdir(dir)) != NULL) {
+		if (de->d_name[0] < '0' || de->d_name[0] > '9')
+			continue;
+		snprintf(path, sizeof(path), "/proc/irq/%s/smp_affinity_list",
+				de->d_name);
+		cpuList(path, &set);
+	}
+	if (dir)
+		closedir(dir);
+	if (CPU_COUNT(&set) == 0 ||
+	    CPU_COUNT(&set) >= sysconf(_SC_NPROCESSORS_ONLN)) {
+		CPU_ZERO(&set);
+		snprintf(path, sizeof(path),
+				"/sys/class/net/%s/device/local_cpulist",
+				service->ifname);
+		cpuList(path, &set);
+	}
+	if (CPU_COUNT(&set) == 0) {
+		logger(LOG_DEBUG, "No CPUs known for %s\n", service->ifname);
+		return;
+	}
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+		logger(LOG_ERROR, "Cannot pin to CPUs of %s: %s\n",
+			service->ifname, strerror(errno));
+	else
+		logger(LOG_DEBUG, "Receiving %s on %d CPUs near %s\n",
+			service->url, CPU_COUNT(&set), service->ifname);
+}
+
+/*
+ * Find payload of a RTP packet.
+ *
+ * @param buf received packet
+ * @param len length of the packet
+ * @param payload set to the start of the payload
+ * @param seqn set to the RTP sequence number
+ * @returns payload length or -1 for malformed packet
+ */
+int rtpPayload(uint8_t *buf, int len, uint8_t **payload, uint16_t *seqn) {
+	int payloadstart, payloadlength;
+
+	if (len < 12 || (buf[0]&0xC0) != 0x80) {
+		/*malformed RTP/UDP/IP packet*/
+		return -1;
+	}
+
+	payloadstart = 12; /* basic RTP header length */
+	payloadstart += (buf[0]&0x0F) * 4; /*CRSC headers*/
+	if (buf[0]&0x10) { /*Extension header*/
+		if (payloadstart + 4 > len)
+			return -1;
+		payloadstart += 4 + 4*ntohs(*((uint16_t *)(buf+payloadstart+2)));
+	}
+	payloadlength = len - payloadstart;
+	if (buf[0]&0x20) { /*Padding*/
+		payloadlength -= buf[len-1];
+		/*last octet indicate padding length*/
+	}
+	if (payloadlength < 0)
+		return -1;
+
+	*seqn = ntohs(*((uint16_t *)(buf+2)));
+	*payload = buf + payloadstart;
+	return payloadlength;
+}
+
+/*
+ * RTP timestamp of a packet already checked by rtpPayload()
+ */
+uint32_t rtpTimestamp(const uint8_t *buf) {
+	return ntohl(*((uint32_t *)(buf+4)));
+}
@@ -0,0 +1,434 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Paced playout of the live stream.
+ *
+ * Received datagrams are held back for a small delay and released at
+ * the pace of the stream clock. Release times come from the PCR: data
+ * between two PCRs is spread linearly over the time between them. For
+ * streams without PCR the RTP timestamp of the datagram is used, and
+ * if there is neither, the arrival time.
+ *
+ * Pending data are kept in a hashed timer wheel of 1 ms ticks with a
+ * bitmap of occupied slots, so finding the next release and firing it
+ * costs a few instructions, and the client sleeps in poll() in between.
+ * Datagrams stay in the arena slabs they were received into, and all
+ * due at once are written with a single writev().
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#define min(a,b) ((a)<(b) ? (a):(b))
+#define max(a,b) ((a)>(b) ? (a):(b))
+
+#define PACE_TICK_US 1000
+#define PACE_WHEEL 1024 /* slots, must be a power of two */
+#define PACE_ENTRIES 8192
+#define PACE_SLABS 2048 /* datagrams held at most */
+#define PACE_IOV 64 /* written at once at most */
+/* Datagrams waiting for the next PCR at most this long */
+#define PACE_PCR_WAIT_US 200000
+/* Rebase the clock when it runs this far from the arrival time */
+#define PACE_RESYNC_US 500000
+#define PCR_WRAP ((1ULL << 33) * 300)
+
+struct pace_entry_s {
+	int64_t due; /* monotonic time in us */
+	int64_t arrival;
+	uint64_t pos; /* stream position, for PCR interpolation */
+	const uint8_t *buf; /* in the slab */
+	uint32_t slab;
+	uint32_t len;
+	struct pace_entry_s *next;
+};
+
+static int enabled = 0;
+static int64_t delay; /* us */
+
+static struct pace_entry_s entries[PACE_ENTRIES];
+static struct pace_entry_s *freelist;
+
+/* Timer wheel */
+static struct pace_entry_s *slot[PACE_WHEEL], *slottail[PACE_WHEEL];
+static uint64_t occupied[PACE_WHEEL / 64];
+static int64_t cursor; /* next tick to fire */
+static int64_t lastdue;
+static int queued;
+
+/* Released entries waiting for writev() */
+static struct iovec iov[PACE_IOV];
+static uint32_t iovslab[PACE_IOV];
+static int niov;
+static size_t iovlen;
+
+/* Datagrams waiting for the next PCR */
+static struct pace_entry_s *pending, *pendingtail;
+
+/* Stream clock */
+static int pcrpid = -1;
+static int clockbase;
+static uint64_t basepcr, lastpcrpos;
+static int64_t basetime, lastpcrdue;
+static uint32_t basets;
+static uint64_t streampos;
+
+static int64_t monoUs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Enable pacing of the live stream.
+ * @param delay_ms how long data are held back at most
+ */
+void paceInit(int client, int delay_ms) {
+	int i, on = 1;
+
+	if (arenaInit(PACE_SLABS) < 0)
+		return;
+	enabled = 1;
+	delay = (int64_t) delay_ms * 1000;
+	for (i = 0; i < PACE_ENTRIES - 1; i++)
+		entries[i].next = &entries[i+1];
+	entries[PACE_ENTRIES-1].next = NULL;
+	freelist = entries;
+	cursor = monoUs() / PACE_TICK_US;
+	/* Small paced writes must not wait for delayed ACKs */
+	setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+int paceEnabled(void) {
+	return enabled;
+}
+
+/*
+ * Write the released entries and drop their slabs
+ */
+static void paceSend(int client) {
+	struct iovec *v = iov;
+	ssize_t actual;
+	int n = niov, i;
+
+	if (niov == 0)
+		return;
+	shapeAcquire(iovlen);
+	for (i = 0; i < niov; i++)
+		zapSent(iov[i].iov_base, iov[i].iov_len);
+	while (n > 0) {
+		actual = writev(client, v, n);
+		if (actual < 0 && errno == EINTR)
+			continue;
+		if (actual <= 0)
+			exit(RETVAL_WRITE_FAILED);
+		/* Skip what was written, on a short write */
+		while (n > 0 && (size_t) actual >= v->iov_len) {
+			actual -= v->iov_len;
+			v++;
+			n--;
+		}
+		if (n > 0) {
+			v->iov_base = (uint8_t *) v->iov_base + actual;
+			v->iov_len -= actual;
+		}
+	}
+	for (i = 0; i < niov; i++)
+		arenaUnref(iovslab[i]);
+	statsPacket(iovlen);
+	statsQueue(client);
+	niov = 0;
+	iovlen = 0;
+}
+
+static void releaseEntry(int client, struct pace_entry_s *e) {
+	iov[niov].iov_base = (void *) e->buf;
+	iov[niov].iov_len = e->len;
+	iovslab[niov++] = e->slab;
+	iovlen += e->len;
+	if (niov == PACE_IOV)
+		paceSend(client);
+	e->next = freelist;
+	freelist = e;
+	queued--;
+}
+
+/*
+ * Put entry to the wheel. Release times never go backwards, which
+ * keeps each slot list and the whole wheel in stream order.
+ */
+static void schedule(struct pace_entry_s *e) {
+	int64_t tick;
+	int s;
+
+	e->due = max(e->due, lastdue);
+	/* Never hold data longer than the wheel reaches */
+	e->due = min(e->due, e->arrival + (PACE_WHEEL - 1) * PACE_TICK_US);
+	lastdue = e->due;
+	tick = max(e->due / PACE_TICK_US, cursor);
+	s = tick & (PACE_WHEEL - 1);
+	e->next = NULL;
+	if (slot[s])
+		slottail[s]->next = e;
+	else
+		slot[s] = e;
+	slottail[s] = e;
+	occupied[s / 64] |= 1ULL << (s % 64);
+	queued++;
+}
+
+/*
+ * Release everything that is due.
+ * @returns milliseconds until the next release, or -1 if nothing waits
+ */
+int paceRun(int client) {
+	int64_t now = monoUs(), nowtick = now / PACE_TICK_US;
+	struct pace_entry_s *e;
+	uint64_t bits;
+	int s, w, i;
+
+	while (cursor <= nowtick && queued > 0) {
+		s = cursor & (PACE_WHEEL - 1);
+		while ((e = slot[s]) != NULL && e->due / PACE_TICK_US <= nowtick) {
+			slot[s] = e->next;
+			releaseEntry(client, e);
+		}
+		if (slot[s] == NULL)
+			occupied[s / 64] &= ~(1ULL << (s % 64));
+		if (slot[s] != NULL)
+			break; /* head of the wheel is not due yet */
+		cursor++;
+	}
+	paceSend(client);
+	if (queued == 0) {
+		cursor = nowtick;
+		return pending ? PACE_PCR_WAIT_US / 1000 : -1;
+	}
+
+	/* Find the next occupied slot from the cursor on */
+	s = cursor & (PACE_WHEEL - 1);
+	for (i = 0; i <= PACE_WHEEL / 64; i++) {
+		w = (s / 64 + i) % (PACE_WHEEL / 64);
+		bits = occupied[w];
+		if (i == 0)
+			bits &= ~0ULL << (s % 64);
+		if (bits) {
+			s = w * 64 + __builtin_ctzll(bits);
+			e = slot[s];
+			return max((e->due - now + 999) / 1000, 0);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Release everything now, to make room or when the clock is lost
+ */
+static void flushAll(int client) {
+	struct pace_entry_s *e;
+	int64_t tick = cursor;
+
+	while (queued > 0) {
+		e = slot[tick & (PACE_WHEEL - 1)];
+		if (e == NULL) {
+			occupied[(tick & (PACE_WHEEL - 1)) / 64] &=
+				~(1ULL << ((tick & (PACE_WHEEL - 1)) % 64));
+			tick++;
+			continue;
+		}
+		slot[tick & (PACE_WHEEL - 1)] = e->next;
+		releaseEntry(client, e);
+	}
+	paceSend(client);
+	memset(occupied, 0, sizeof(occupied));
+	cursor = monoUs() / PACE_TICK_US;
+}
+
+static void schedulePending(int64_t due) {
+	struct pace_entry_s *e;
+
+	while ((e = pending) != NULL) {
+		pending = e->next;
+		e->due = due;
+		schedule(e);
+	}
+	pendingtail = NULL;
+}
+
+/*
+ * Spread pending datagrams between the last PCR and a new one
+ */
+static void interpolatePending(uint64_t pos, int64_t due) {
+	struct pace_entry_s *e;
+	uint64_t span = pos - lastpcrpos;
+
+	while ((e = pending) != NULL) {
+		pending = e->next;
+		if (span > 0 && e->pos > lastpcrpos && due > lastpcrdue)
+			e->due = lastpcrdue + (due - lastpcrdue) *
+				(int64_t) (e->pos - lastpcrpos) / (int64_t) span;
+		else
+			e->due = due;
+		schedule(e);
+	}
+	pendingtail = NULL;
+}
+
+static int findPCR(const uint8_t *buf, size_t len, uint64_t *pcr) {
+	size_t i;
+
+	for (i = 0; i + TS_PACKET_LEN <= len; i += TS_PACKET_LEN) {
+		if (!tsPCR(buf + i, pcr))
+			continue;
+		if (pcrpid < 0)
+			pcrpid = tsPID(buf + i);
+		if (tsPID(buf + i) == pcrpid)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Slab to receive the next datagram into, with the only reference to
+ * it. Makes room by releasing everything when the arena is used up.
+ */
+uint8_t* paceBuffer(int client, uint32_t *slab) {
+	*slab = arenaAlloc();
+	if (*slab == ARENA_NONE) {
+		logger(LOG_DEBUG, "Pacing buffer full, flushing\n");
+		if (pending)
+			schedulePending(monoUs());
+		flushAll(client);
+		*slab = arenaAlloc();
+	}
+	return arenaData(*slab);
+}
+
+/*
+ * Queue received payload for paced release. The queue takes over the
+ * reference of the caller to the slab of the payload.
+ * @param buf the payload, in the slab
+ * @param rtpts RTP timestamp of the datagram
+ * @param hasrtp the stream is RTP, so rtpts is valid
+ */
+void paceQueue(int client, uint32_t slab, const uint8_t *buf, size_t len,
+		uint32_t rtpts, int hasrtp) {
+	struct pace_entry_s *e;
+	int64_t now = monoUs(), due;
+	uint64_t pcr;
+	int haspcr;
+
+	if (len == 0) {
+		arenaUnref(slab);
+		return;
+	}
+	if (freelist == NULL) {
+		logger(LOG_DEBUG, "Pacing queue full, flushing\n");
+		if (pending)
+			schedulePending(now);
+		flushAll(client);
+	}
+
+	e = freelist;
+	freelist = e->next;
+	e->slab = slab;
+	e->buf = buf;
+	e->len = len;
+	e->arrival = now;
+	streampos += len;
+	e->pos = streampos;
+
+	haspcr = findPCR(buf, len, &pcr);
+	if (haspcr) {
+		due = basetime + (int64_t) (((pcr - basepcr + PCR_WRAP) %
+				PCR_WRAP) / 27);
+		if (!clockbase || due > now + delay + PACE_RESYNC_US ||
+		    due < now - PACE_RESYNC_US) {
+			/* First PCR or discontinuity */
+			clockbase = 1;
+			basepcr = pcr;
+			basetime = now;
+			due = now;
+			lastpcrdue = now + delay;
+			lastpcrpos = e->pos - len;
+		}
+		due += delay;
+		e->next = NULL;
+		if (pendingtail)
+			pendingtail->next = e;
+		else
+			pending = e;
+		pendingtail = e;
+		interpolatePending(e->pos, due);
+		lastpcrpos = e->pos;
+		lastpcrdue = due;
+		return;
+	}
+
+	if (pcrpid >= 0) {
+		/* Wait for the next PCR, unless it takes too long */
+		e->next = NULL;
+		if (pendingtail)
+			pendingtail->next = e;
+		else
+			pending = e;
+		pendingtail = e;
+		if (now - pending->arrival > PACE_PCR_WAIT_US) {
+			logger(LOG_DEBUG, "PCR lost, pacing by arrival\n");
+			pcrpid = -1;
+			clockbase = 0;
+			schedulePending(now + delay);
+		}
+		return;
+	}
+
+	if (hasrtp) {
+		/* 90 kHz RTP clock */
+		due = basetime + (int64_t) (uint32_t) (rtpts - basets) * 100 / 9;
+		if (!clockbase || due > now + delay + PACE_RESYNC_US ||
+		    due < now - PACE_RESYNC_US) {
+			clockbase = 1;
+			basets = rtpts;
+			basetime = now;
+			due = now;
+		}
+		e->due = due + delay;
+	} else {
+		e->due = now + delay;
+	}
+	schedule(e);
+}
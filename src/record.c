@@ -0,0 +1,578 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Recording of services to disk.
+ *
+ * Recordings live in a table shared by all processes. The main process
+ * fills in scheduled recordings from the config file, clients add them
+ * through the /record URL. The main process then makes sure the service
+ * has a feeder, and the feeder writes the stream into the file.
+ *
+ * Files are written through a few large aligned buffers, with O_DIRECT
+ * where the filesystem supports it, so recordings bypass the page cache.
+ * The buffers are written with POSIX AIO, so the feeder keeps receiving
+ * while the previous buffer is on its way to the disk.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <aio.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#define min(a,b) ((a)<(b) ? (a):(b))
+
+#define RECORD_SLOTS 64
+#define RECORD_PATH_LEN 256
+/* Concurrent recordings of one service */
+#define RECORD_WRITERS 4
+#define RECORD_BUFSIZE (1024*1024)
+#define RECORD_NBUF 4
+#define RECORD_ALIGN 4096
+
+enum record_state {
+	REC_FREE = 0,
+	REC_CLAIMED,   /* being filled in */
+	REC_SCHEDULED, /* waiting for start time */
+	REC_RUNNING,
+	REC_DONE,
+	REC_FAILED
+};
+
+static const char *stateNames[] = {
+	"free", "claimed", "scheduled", "running", "done", "failed"
+};
+
+struct record_s {
+	uint32_t state;
+	uint32_t id;
+	char service[STATS_URL_LEN];
+	char path[RECORD_PATH_LEN];
+	int64_t start; /* unix time */
+	int64_t stop; /* unix time, 0 for unlimited */
+	uint64_t bytes;
+	pid_t writer;
+};
+
+struct record_table_s {
+	uint32_t seq;
+	struct record_s slot[RECORD_SLOTS];
+};
+
+/*
+ * Linked list of recordings from the config file
+ */
+struct schedule_s {
+	char *service;
+	char *file;
+	int64_t start;
+	int64_t stop;
+	struct schedule_s *next;
+};
+
+/*
+ * Writer of one recording, private to the feeder
+ */
+struct recwriter_s {
+	struct record_s *rec;
+	int fd;
+	int direct; /* O_DIRECT is in effect */
+	uint8_t *buf[RECORD_NBUF];
+	struct aiocb cb[RECORD_NBUF];
+	int inflight[RECORD_NBUF];
+	int cur;
+	size_t fill;
+	off_t off;
+	int failed;
+};
+
+static struct record_table_s *table = NULL;
+static struct schedule_s *schedule = NULL;
+static struct recwriter_s writers[RECORD_WRITERS];
+static int nwriters = 0;
+
+/*
+ * Add scheduled recording. Called while parsing the config file.
+ */
+void recordSchedule(const char *service, int64_t start, int minutes,
+		const char *file) {
+	struct schedule_s *sch;
+
+	sch = malloc(sizeof(struct schedule_s));
+	sch->service = strdup(service);
+	sch->file = file ? strdup(file) : NULL;
+	sch->start = start;
+	sch->stop = start + (int64_t) minutes * 60;
+	sch->next = schedule;
+	schedule = sch;
+}
+
+/*
+ * Claim a table slot, reusing finished recordings if needed.
+ */
+static struct record_s* claimSlot(void) {
+	int i, pass;
+	uint32_t expected;
+	struct record_s *rec;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < RECORD_SLOTS; i++) {
+			rec = &table->slot[i];
+			expected = STATS_GET(rec->state);
+			if (!(expected == REC_FREE || (pass == 1 &&
+			      (expected == REC_DONE || expected == REC_FAILED))))
+				continue;
+			if (__atomic_compare_exchange_n(&rec->state, &expected,
+					REC_CLAIMED, 0, __ATOMIC_ACQUIRE,
+					__ATOMIC_RELAXED))
+				return rec;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * File names may come from HTTP requests, so keep them inside recorddir.
+ */
+static int validFile(const char *file) {
+	return file[0] != '\0' && file[0] != '.' && index(file, '/') == NULL;
+}
+
+static struct record_s* addRecording(const char *service, int64_t start,
+		int64_t stop, const char *file) {
+	struct record_s *rec;
+	struct tm tm;
+	time_t t = start;
+	char stamp[32];
+
+	rec = claimSlot();
+	if (rec == NULL) {
+		logger(LOG_ERROR, "No free recording slot for %s\n", service);
+		return NULL;
+	}
+	rec->id = __atomic_add_fetch(&table->seq, 1, __ATOMIC_RELAXED);
+	snprintf(rec->service, sizeof(rec->service), "%s", service);
+	if (file) {
+		snprintf(rec->path, sizeof(rec->path), "%s/%s",
+				conf_recorddir, file);
+	} else {
+		localtime_r(&t, &tm);
+		strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+		snprintf(rec->path, sizeof(rec->path), "%s/%s-%s.ts",
+				conf_recorddir, service, stamp);
+	}
+	rec->start = start;
+	rec->stop = stop;
+	rec->bytes = 0;
+	rec->writer = 0;
+	__atomic_store_n(&rec->state, REC_SCHEDULED, __ATOMIC_RELEASE);
+	return rec;
+}
+
+/*
+ * Create the shared recording table and fill in the schedule, or
+ * take over the one of the image before an upgrade.
+ * Called by the main process before forking.
+ */
+void recordInit(void) {
+	struct schedule_s *sch;
+	void *p;
+	int fresh;
+
+	p = sharedMap("records", sizeof(struct record_table_s), -1, &fresh);
+	if (p == NULL)
+		return;
+	table = p;
+
+	while (schedule) {
+		sch = schedule;
+		schedule = sch->next;
+		/* A table taken over has it already */
+		if (fresh && sch->stop > time(NULL))
+			addRecording(sch->service, sch->start, sch->stop,
+					sch->file);
+		free(sch->service);
+		free(sch->file);
+		free(sch);
+	}
+}
+
+/*
+ * Check whether the service has a recording that should be running.
+ */
+int recordNeeded(const struct services_s *service) {
+	int i;
+	uint32_t state;
+	int64_t now = time(NULL);
+	struct record_s *rec;
+
+	if (table == NULL)
+		return 0;
+	for (i = 0; i < RECORD_SLOTS; i++) {
+		rec = &table->slot[i];
+		state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+		if (state == REC_RUNNING ||
+		    (state == REC_SCHEDULED && rec->start <= now &&
+		     (rec->stop == 0 || rec->stop > now))) {
+			if (strcmp(rec->service, service->url) == 0)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Expire missed recordings and make sure services being recorded
+ * have a feeder. Called by the main process about once a second.
+ */
+void recordsCheck(void) {
+	int i;
+	uint32_t state;
+	int64_t now = time(NULL);
+	struct record_s *rec;
+	struct services_s *servi;
+
+	if (table == NULL)
+		return;
+	for (i = 0; i < RECORD_SLOTS; i++) {
+		rec = &table->slot[i];
+		state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+		if (state == REC_SCHEDULED && rec->stop != 0 &&
+		    STATS_GET(rec->stop) <= now) {
+			logger(LOG_ERROR, "Recording %s missed\n", rec->path);
+			__atomic_compare_exchange_n(&rec->state, &state,
+				REC_FAILED, 0, __ATOMIC_RELEASE,
+				__ATOMIC_RELAXED);
+			continue;
+		}
+		if (!(state == REC_RUNNING ||
+		      (state == REC_SCHEDULED && rec->start <= now)))
+			continue;
+		for (servi = services; servi; servi = servi->next) {
+			if (strcmp(rec->service, servi->url) == 0) {
+				feederEnsure(servi);
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Fail recordings of a feeder which died. Called by the main process.
+ */
+void recordFeederDied(pid_t pid) {
+	int i;
+	struct record_s *rec;
+
+	if (table == NULL)
+		return;
+	for (i = 0; i < RECORD_SLOTS; i++) {
+		rec = &table->slot[i];
+		if (STATS_GET(rec->state) == REC_RUNNING && rec->writer == pid)
+			__atomic_store_n(&rec->state, REC_FAILED,
+					__ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Wait for buffer to be written.
+ */
+static void writerWait(struct recwriter_s *w, int i) {
+	const struct aiocb *list[1];
+	ssize_t r;
+	int err;
+
+	if (!w->inflight[i])
+		return;
+	list[0] = &w->cb[i];
+	while ((err = aio_error(&w->cb[i])) == EINPROGRESS)
+		aio_suspend(list, 1, NULL);
+	r = aio_return(&w->cb[i]);
+	if (r != w->cb[i].aio_nbytes) {
+		logger(LOG_ERROR, "Recording %s: write failed: %s\n",
+				w->rec->path, r < 0 ? strerror(err) : "short");
+		w->failed = 1;
+	} else if (!w->direct) {
+		/* Do not let finished data sit in the page cache */
+		sync_file_range(w->fd, w->cb[i].aio_offset, r,
+				SYNC_FILE_RANGE_WRITE);
+		posix_fadvise(w->fd, w->cb[i].aio_offset, r,
+				POSIX_FADV_DONTNEED);
+	}
+	w->inflight[i] = 0;
+}
+
+/*
+ * Queue the current buffer for writing and switch to the next one.
+ */
+static void writerFlush(struct recwriter_s *w) {
+	struct aiocb *cb = &w->cb[w->cur];
+
+	memset(cb, 0, sizeof(*cb));
+	cb->aio_fildes = w->fd;
+	cb->aio_buf = w->buf[w->cur];
+	cb->aio_nbytes = w->fill;
+	cb->aio_offset = w->off;
+	cb->aio_sigevent.sigev_notify = SIGEV_NONE;
+	if (aio_write(cb) < 0) {
+		if (pwrite(w->fd, w->buf[w->cur], w->fill, w->off) != w->fill)
+			w->failed = 1;
+	} else {
+		w->inflight[w->cur] = 1;
+	}
+	w->off += w->fill;
+	w->fill = 0;
+	w->cur = (w->cur + 1) % RECORD_NBUF;
+	writerWait(w, w->cur);
+}
+
+static int writerOpen(struct recwriter_s *w, struct record_s *rec) {
+	int i;
+
+	memset(w, 0, sizeof(*w));
+	w->rec = rec;
+	w->direct = 1;
+	w->fd = open(rec->path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if (w->fd < 0 && errno == EINVAL) {
+		/* Filesystem without direct I/O, e.g. tmpfs */
+		w->direct = 0;
+		w->fd = open(rec->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (w->fd < 0) {
+		logger(LOG_ERROR, "Cannot open recording %s: %s\n",
+				rec->path, strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < RECORD_NBUF; i++) {
+		if (posix_memalign((void **) &w->buf[i], RECORD_ALIGN,
+				RECORD_BUFSIZE)) {
+			while (i--)
+				free(w->buf[i]);
+			close(w->fd);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void writerClose(struct recwriter_s *w) {
+	int i;
+
+	for (i = 0; i < RECORD_NBUF; i++)
+		writerWait(w, i);
+	if (w->fill > 0) {
+		/* Unaligned tail can not go through O_DIRECT */
+		if (w->direct)
+			fcntl(w->fd, F_SETFL,
+				fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+		if (pwrite(w->fd, w->buf[w->cur], w->fill, w->off) != w->fill)
+			w->failed = 1;
+	}
+	close(w->fd);
+	for (i = 0; i < RECORD_NBUF; i++)
+		free(w->buf[i]);
+	logger(LOG_INFO, "Recording %s finished, %llu bytes\n", w->rec->path,
+			(unsigned long long) STATS_GET(w->rec->bytes));
+	__atomic_store_n(&w->rec->state, w->failed ? REC_FAILED : REC_DONE,
+			__ATOMIC_RELEASE);
+}
+
+/*
+ * Start and stop recordings of the service. Called by the feeder
+ * about once a second.
+ */
+void recordTick(const struct services_s *service) {
+	int i;
+	int64_t now = time(NULL);
+	uint32_t expected;
+	struct record_s *rec;
+	struct recwriter_s *w;
+
+	if (table == NULL)
+		return;
+
+	for (i = 0; i < nwriters; ) {
+		w = &writers[i];
+		if (w->failed || (STATS_GET(w->rec->stop) != 0 &&
+				  STATS_GET(w->rec->stop) <= now)) {
+			writerClose(w);
+			writers[i] = writers[--nwriters];
+			continue;
+		}
+		i++;
+	}
+
+	for (i = 0; i < RECORD_SLOTS && nwriters < RECORD_WRITERS; i++) {
+		rec = &table->slot[i];
+		expected = REC_SCHEDULED;
+		if (STATS_GET(rec->state) != REC_SCHEDULED ||
+		    rec->start > now ||
+		    strcmp(rec->service, service->url) != 0)
+			continue;
+		if (!__atomic_compare_exchange_n(&rec->state, &expected,
+				REC_RUNNING, 0, __ATOMIC_ACQUIRE,
+				__ATOMIC_RELAXED))
+			continue;
+		rec->writer = getpid();
+		if (writerOpen(&writers[nwriters], rec) < 0) {
+			__atomic_store_n(&rec->state, REC_FAILED,
+					__ATOMIC_RELEASE);
+			continue;
+		}
+		logger(LOG_INFO, "Recording %s into %s%s\n", service->url,
+				rec->path, writers[nwriters].direct ?
+				" (direct I/O)" : "");
+		nwriters++;
+	}
+}
+
+/*
+ * Number of recordings the feeder is writing
+ */
+int recordActive(void) {
+	return nwriters;
+}
+
+/*
+ * Append stream data to all running recordings of the feeder.
+ */
+void recordWrite(const uint8_t *buf, size_t len) {
+	int i;
+	size_t n, left;
+	const uint8_t *p;
+	struct recwriter_s *w;
+
+	for (i = 0; i < nwriters; i++) {
+		w = &writers[i];
+		p = buf;
+		left = len;
+		while (left > 0) {
+			n = min(left, RECORD_BUFSIZE - w->fill);
+			memcpy(w->buf[w->cur] + w->fill, p, n);
+			w->fill += n;
+			p += n;
+			left -= n;
+			if (w->fill == RECORD_BUFSIZE)
+				writerFlush(w);
+		}
+		STATS_ADD(w->rec->bytes, len);
+	}
+}
+
+static void listRecordings(FILE *f) {
+	int i;
+	uint32_t state;
+	struct record_s *rec;
+
+	for (i = 0; i < RECORD_SLOTS; i++) {
+		rec = &table->slot[i];
+		state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+		if (state < REC_SCHEDULED)
+			continue;
+		fprintf(f, "%u %s %s %lld %lld %llu %s\n", rec->id,
+			stateNames[state], rec->service,
+			(long long) rec->start, (long long) rec->stop,
+			(unsigned long long) STATS_GET(rec->bytes), rec->path);
+	}
+}
+
+/*
+ * Handle /record control request:
+ *   ?action=start&service=<url>[&duration=<min>][&start=<time>][&file=<name>]
+ *   ?action=stop&id=<id>
+ *   ?action=list (default)
+ * Answer is written to f as plain text.
+ *
+ * @returns 0 on success, -1 for bad request
+ */
+int recordControl(const char *query, FILE *f) {
+	char *action, *name, *value;
+	struct services_s *servi;
+	struct record_s *rec;
+	int64_t start, stop;
+	uint32_t id, state;
+	int i, ret = -1;
+
+	if (!conf_recordapi || table == NULL)
+		return -1;
+
+	action = query ? queryParam(query, "action") : NULL;
+	if (action == NULL || strcmp(action, "list") == 0) {
+		listRecordings(f);
+		ret = 0;
+	} else if (strcmp(action, "start") == 0) {
+		name = queryParam(query, "service");
+		for (servi = services; name && servi; servi = servi->next) {
+			if (strcmp(name, servi->url) == 0)
+				break;
+		}
+		start = time(NULL);
+		stop = 0;
+		if ((value = queryParam(query, "start")) != NULL) {
+			start = atoll(value);
+			free(value);
+		}
+		if ((value = queryParam(query, "duration")) != NULL) {
+			stop = start + atoll(value) * 60;
+			free(value);
+		}
+		value = queryParam(query, "file");
+		if (servi && (value == NULL || validFile(value)) &&
+		    (rec = addRecording(servi->url, start, stop, value))) {
+			fprintf(f, "%u %s\n", rec->id, rec->path);
+			ret = 0;
+		}
+		free(value);
+		free(name);
+	} else if (strcmp(action, "stop") == 0) {
+		value = queryParam(query, "id");
+		id = value ? atol(value) : 0;
+		free(value);
+		for (i = 0; id && i < RECORD_SLOTS; i++) {
+			rec = &table->slot[i];
+			state = STATS_GET(rec->state);
+			if (rec->id != id ||
+			    (state != REC_RUNNING && state != REC_SCHEDULED))
+				continue;
+			STATS_SET(rec->stop, (int64_t) time(NULL));
+			if (state == REC_SCHEDULED)
+				__atomic_compare_exchange_n(&rec->state, &state,
+					REC_DONE, 0, __ATOMIC_RELEASE,
+					__ATOMIC_RELAXED);
+			fprintf(f, "%u stopped\n", id);
+			ret = 0;
+			break;
+		}
+	}
+	free(action);
+	return ret;
+}
@@ -0,0 +1,536 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Unicast RTP/UDP relay.
+ *
+ * Relay destinations live in a table shared by all processes, filled
+ * from relay= service options and through the /relay URL. The feeder of
+ * the service forwards the received datagrams, unchanged, to all
+ * destinations of the service.
+ *
+ * Datagrams are collected into a batch, which is sent with a single
+ * sendmmsg() call. Where the kernel supports UDP segmentation offload,
+ * runs of equally sized datagrams go to one destination as a single
+ * UDP_SEGMENT message and are split by the kernel or the NIC.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#define RELAY_SLOTS 64
+/* Destinations of one service */
+#define RELAY_DESTS 16
+/* Datagrams collected before they are sent */
+#define RELAY_BATCH 64
+#define RELAY_MTU 2000
+/* Limits of one UDP_SEGMENT message */
+#define RELAY_GSO_SEGS 64
+#define RELAY_GSO_BYTES 65000
+#define RELAY_MSGS (RELAY_DESTS * RELAY_BATCH)
+
+enum relay_state {
+	RELAY_FREE = 0,
+	RELAY_CLAIMED, /* being filled in */
+	RELAY_ACTIVE
+};
+
+struct relay_s {
+	uint32_t state;
+	uint32_t id;
+	char service[STATS_URL_LEN];
+	char dest[STATS_URL_LEN]; /* as given, for listing */
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int64_t stop; /* unix time, 0 for unlimited */
+	uint64_t packets;
+	uint64_t bytes;
+};
+
+struct relay_table_s {
+	uint32_t seq;
+	struct relay_s slot[RELAY_SLOTS];
+};
+
+/*
+ * Linked list of relays from the config file
+ */
+struct relayconf_s {
+	char *service;
+	char *dest;
+	struct relayconf_s *next;
+};
+
+static struct relay_table_s *table = NULL;
+static struct relayconf_s *relayconf = NULL;
+
+/* Feeder state */
+static struct relay_s *dests[RELAY_DESTS];
+static int ndests;
+static int sock4 = -1, sock6 = -1;
+static int gso = 1;
+static uint8_t batch[RELAY_BATCH * RELAY_MTU];
+static size_t batchlen[RELAY_BATCH];
+static int nbatch;
+static size_t batchfill;
+
+/*
+ * Add relay destination of a service. Called while parsing the
+ * config file.
+ */
+void relayConfigure(const char *service, const char *dest) {
+	struct relayconf_s *rc;
+
+	rc = malloc(sizeof(struct relayconf_s));
+	rc->service = strdup(service);
+	rc->dest = strdup(dest);
+	rc->next = relayconf;
+	relayconf = rc;
+}
+
+/*
+ * Resolve host:port or [host]:port
+ * @returns 0 on success
+ */
+static int parseDest(const char *dest, struct sockaddr_storage *addr,
+		socklen_t *addrlen) {
+	struct addrinfo hints, *res;
+	char *host, *port;
+
+	host = strdupa(dest);
+	port = rindex(host, ':');
+	if (port == NULL)
+		return -1;
+	*port++ = '\0';
+	if (host[0] == '[' && host[strlen(host)-1] == ']') {
+		host[strlen(host)-1] = '\0';
+		host++;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	if (getaddrinfo(host, port, &hints, &res) != 0)
+		return -1;
+	memcpy(addr, res->ai_addr, res->ai_addrlen);
+	*addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+	return 0;
+}
+
+static struct relay_s* addRelay(const char *service, const char *dest,
+		int64_t stop) {
+	struct relay_s *rel;
+	uint32_t expected;
+	int i;
+
+	for (i = 0; i < RELAY_SLOTS; i++) {
+		rel = &table->slot[i];
+		expected = RELAY_FREE;
+		if (__atomic_compare_exchange_n(&rel->state, &expected,
+				RELAY_CLAIMED, 0, __ATOMIC_ACQUIRE,
+				__ATOMIC_RELAXED))
+			break;
+	}
+	if (i == RELAY_SLOTS) {
+		logger(LOG_ERROR, "No free relay slot for %s\n", service);
+		return NULL;
+	}
+	if (parseDest(dest, &rel->addr, &rel->addrlen) < 0) {
+		logger(LOG_ERROR, "Invalid relay destination %s\n", dest);
+		__atomic_store_n(&rel->state, RELAY_FREE, __ATOMIC_RELEASE);
+		return NULL;
+	}
+	rel->id = __atomic_add_fetch(&table->seq, 1, __ATOMIC_RELAXED);
+	snprintf(rel->service, sizeof(rel->service), "%s", service);
+	snprintf(rel->dest, sizeof(rel->dest), "%s", dest);
+	rel->stop = stop;
+	rel->packets = 0;
+	rel->bytes = 0;
+	__atomic_store_n(&rel->state, RELAY_ACTIVE, __ATOMIC_RELEASE);
+	return rel;
+}
+
+/*
+ * Create the shared relay table and fill in configured relays, or
+ * take over the one of the image before an upgrade.
+ * Called by the main process before forking.
+ */
+void relayInit(void) {
+	struct relayconf_s *rc;
+	void *p;
+	int fresh;
+
+	p = sharedMap("relays", sizeof(struct relay_table_s), -1, &fresh);
+	if (p == NULL)
+		return;
+	table = p;
+
+	while (relayconf) {
+		rc = relayconf;
+		relayconf = rc->next;
+		/* A table taken over has them already */
+		if (fresh)
+			addRelay(rc->service, rc->dest, 0);
+		free(rc->service);
+		free(rc->dest);
+		free(rc);
+	}
+}
+
+static int relayLive(struct relay_s *rel, int64_t now) {
+	return __atomic_load_n(&rel->state, __ATOMIC_ACQUIRE) == RELAY_ACTIVE &&
+		(STATS_GET(rel->stop) == 0 || STATS_GET(rel->stop) > now);
+}
+
+/*
+ * Check whether the service has somewhere to relay to.
+ */
+int relayNeeded(const struct services_s *service) {
+	int i;
+	int64_t now = time(NULL);
+
+	if (table == NULL)
+		return 0;
+	for (i = 0; i < RELAY_SLOTS; i++) {
+		if (relayLive(&table->slot[i], now) &&
+		    strcmp(table->slot[i].service, service->url) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Free expired relays and make sure relayed services have a feeder.
+ * Called by the main process about once a second.
+ */
+void relaysCheck(void) {
+	int i;
+	int64_t now = time(NULL);
+	uint32_t state;
+	struct relay_s *rel;
+	struct services_s *servi;
+
+	if (table == NULL)
+		return;
+	for (i = 0; i < RELAY_SLOTS; i++) {
+		rel = &table->slot[i];
+		state = __atomic_load_n(&rel->state, __ATOMIC_ACQUIRE);
+		if (state != RELAY_ACTIVE)
+			continue;
+		if (!relayLive(rel, now)) {
+			logger(LOG_INFO, "Relay %u to %s ended\n",
+					rel->id, rel->dest);
+			__atomic_compare_exchange_n(&rel->state, &state,
+				RELAY_FREE, 0, __ATOMIC_RELEASE,
+				__ATOMIC_RELAXED);
+			continue;
+		}
+		for (servi = services; servi; servi = servi->next) {
+			if (strcmp(rel->service, servi->url) == 0) {
+				feederEnsure(servi);
+				break;
+			}
+		}
+	}
+}
+
+static int relaySocket(int family) {
+	int sock, seg;
+	socklen_t len = sizeof(seg);
+
+	sock = socket(family, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		logger(LOG_ERROR, "Cannot create relay socket: %s\n",
+				strerror(errno));
+		return -1;
+	}
+	if (gso && getsockopt(sock, SOL_UDP, UDP_SEGMENT, &seg, &len) < 0) {
+		logger(LOG_INFO, "UDP segmentation offload not available\n");
+		gso = 0;
+	}
+	return sock;
+}
+
+/*
+ * Pick up destinations of the service. Called by the feeder about
+ * once a second.
+ */
+void relayTick(const struct services_s *service) {
+	int i;
+	int64_t now = time(NULL);
+	struct relay_s *rel;
+
+	relayFlush();
+	ndests = 0;
+	if (table == NULL)
+		return;
+	for (i = 0; i < RELAY_SLOTS && ndests < RELAY_DESTS; i++) {
+		rel = &table->slot[i];
+		if (!relayLive(rel, now) ||
+		    strcmp(rel->service, service->url) != 0)
+			continue;
+		if (rel->addr.ss_family == AF_INET6 && sock6 < 0)
+			sock6 = relaySocket(AF_INET6);
+		if (rel->addr.ss_family == AF_INET && sock4 < 0)
+			sock4 = relaySocket(AF_INET);
+		dests[ndests++] = rel;
+	}
+}
+
+/*
+ * Queue a received datagram for relaying. Called by the feeder.
+ */
+void relayWrite(const uint8_t *buf, size_t len) {
+	if (ndests == 0 || len > RELAY_MTU)
+		return;
+	memcpy(batch + batchfill, buf, len);
+	batchlen[nbatch++] = len;
+	batchfill += len;
+	if (nbatch == RELAY_BATCH)
+		relayFlush();
+}
+
+/*
+ * Send all messages of one socket, retrying short sends. Returns the
+ * number of messages sent, fewer than n with errno set on failure.
+ */
+static int relaySend(int sock, struct mmsghdr *msgs, int n) {
+	int r, sent = 0;
+
+	while (sent < n) {
+		r = sendmmsg(sock, msgs + sent, n - sent, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			break;
+		sent += r;
+	}
+	return sent;
+}
+
+/*
+ * Send the batch to all destinations of the service.
+ */
+void relayFlush(void) {
+	static struct mmsghdr msgs[RELAY_MSGS];
+	static struct iovec iov[RELAY_BATCH];
+	static union {
+		char buf[CMSG_SPACE(sizeof(uint16_t))];
+		struct cmsghdr align;
+	} ctrl[RELAY_BATCH];
+	static short msgdest[RELAY_MSGS], msgrun[RELAY_MSGS];
+	struct cmsghdr *cm;
+	struct relay_s *rel;
+	int runlen[RELAY_BATCH], runfirst[RELAY_BATCH], nruns = 0;
+	int64_t now = time(NULL);
+	int i, j, d, n, sent, sock, family;
+	int fromdest = 0, fromseg = 0;
+	size_t off, bytes;
+
+	if (nbatch == 0 || ndests == 0) {
+		nbatch = 0;
+		batchfill = 0;
+		return;
+	}
+
+	family = 0;
+split:
+	/* Split the batch into runs which can go as one message */
+	nruns = 0;
+	off = 0;
+	for (i = 0; i < nbatch; ) {
+		bytes = batchlen[i];
+		for (j = i + 1; gso && j < nbatch &&
+		     j - i < RELAY_GSO_SEGS &&
+		     batchlen[j] <= batchlen[i] &&
+		     bytes + batchlen[j] <= RELAY_GSO_BYTES; j++) {
+			bytes += batchlen[j];
+			/* Only the last segment may be shorter */
+			if (batchlen[j] < batchlen[i]) {
+				j++;
+				break;
+			}
+		}
+		iov[nruns].iov_base = batch + off;
+		iov[nruns].iov_len = bytes;
+		runlen[nruns] = j - i;
+		runfirst[nruns] = i;
+		memset(&ctrl[nruns], 0, sizeof(ctrl[nruns]));
+		if (j - i > 1) {
+			cm = (struct cmsghdr *) ctrl[nruns].buf;
+			cm->cmsg_level = SOL_UDP;
+			cm->cmsg_type = UDP_SEGMENT;
+			cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			*(uint16_t *) CMSG_DATA(cm) = batchlen[i];
+		}
+		off += bytes;
+		nruns++;
+		i = j;
+	}
+
+	/* Resumes at fromdest/fromseg after a segmentation failure */
+	for (; family < 2; family++, fromdest = 0, fromseg = 0) {
+		sock = family ? sock6 : sock4;
+		if (sock < 0)
+			continue;
+		n = 0;
+		for (d = fromdest; d < ndests; d++) {
+			rel = dests[d];
+			if (rel->addr.ss_family != (family ? AF_INET6 : AF_INET) ||
+			    !relayLive(rel, now))
+				continue;
+			for (i = 0; i < nruns; i++) {
+				if (d == fromdest && runfirst[i] < fromseg)
+					continue;
+				memset(&msgs[n], 0, sizeof(msgs[n]));
+				msgs[n].msg_hdr.msg_name = &rel->addr;
+				msgs[n].msg_hdr.msg_namelen = rel->addrlen;
+				msgs[n].msg_hdr.msg_iov = &iov[i];
+				msgs[n].msg_hdr.msg_iovlen = 1;
+				if (runlen[i] > 1) {
+					msgs[n].msg_hdr.msg_control = ctrl[i].buf;
+					msgs[n].msg_hdr.msg_controllen =
+						sizeof(ctrl[i].buf);
+				}
+				msgdest[n] = d;
+				msgrun[n] = i;
+				n++;
+			}
+		}
+		if (n == 0)
+			continue;
+		sent = relaySend(sock, msgs, n);
+		for (i = 0; i < sent; i++) {
+			rel = dests[msgdest[i]];
+			STATS_ADD(rel->packets, runlen[msgrun[i]]);
+			STATS_ADD(rel->bytes, iov[msgrun[i]].iov_len);
+		}
+		if (sent == n)
+			continue;
+		if (gso && (errno == EIO || errno == EINVAL)) {
+			/* Device can not do it after all, send the rest
+			 * of this socket one datagram a message */
+			logger(LOG_INFO, "UDP segmentation offload "
+				"failed, disabling it\n");
+			gso = 0;
+			fromdest = msgdest[sent];
+			fromseg = runfirst[msgrun[sent]];
+			goto split;
+		}
+		logger(LOG_DEBUG, "Relay send failed: %s\n",
+				strerror(errno));
+	}
+	nbatch = 0;
+	batchfill = 0;
+}
+
+static void listRelays(FILE *f) {
+	int i;
+	struct relay_s *rel;
+
+	for (i = 0; i < RELAY_SLOTS; i++) {
+		rel = &table->slot[i];
+		if (STATS_GET(rel->state) != RELAY_ACTIVE)
+			continue;
+		fprintf(f, "%u %s %s %lld %llu %llu\n", rel->id, rel->service,
+			rel->dest, (long long) rel->stop,
+			(unsigned long long) STATS_GET(rel->packets),
+			(unsigned long long) STATS_GET(rel->bytes));
+	}
+}
+
+/*
+ * Handle /relay control request:
+ *   ?action=add&service=<url>&dest=<host>:<port>[&duration=<min>]
+ *   ?action=remove&id=<id>
+ *   ?action=list (default)
+ * Answer is written to f as plain text.
+ *
+ * @returns 0 on success, -1 for bad request
+ */
+int relayControl(const char *query, FILE *f) {
+	char *action, *name, *dest, *value;
+	struct services_s *servi;
+	struct relay_s *rel;
+	int64_t stop = 0;
+	uint32_t id;
+	int i, ret = -1;
+
+	if (!conf_relayapi || table == NULL)
+		return -1;
+
+	action = query ? queryParam(query, "action") : NULL;
+	if (action == NULL || strcmp(action, "list") == 0) {
+		listRelays(f);
+		ret = 0;
+	} else if (strcmp(action, "add") == 0) {
+		name = queryParam(query, "service");
+		for (servi = services; name && servi; servi = servi->next) {
+			if (strcmp(name, servi->url) == 0)
+				break;
+		}
+		if ((value = queryParam(query, "duration")) != NULL) {
+			stop = time(NULL) + atoll(value) * 60;
+			free(value);
+		}
+		dest = queryParam(query, "dest");
+		if (servi && dest && (rel = addRelay(servi->url, dest, stop))) {
+			fprintf(f, "%u %s\n", rel->id, rel->dest);
+			ret = 0;
+		}
+		free(dest);
+		free(name);
+	} else if (strcmp(action, "remove") == 0) {
+		value = queryParam(query, "id");
+		id = value ? atol(value) : 0;
+		free(value);
+		for (i = 0; id && i < RELAY_SLOTS; i++) {
+			rel = &table->slot[i];
+			if (rel->id != id ||
+			    STATS_GET(rel->state) != RELAY_ACTIVE)
+				continue;
+			/* The main process frees the slot */
+			STATS_SET(rel->stop, (int64_t) time(NULL));
+			fprintf(f, "%u removed\n", id);
+			ret = 0;
+			break;
+		}
+	}
+	free(action);
+	return ret;
+}
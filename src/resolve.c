@@ -0,0 +1,238 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Deferred resolution of service addresses.
+ *
+ * Numeric addresses are parsed while the configuration is read, host
+ * names are not looked up there, so a long channel list loads at once
+ * even when DNS is slow or down. The main process looks all of them up
+ * in parallel in the background and hands the results to the processes
+ * it forks afterwards. A process needing a service whose name is not
+ * resolved yet looks it up itself, blocking only that process.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+/* Seconds before a failed background lookup is tried again */
+#define RESOLVE_RETRY 30
+
+struct lookup_s {
+	struct services_s *service;
+	int source; /* of msrc_addr, not addr */
+	struct addrinfo hints;
+	struct gaicb cb;
+	time_t retry; /* 0 while in progress or done */
+};
+
+static struct lookup_s *lookups = NULL;
+static int nlookups = 0;
+
+static int socktype(const struct services_s *service) {
+	return SERVICE_PULLED(service) ? SOCK_STREAM : SOCK_DGRAM;
+}
+
+/*
+ * Parse a numeric address, leaving host names for later.
+ * @param res set to the address, or to NULL for a host name
+ * @returns 0 or a getaddrinfo() error
+ */
+int resolveNumeric(const char *host, const char *port, int type,
+		struct addrinfo **res) {
+	struct addrinfo hints;
+	unsigned char buf[sizeof(struct in6_addr)];
+	int r;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = type;
+	hints.ai_flags = AI_NUMERICHOST;
+	*res = NULL;
+	r = getaddrinfo(host, port, &hints, res);
+	if (r == EAI_NONAME && inet_pton(AF_INET, host, buf) != 1 &&
+	    inet_pton(AF_INET6, host, buf) != 1) {
+		*res = NULL;
+		return 0;
+	}
+	return r;
+}
+
+/*
+ * Make sure the addresses of the service are known, looking up names
+ * not resolved yet.
+ * @returns 0 on success
+ */
+int serviceResolve(struct services_s *service) {
+	struct addrinfo hints;
+	int r;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = socktype(service);
+	if (service->addr == NULL && service->host) {
+		r = getaddrinfo(service->host, service->port, &hints,
+				&service->addr);
+		if (r) {
+			logger(LOG_ERROR, "Cannot resolve %s of service %s. "
+				"GAI: %s\n", service->host, service->url,
+				gai_strerror(r));
+			service->addr = NULL;
+			return -1;
+		}
+	}
+	if (service->msrc_addr == NULL && service->srchost) {
+		r = getaddrinfo(service->srchost, service->srcport, &hints,
+				&service->msrc_addr);
+		if (r) {
+			logger(LOG_ERROR, "Cannot resolve %s of service %s. "
+				"GAI: %s\n", service->srchost, service->url,
+				gai_strerror(r));
+			service->msrc_addr = NULL;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Start lookups. The threads doing them are created with all signals
+ * blocked, so that signal handlers keep running in the main thread.
+ */
+static int lookupAll(struct gaicb **list, int n) {
+	sigset_t all, old;
+	int r;
+
+	sigfillset(&all);
+	sigprocmask(SIG_BLOCK, &all, &old);
+	r = getaddrinfo_a(GAI_NOWAIT, list, n, NULL);
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	return r;
+}
+
+static void lookupStart(struct lookup_s *l) {
+	struct gaicb *list[1] = { &l->cb };
+	int r;
+
+	l->retry = 0;
+	r = lookupAll(list, 1);
+	if (r) {
+		logger(LOG_ERROR, "Cannot look up %s: %s\n", l->cb.ar_name,
+			gai_strerror(r));
+		l->retry = time(NULL) + RESOLVE_RETRY;
+	}
+}
+
+/*
+ * Start looking up all host names of services in the background.
+ * Called by the main process after the configuration is read.
+ */
+void resolveStart(void) {
+	struct services_s *servi;
+	struct lookup_s *l;
+	struct gaicb **list;
+	int i, r;
+
+	for (servi = services; servi; servi = servi->next)
+		nlookups += (servi->addr == NULL && servi->host != NULL) +
+			(servi->msrc_addr == NULL && servi->srchost != NULL);
+	if (nlookups == 0)
+		return;
+	lookups = calloc(nlookups, sizeof(struct lookup_s));
+	list = calloc(nlookups, sizeof(struct gaicb *));
+	if (lookups == NULL || list == NULL) {
+		logger(LOG_ERROR, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	l = lookups;
+	for (servi = services; servi; servi = servi->next) {
+		for (i = 0; i < 2; i++) {
+			if (i == 0 && (servi->addr || servi->host == NULL))
+				continue;
+			if (i == 1 && (servi->msrc_addr ||
+			    servi->srchost == NULL))
+				continue;
+			l->service = servi;
+			l->source = i;
+			l->hints.ai_socktype = socktype(servi);
+			l->cb.ar_name = i ? servi->srchost : servi->host;
+			l->cb.ar_service = i ? servi->srcport : servi->port;
+			l->cb.ar_request = &l->hints;
+			list[l - lookups] = &l->cb;
+			l++;
+		}
+	}
+	logger(LOG_INFO, "Looking up %d host names\n", nlookups);
+	r = lookupAll(list, nlookups);
+	if (r) {
+		logger(LOG_ERROR, "Cannot look up host names: %s\n",
+			gai_strerror(r));
+		for (i = 0; i < nlookups; i++)
+			lookups[i].retry = time(NULL) + RESOLVE_RETRY;
+	}
+	free(list);
+}
+
+/*
+ * Take over finished lookups and retry failed ones. Called by the
+ * main process once a second.
+ */
+void resolveCheck(void) {
+	struct lookup_s *l;
+	struct addrinfo **addr;
+	int r;
+
+	for (l = lookups; l < lookups + nlookups; l++) {
+		addr = l->source ? &l->service->msrc_addr : &l->service->addr;
+		if (*addr != NULL)
+			continue;
+		if (l->retry) {
+			if (time(NULL) >= l->retry)
+				lookupStart(l);
+			continue;
+		}
+		r = gai_error(&l->cb);
+		if (r == EAI_INPROGRESS)
+			continue;
+		if (r == 0) {
+			*addr = l->cb.ar_result;
+			logger(LOG_DEBUG, "Resolved %s of service %s\n",
+				l->cb.ar_name, l->service->url);
+			continue;
+		}
+		logger(LOG_ERROR, "Cannot resolve %s of service %s. GAI: %s\n",
+			l->cb.ar_name, l->service->url, gai_strerror(r));
+		l->retry = time(NULL) + RESOLVE_RETRY;
+	}
+}
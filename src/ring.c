@@ -0,0 +1,333 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Memory mapped stream ring.
+ *
+ * One writer appends stream data to a file backed ring buffer. Positions
+ * are absolute byte counts since the ring was created, so a reader can
+ * tell by comparing its position with the head how much it is behind and
+ * whether the data it wants was already overwritten. Next to the data,
+ * the ring keeps an index of (time, position) pairs, marking random
+ * access points, so readers can seek in time.
+ *
+ * Readers may map the file as well, or use sendfile() on it, so the data
+ * is read from the page cache without copying through user space.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#define min(a,b) ((a)<(b) ? (a):(b))
+
+#define RING_MAGIC 0x52494e47 /* "RING" */
+#define RING_VERSION 1
+
+/* Minimal distance of two index entries */
+#define INDEX_RAP_MS 100
+/* Maximal distance of two index entries */
+#define INDEX_MAX_MS 1000
+
+static long futex(uint32_t *uaddr, int op, uint32_t val,
+		const struct timespec *timeout) {
+	return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+static size_t pageAlign(size_t len) {
+	long page = sysconf(_SC_PAGESIZE);
+	return (len + page - 1) / page * page;
+}
+
+/*
+ * Real time in milliseconds
+ */
+int64_t nowMs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct ring_s* ringMap(int fd, size_t maplen, int prot) {
+	struct ring_s *r;
+	void *p;
+
+	p = mmap(NULL, maplen, prot, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		logger(LOG_ERROR, "Cannot map ring: %s\n", strerror(errno));
+		return NULL;
+	}
+	r = malloc(sizeof(struct ring_s));
+	memset(r, 0, sizeof(*r));
+	r->fd = fd;
+	r->hdr = p;
+	r->maplen = maplen;
+	return r;
+}
+
+/*
+ * Create a new ring file, replacing the old one.
+ *
+ * @param path file name
+ * @param size size of the data area
+ * @param seconds how long the ring is expected to last, for index sizing
+ * @param extlen size of extension area for the user of the ring
+ * @returns ring or NULL on failure
+ */
+struct ring_s* ringCreate(const char *path, uint64_t size, uint32_t seconds,
+		size_t extlen) {
+	int fd;
+	size_t hdrlen, extoff;
+	struct ring_s *r;
+	char *tmp;
+	uint32_t nindex;
+
+	nindex = seconds * (1000 / INDEX_RAP_MS) + 64;
+	extoff = sizeof(struct ring_hdr_s) +
+		nindex * sizeof(struct ring_index_s);
+	extoff = (extoff + 63) & ~63;
+	hdrlen = pageAlign(extoff + extlen);
+	size = pageAlign(size);
+
+	/* Build the ring aside, so readers never open a half made one */
+	if (asprintf(&tmp, "%s.new", path) < 0)
+		return NULL;
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, hdrlen + size) < 0) {
+		logger(LOG_ERROR, "Cannot create ring %s: %s\n",
+				tmp, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		free(tmp);
+		return NULL;
+	}
+
+	r = ringMap(fd, hdrlen + size, PROT_READ | PROT_WRITE);
+	if (r == NULL) {
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return NULL;
+	}
+	r->hdr->version = RING_VERSION;
+	r->hdr->size = size;
+	r->hdr->nindex = nindex;
+	r->hdr->dataoff = hdrlen;
+	r->hdr->extoff = extoff;
+	r->hdr->extlen = extlen;
+	r->hdr->writer = getpid();
+	r->hdr->created = nowMs();
+	r->data = (uint8_t *) r->hdr + hdrlen;
+	__atomic_store_n(&r->hdr->magic, RING_MAGIC, __ATOMIC_RELEASE);
+
+	if (rename(tmp, path) < 0) {
+		logger(LOG_ERROR, "Cannot rename ring %s: %s\n",
+				tmp, strerror(errno));
+		unlink(tmp);
+		free(tmp);
+		ringClose(r);
+		return NULL;
+	}
+	free(tmp);
+	return r;
+}
+
+/*
+ * Open existing ring for reading.
+ */
+struct ring_s* ringOpen(const char *path) {
+	int fd;
+	struct stat sb;
+	struct ring_s *r;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0 || fstat(fd, &sb) < 0 ||
+			sb.st_size < sizeof(struct ring_hdr_s)) {
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	r = ringMap(fd, sb.st_size, PROT_READ | PROT_WRITE);
+	if (r == NULL) {
+		close(fd);
+		return NULL;
+	}
+	if (__atomic_load_n(&r->hdr->magic, __ATOMIC_ACQUIRE) != RING_MAGIC ||
+			r->hdr->version != RING_VERSION ||
+			r->hdr->dataoff + r->hdr->size > sb.st_size) {
+		logger(LOG_ERROR, "%s is not a valid ring\n", path);
+		ringClose(r);
+		return NULL;
+	}
+	r->data = (uint8_t *) r->hdr + r->hdr->dataoff;
+	return r;
+}
+
+/*
+ * Extension area of the ring, or NULL if it has none
+ */
+void* ringExt(const struct ring_s *r) {
+	if (r->hdr->extlen == 0)
+		return NULL;
+	return (uint8_t *) r->hdr + r->hdr->extoff;
+}
+
+void ringClose(struct ring_s *r) {
+	munmap(r->hdr, r->maplen);
+	close(r->fd);
+	free(r);
+}
+
+/*
+ * Append data to the ring. Should be called by the writer only.
+ *
+ * @param r ring
+ * @param buf data
+ * @param len data length, must be smaller than the ring
+ * @param rap offset of a random access point in buf or -1
+ */
+void ringWrite(struct ring_s *r, const uint8_t *buf, size_t len, int rap) {
+	struct ring_hdr_s *h = r->hdr;
+	uint64_t head = h->head;
+	uint64_t off = head % h->size;
+	size_t first;
+	int64_t now;
+
+	first = min(len, h->size - off);
+	memcpy(r->data + off, buf, first);
+	if (first < len)
+		memcpy(r->data, buf + first, len - first);
+
+	now = nowMs();
+	if ((rap >= 0 && now - r->lastindex >= INDEX_RAP_MS) ||
+			now - r->lastindex >= INDEX_MAX_MS) {
+		struct ring_index_s *e;
+		e = &h->index[h->indexhead % h->nindex];
+		e->time = now;
+		e->pos = head + (rap >= 0 ? rap : 0);
+		e->rap = rap >= 0;
+		__atomic_store_n(&h->indexhead, h->indexhead + 1,
+				__ATOMIC_RELEASE);
+		r->lastindex = now;
+	}
+
+	__atomic_store_n(&h->head, head + len, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&h->futex, 1, __ATOMIC_RELEASE);
+	if (__atomic_load_n(&h->waiters, __ATOMIC_ACQUIRE))
+		futex(&h->futex, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+uint64_t ringHead(const struct ring_s *r) {
+	return __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Oldest position that is safe to read. The writer may be just
+ * overwriting data right behind the tail, so keep some margin.
+ */
+uint64_t ringTail(const struct ring_s *r) {
+	uint64_t head = ringHead(r);
+	uint64_t avail = r->hdr->size - r->hdr->size / RING_MARGIN;
+
+	return head > avail ? head - avail : 0;
+}
+
+/*
+ * Find the random access point closest before the given time. Streams
+ * without random access indication are seeked by the periodic entries.
+ *
+ * @param r ring
+ * @param time unix time in ms
+ * @returns stream position, the oldest usable position if the time
+ * is too old, or the head if there is no usable index entry at all.
+ */
+uint64_t ringSeek(const struct ring_s *r, int64_t time) {
+	const struct ring_hdr_s *h = r->hdr;
+	uint64_t ih, i, first, tail;
+	uint64_t best[2] = { UINT64_MAX, UINT64_MAX };
+	uint64_t oldest[2] = { UINT64_MAX, UINT64_MAX };
+	const struct ring_index_s *e;
+	int rap;
+
+	ih = __atomic_load_n(&h->indexhead, __ATOMIC_ACQUIRE);
+	/* The oldest entry may be just being rewritten, skip it */
+	first = ih > h->nindex - 1 ? ih - (h->nindex - 1) : 0;
+	tail = ringTail(r);
+
+	for (i = ih; i > first; i--) {
+		e = &h->index[(i - 1) % h->nindex];
+		if (e->pos < tail)
+			break;
+		rap = e->rap ? 1 : 0;
+		oldest[rap] = e->pos;
+		if (e->time <= time && best[rap] == UINT64_MAX) {
+			best[rap] = e->pos;
+			if (rap)
+				break;
+		}
+	}
+	if (best[1] != UINT64_MAX)
+		return best[1];
+	if (oldest[1] != UINT64_MAX)
+		return oldest[1];
+	if (best[0] != UINT64_MAX)
+		return best[0];
+	if (oldest[0] != UINT64_MAX)
+		return oldest[0];
+	return ringHead(r);
+}
+
+/*
+ * Wait until there are data past pos.
+ *
+ * @returns 1 if there are new data, 0 on timeout
+ */
+int ringWait(struct ring_s *r, uint64_t pos, int timeout_ms) {
+	struct ring_hdr_s *h = r->hdr;
+	struct timespec ts;
+	uint32_t gen;
+
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+	__atomic_add_fetch(&h->waiters, 1, __ATOMIC_ACQ_REL);
+	gen = __atomic_load_n(&h->futex, __ATOMIC_ACQUIRE);
+	if (ringHead(r) <= pos)
+		futex(&h->futex, FUTEX_WAIT, gen, &ts);
+	__atomic_sub_fetch(&h->waiters, 1, __ATOMIC_ACQ_REL);
+	return ringHead(r) > pos;
+}
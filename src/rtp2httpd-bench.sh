@@ -0,0 +1,90 @@
+#!/bin/sh
+#
+# End to end benchmark of rtp2httpd on loopback.
+#
+# Starts rtp2httpd with one service per channel, feeds the channels from
+# rtp2httpd-gen and reads them with rtp2httpd-fleet. Prints a single
+# JSON object with the settings and the results of both.
+#
+# Usage: rtp2httpd-bench.sh [-d bindir] [-n clients] [-c channels]
+#        [-b kbit/s] [-l loss%] [-r reorder%] [-t seconds] [-p port]
+#        [-o "service options"] [-s stall_ms] [-R ramp_ms]
+
+bindir=.
+clients=10
+channels=2
+bitrate=8000
+loss=0
+reorder=0
+seconds=10
+port=18080
+options=
+stall=500
+ramp=10
+group=239.255.42.1
+mport=5004
+
+while getopts d:n:c:b:l:r:t:p:o:s:R: opt; do
+	case $opt in
+	d) bindir=$OPTARG ;;
+	n) clients=$OPTARG ;;
+	c) channels=$OPTARG ;;
+	b) bitrate=$OPTARG ;;
+	l) loss=$OPTARG ;;
+	r) reorder=$OPTARG ;;
+	t) seconds=$OPTARG ;;
+	p) port=$OPTARG ;;
+	o) options=$OPTARG ;;
+	s) stall=$OPTARG ;;
+	R) ramp=$OPTARG ;;
+	*) sed -n 's/^# \{0,1\}//p' "$0" | sed -n '/^Usage/,$p' >&2; exit 1 ;;
+	esac
+done
+
+tmp=$(mktemp -d) || exit 1
+trap 'kill $srv $gen 2>/dev/null; rm -rf "$tmp"' EXIT INT TERM
+
+# One service per channel, on consecutive groups
+conf=$tmp/rtp2httpd.conf
+{
+	echo "[global]"
+	echo "verbosity = 0"
+	echo "maxclients = $((clients + 16))"
+	echo "timeshiftdir = $tmp"
+	echo "hlsdir = $tmp"
+	echo "recorddir = $tmp"
+	echo "[services]"
+	i=0
+	base=${group%.*}
+	last=${group##*.}
+	while [ $i -lt "$channels" ]; do
+		echo "ch$i MRTP $base.$((last + i)) $mport $options"
+		i=$((i + 1))
+	done
+} > "$conf"
+
+"$bindir/rtp2httpd" -c "$conf" -D -q -l "127.0.0.1:$port" 2>"$tmp/server.log" &
+srv=$!
+sleep 1
+if ! kill -0 $srv 2>/dev/null; then
+	cat "$tmp/server.log" >&2
+	exit 1
+fi
+
+# Generator runs a bit longer than the fleet on both ends
+"$bindir/rtp2httpd-gen" -g $group -p $mport -c "$channels" -b "$bitrate" \
+	-l "$loss" -r "$reorder" -t $((seconds + 2)) > "$tmp/gen.json" &
+gen=$!
+sleep 1
+
+"$bindir/rtp2httpd-fleet" -P "$port" -n "$clients" -c "$channels" \
+	-t "$seconds" -s "$stall" -r "$ramp" -S $srv "/ch%d" > "$tmp/fleet.json"
+wait $gen
+
+printf '{"settings": {"clients": %d, "channels": %d, "bitrate_kbps": %d, ' \
+	"$clients" "$channels" "$bitrate"
+printf '"loss_pct": %s, "reorder_pct": %s, "seconds": %d, "ramp_ms": %d, ' \
+	"$loss" "$reorder" "$seconds" "$ramp"
+printf '"options": "%s"}, ' "$options"
+printf '"generator": %s, "fleet": %s}\n' "$(cat "$tmp/gen.json")" \
+	"$(cat "$tmp/fleet.json")"
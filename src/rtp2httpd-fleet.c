@@ -0,0 +1,356 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Fleet of HTTP clients for benchmarks.
+ *
+ * Opens N streams from one process with epoll, reads them for the given
+ * time and reports time to first byte, throughput and stalls per stream
+ * as JSON. Given the pid of the server, it also reports the CPU time
+ * the server and its children spent meanwhile.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#define max(a,b) ((a)>(b) ? (a):(b))
+
+#define READ_LEN 65536
+
+struct stream_s {
+	int fd;
+	char *path;
+	int connected;
+	int eof;
+	int hdrmatch; /* bytes of the header terminator seen */
+	int64_t start, first, last; /* ns */
+	uint64_t bytes;
+	int stalls;
+	int64_t maxgap;
+};
+
+static void usage(FILE *f, const char *prog) {
+	fprintf(f,
+"Usage: %s [options] <path>...\n"
+"\n"
+"Paths may contain %%d, replaced by the stream number modulo the\n"
+"channel count. Streams are spread over the paths round robin.\n"
+"\n"
+"Options:\n"
+"\t-h --help            Show this help\n"
+"\t-H --host <host>     Server address (default 127.0.0.1)\n"
+"\t-P --port <port>     Server port (default 8080)\n"
+"\t-n --clients <n>     Number of streams (default 1)\n"
+"\t-c --channels <n>    Channel count for %%d (default 1)\n"
+"\t-t --time <s>        Read for s seconds (default 10)\n"
+"\t-s --stall <ms>      Gap counted as a stall (default 500)\n"
+"\t-r --ramp <ms>       Delay between connections (default 0)\n"
+"\t-S --server <pid>    Measure CPU of this server process\n",
+		prog);
+}
+
+static int64_t monoNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * CPU ticks of the process, its reaped children and the ones running
+ */
+static uint64_t serverTicks(pid_t pid) {
+	char path[300], buf[1024], *p;
+	unsigned long utime, stime;
+	long cutime, cstime;
+	int ppid;
+	uint64_t ticks = 0;
+	DIR *d;
+	struct dirent *de;
+	FILE *f;
+
+	d = opendir("/proc");
+	if (d == NULL)
+		return 0;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] < '0' || de->d_name[0] > '9')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%s/stat", de->d_name);
+		f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		p = fgets(buf, sizeof(buf), f);
+		fclose(f);
+		if (p == NULL || (p = strrchr(buf, ')')) == NULL)
+			continue;
+		if (sscanf(p + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+				"%lu %lu %ld %ld", &ppid, &utime, &stime,
+				&cutime, &cstime) != 5)
+			continue;
+		if (atoi(de->d_name) == pid)
+			ticks += utime + stime + cutime + cstime;
+		else if (ppid == pid)
+			ticks += utime + stime;
+	}
+	closedir(d);
+	return ticks;
+}
+
+static int streamConnect(struct stream_s *st, const struct addrinfo *ai,
+		int ep) {
+	struct epoll_event ev;
+
+	st->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK,
+			ai->ai_protocol);
+	if (st->fd < 0)
+		return -1;
+	st->start = monoNs();
+	if (connect(st->fd, ai->ai_addr, ai->ai_addrlen) < 0 &&
+	    errno != EINPROGRESS) {
+		close(st->fd);
+		st->fd = -1;
+		return -1;
+	}
+	ev.events = EPOLLOUT | EPOLLIN;
+	ev.data.ptr = st;
+	epoll_ctl(ep, EPOLL_CTL_ADD, st->fd, &ev);
+	return 0;
+}
+
+static void streamEvent(struct stream_s *st, uint32_t events, int ep,
+		const char *host, int64_t stall) {
+	static char buf[READ_LEN];
+	struct epoll_event ev;
+	char req[512];
+	int64_t now;
+	ssize_t n, i;
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (!st->connected && (events & EPOLLOUT)) {
+		getsockopt(st->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err) {
+			st->eof = 1;
+			epoll_ctl(ep, EPOLL_CTL_DEL, st->fd, NULL);
+			return;
+		}
+		st->connected = 1;
+		snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\n"
+			"User-Agent: " PACKAGE "-fleet\r\n\r\n", st->path, host);
+		if (write(st->fd, req, strlen(req)) < 0) {
+			st->eof = 1;
+			return;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = st;
+		epoll_ctl(ep, EPOLL_CTL_MOD, st->fd, &ev);
+		return;
+	}
+	if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return;
+	while ((n = read(st->fd, buf, sizeof(buf))) > 0) {
+		now = monoNs();
+		if (st->first == 0)
+			st->first = now;
+		else if (now - st->last > stall && st->hdrmatch == 4)
+			st->stalls++;
+		if (st->hdrmatch == 4 && st->last)
+			st->maxgap = max(st->maxgap, now - st->last);
+		st->last = now;
+		/* Count the body only */
+		for (i = 0; i < n && st->hdrmatch < 4; i++)
+			st->hdrmatch = buf[i] == "\r\n\r\n"[st->hdrmatch] ?
+				st->hdrmatch + 1 : buf[i] == '\r';
+		st->bytes += n - i;
+	}
+	if (n == 0 || (n < 0 && errno != EAGAIN)) {
+		st->eof = 1;
+		epoll_ctl(ep, EPOLL_CTL_DEL, st->fd, NULL);
+	}
+}
+
+static int cmpll(const void *a, const void *b) {
+	int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+	const struct option longopts[] = {
+		{ "help",	no_argument, 0, 'h' },
+		{ "host",	required_argument, 0, 'H' },
+		{ "port",	required_argument, 0, 'P' },
+		{ "clients",	required_argument, 0, 'n' },
+		{ "channels",	required_argument, 0, 'c' },
+		{ "time",	required_argument, 0, 't' },
+		{ "stall",	required_argument, 0, 's' },
+		{ "ramp",	required_argument, 0, 'r' },
+		{ "server",	required_argument, 0, 'S' },
+		{ 0,		0, 0, 0}
+	};
+	int opt, option_index;
+	const char *host = "127.0.0.1", *port = "8080";
+	int nclients = 1, channels = 1, seconds = 10, stallms = 500, ramp = 0;
+	pid_t server = 0;
+	struct addrinfo hints, *ai;
+	struct stream_s *st;
+	struct epoll_event evs[64];
+	int ep, i, n, started = 0, failed = 0, ok = 0, stalled = 0;
+	int64_t begin, end, now, nextconn, *ttfb, maxgap = 0;
+	uint64_t ticks0 = 0, ticks1, totalbytes = 0;
+	double secs, kbps, minkbps = -1, maxkbps = 0, sumkbps = 0, cpu;
+	long hz = sysconf(_SC_CLK_TCK);
+	struct rlimit rl;
+
+	while ((opt = getopt_long(argc, argv, "hH:P:n:c:t:s:r:S:",
+			longopts, &option_index)) != -1) {
+		switch (opt) {
+			case 'h':
+				usage(stdout, argv[0]);
+				exit(EXIT_SUCCESS);
+			case 'H': host = optarg; break;
+			case 'P': port = optarg; break;
+			case 'n': nclients = atoi(optarg); break;
+			case 'c': channels = atoi(optarg); break;
+			case 't': seconds = atoi(optarg); break;
+			case 's': stallms = atoi(optarg); break;
+			case 'r': ramp = atoi(optarg); break;
+			case 'S': server = atoi(optarg); break;
+			default:
+				usage(stderr, argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (optind >= argc || nclients < 1 || channels < 1) {
+		usage(stderr, argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &ai) != 0) {
+		fprintf(stderr, "Cannot resolve %s\n", host);
+		exit(EXIT_FAILURE);
+	}
+	/* Every stream needs a descriptor */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+	    rl.rlim_cur < (rlim_t) nclients + 16) {
+		rl.rlim_cur = (rlim_t) nclients + 16 < rl.rlim_max ?
+			(rlim_t) nclients + 16 : rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	st = calloc(nclients, sizeof(struct stream_s));
+	ttfb = calloc(nclients, sizeof(int64_t));
+	for (i = 0; i < nclients; i++) {
+		st[i].fd = -1;
+		if (asprintf(&st[i].path, argv[optind + i % (argc - optind)],
+				i % channels) < 0)
+			exit(EXIT_FAILURE);
+	}
+
+	ep = epoll_create1(0);
+	if (server)
+		ticks0 = serverTicks(server);
+	begin = nextconn = monoNs();
+	end = begin + (int64_t) seconds * 1000000000LL;
+	while ((now = monoNs()) < end) {
+		while (started < nclients && now >= nextconn) {
+			if (streamConnect(&st[started], ai, ep) < 0)
+				st[started].eof = 1;
+			started++;
+			nextconn += (int64_t) ramp * 1000000;
+		}
+		n = epoll_wait(ep, evs, 64, started < nclients && ramp ?
+				ramp : 100);
+		for (i = 0; i < n; i++)
+			streamEvent(evs[i].data.ptr, evs[i].events, ep, host,
+					(int64_t) stallms * 1000000);
+	}
+	/* Streams which are silent at the end stalled too */
+	for (i = 0; i < started; i++) {
+		if (st[i].last && !st[i].eof &&
+		    end - st[i].last > (int64_t) stallms * 1000000) {
+			st[i].stalls++;
+			st[i].maxgap = max(st[i].maxgap, end - st[i].last);
+		}
+	}
+	secs = (double) (monoNs() - begin) / 1e9;
+	ticks1 = server ? serverTicks(server) : 0;
+
+	for (i = 0; i < nclients; i++) {
+		if (st[i].first == 0) {
+			failed++;
+			continue;
+		}
+		ttfb[ok++] = st[i].first - st[i].start;
+		totalbytes += st[i].bytes;
+		kbps = st[i].bytes * 8 / 1000.0 /
+			((double) (end - st[i].first) / 1e9);
+		sumkbps += kbps;
+		if (minkbps < 0 || kbps < minkbps)
+			minkbps = kbps;
+		if (kbps > maxkbps)
+			maxkbps = kbps;
+		if (st[i].stalls)
+			stalled++;
+		maxgap = max(maxgap, st[i].maxgap);
+		if (st[i].fd >= 0)
+			close(st[i].fd);
+	}
+	qsort(ttfb, ok, sizeof(int64_t), cmpll);
+	cpu = server ? (double) (ticks1 - ticks0) / hz / secs * 100 : 0;
+
+	printf("{\"clients\": %d, \"seconds\": %.3f, \"streams_ok\": %d, "
+		"\"streams_failed\": %d, \"bytes\": %llu, ",
+		nclients, secs, ok, failed, (unsigned long long) totalbytes);
+	printf("\"kbps\": {\"mean\": %.1f, \"min\": %.1f, \"max\": %.1f}, ",
+		ok ? sumkbps / ok : 0, max(minkbps, 0), maxkbps);
+	printf("\"ttfb_ms\": {\"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f}, ",
+		ok ? ttfb[ok / 2] / 1e6 : 0,
+		ok ? ttfb[(ok * 99) / 100] / 1e6 : 0,
+		ok ? ttfb[ok - 1] / 1e6 : 0);
+	printf("\"stalled_streams\": %d, \"max_gap_ms\": %.3f, ",
+		stalled, maxgap / 1e6);
+	if (server)
+		printf("\"server_cpu_pct\": %.2f, "
+			"\"server_cpu_pct_per_stream\": %.4f}\n",
+			cpu, ok ? cpu / ok : 0);
+	else
+		printf("\"server_cpu_pct\": null, "
+			"\"server_cpu_pct_per_stream\": null}\n");
+	freeaddrinfo(ai);
+	return failed == nclients ? EXIT_FAILURE : EXIT_SUCCESS;
+}
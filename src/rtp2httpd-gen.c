@@ -0,0 +1,310 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Synthetic multicast source for benchmarks.
+ *
+ * Sends one RTP/MPEG-TS stream per channel to consecutive multicast
+ * groups. Each datagram carries seven TS packets. The streams have a
+ * PAT and PMT every 100 ms and a PCR with a random access point every
+ * 40 ms, so timeshift, HLS and pacing have something to work with.
+ * Loss and reordering are simulated on the sending side.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#define TS_LEN 188
+#define TS_PER_RTP 7
+#define RTP_HDR 12
+#define DGRAM_LEN (RTP_HDR + TS_PER_RTP * TS_LEN)
+#define MAX_CHANNELS 256
+
+#define PID_PMT 0x1000
+#define PID_VIDEO 0x100
+/* Intervals in 90 kHz units */
+#define PSI_INTERVAL 9000
+#define PCR_INTERVAL 3600
+
+struct channel_s {
+	struct sockaddr_in addr;
+	uint16_t seq;
+	uint32_t ssrc;
+	uint8_t cc[3]; /* PAT, PMT, video */
+	uint64_t lastpsi, lastpcr;
+	uint8_t held[DGRAM_LEN]; /* datagram held back for reordering */
+	int hasheld;
+};
+
+static void usage(FILE *f, const char *prog) {
+	fprintf(f,
+"Usage: %s [options]\n"
+"\n"
+"Options:\n"
+"\t-h --help            Show this help\n"
+"\t-g --group <addr>    First multicast group (default 239.255.0.1)\n"
+"\t-p --port <port>     UDP port (default 1234)\n"
+"\t-c --channels <n>    Number of channels, on consecutive groups (default 1)\n"
+"\t-b --bitrate <kbit>  Bitrate of each channel (default 8000)\n"
+"\t-l --loss <pct>      Datagrams dropped, in percent (default 0)\n"
+"\t-r --reorder <pct>   Datagrams swapped with the next one (default 0)\n"
+"\t-t --time <s>        Run for s seconds (default 10)\n"
+"\t-i --interface <addr> Send through this interface (default by route)\n",
+		prog);
+}
+
+static uint32_t crc32mpeg(const uint8_t *p, size_t len) {
+	uint32_t crc = 0xffffffff;
+	int i;
+
+	while (len--) {
+		crc ^= (uint32_t) *p++ << 24;
+		for (i = 0; i < 8; i++)
+			crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+	}
+	return crc;
+}
+
+static void tsHeader(uint8_t *ts, int pid, int pusi, uint8_t *cc) {
+	ts[0] = 0x47;
+	ts[1] = (pusi ? 0x40 : 0) | (pid >> 8);
+	ts[2] = pid & 0xff;
+	ts[3] = 0x10 | (*cc & 0x0f);
+	(*cc)++;
+}
+
+/* PSI section with pointer field, stuffed with 0xff */
+static void tsSection(uint8_t *ts, int pid, uint8_t *cc,
+		const uint8_t *sec, size_t len) {
+	uint32_t crc = crc32mpeg(sec, len);
+
+	memset(ts, 0xff, TS_LEN);
+	tsHeader(ts, pid, 1, cc);
+	ts[4] = 0;
+	memcpy(ts + 5, sec, len);
+	ts[5+len] = crc >> 24;
+	ts[6+len] = crc >> 16;
+	ts[7+len] = crc >> 8;
+	ts[8+len] = crc;
+}
+
+static void tsPAT(uint8_t *ts, uint8_t *cc) {
+	const uint8_t sec[] = { 0x00, 0xb0, 13, 0x00, 0x01, 0xc1, 0, 0,
+		0x00, 0x01, 0xe0 | (PID_PMT >> 8), PID_PMT & 0xff };
+	tsSection(ts, 0, cc, sec, sizeof(sec));
+}
+
+static void tsPMT(uint8_t *ts, uint8_t *cc) {
+	const uint8_t sec[] = { 0x02, 0xb0, 18, 0x00, 0x01, 0xc1, 0, 0,
+		0xe0 | (PID_VIDEO >> 8), PID_VIDEO & 0xff, 0xf0, 0,
+		0x1b, 0xe0 | (PID_VIDEO >> 8), PID_VIDEO & 0xff, 0xf0, 0 };
+	tsSection(ts, PID_PMT, cc, sec, sizeof(sec));
+}
+
+/* Video packet, with PCR (90 kHz base) and random access indicator
+ * if pcr >= 0 */
+static void tsVideo(uint8_t *ts, uint8_t *cc, int64_t pcr) {
+	tsHeader(ts, PID_VIDEO, pcr >= 0, cc);
+	if (pcr < 0) {
+		memset(ts + 4, 0xa5, TS_LEN - 4);
+		return;
+	}
+	ts[3] |= 0x20;
+	ts[4] = 7;
+	ts[5] = 0x50; /* random access, PCR */
+	ts[6] = pcr >> 25;
+	ts[7] = pcr >> 17;
+	ts[8] = pcr >> 9;
+	ts[9] = pcr >> 1;
+	ts[10] = (pcr & 1) << 7 | 0x7e;
+	ts[11] = 0;
+	/* PES start, H.264 */
+	memcpy(ts + 12, "\x00\x00\x01\xe0\x00\x00\x80\x00\x00", 9);
+	memset(ts + 21, 0xa5, TS_LEN - 21);
+}
+
+static void fillDatagram(struct channel_s *ch, uint8_t *buf, uint64_t now90k) {
+	uint8_t *ts = buf + RTP_HDR;
+	int i;
+
+	buf[0] = 0x80;
+	buf[1] = 33; /* MP2T */
+	buf[2] = ch->seq >> 8;
+	buf[3] = ch->seq;
+	buf[4] = now90k >> 24;
+	buf[5] = now90k >> 16;
+	buf[6] = now90k >> 8;
+	buf[7] = now90k;
+	memcpy(buf + 8, &ch->ssrc, 4);
+	ch->seq++;
+
+	for (i = 0; i < TS_PER_RTP; i++, ts += TS_LEN) {
+		if (now90k - ch->lastpsi >= PSI_INTERVAL && i == 0) {
+			tsPAT(ts, &ch->cc[0]);
+		} else if (now90k - ch->lastpsi >= PSI_INTERVAL && i == 1) {
+			tsPMT(ts, &ch->cc[1]);
+			ch->lastpsi = now90k;
+		} else if (now90k - ch->lastpcr >= PCR_INTERVAL) {
+			tsVideo(ts, &ch->cc[2], now90k);
+			ch->lastpcr = now90k;
+		} else {
+			tsVideo(ts, &ch->cc[2], -1);
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	const struct option longopts[] = {
+		{ "help",	no_argument, 0, 'h' },
+		{ "group",	required_argument, 0, 'g' },
+		{ "port",	required_argument, 0, 'p' },
+		{ "channels",	required_argument, 0, 'c' },
+		{ "bitrate",	required_argument, 0, 'b' },
+		{ "loss",	required_argument, 0, 'l' },
+		{ "reorder",	required_argument, 0, 'r' },
+		{ "time",	required_argument, 0, 't' },
+		{ "interface",	required_argument, 0, 'i' },
+		{ 0,		0, 0, 0}
+	};
+	int opt, option_index;
+	const char *group = "239.255.0.1", *iface = NULL;
+	int port = 1234, channels = 1, bitrate = 8000, seconds = 10;
+	double loss = 0, reorder = 0;
+	struct channel_s *ch;
+	struct in_addr base, ifaddr;
+	int sock, i;
+	unsigned char ttl = 1, loop = 1;
+	uint8_t buf[DGRAM_LEN];
+	struct timespec start, next, now;
+	int64_t interval, elapsed, sent = 0, dropped = 0, reordered = 0;
+	uint64_t tick = 0, now90k;
+
+	while ((opt = getopt_long(argc, argv, "hg:p:c:b:l:r:t:i:",
+			longopts, &option_index)) != -1) {
+		switch (opt) {
+			case 'h':
+				usage(stdout, argv[0]);
+				exit(EXIT_SUCCESS);
+			case 'g': group = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'c': channels = atoi(optarg); break;
+			case 'b': bitrate = atoi(optarg); break;
+			case 'l': loss = atof(optarg); break;
+			case 'r': reorder = atof(optarg); break;
+			case 't': seconds = atoi(optarg); break;
+			case 'i': iface = optarg; break;
+			default:
+				usage(stderr, argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (channels < 1 || channels > MAX_CHANNELS || bitrate < 100 ||
+	    inet_pton(AF_INET, group, &base) != 1 ||
+	    (iface && inet_pton(AF_INET, iface, &ifaddr) != 1)) {
+		usage(stderr, argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	/* Looped back to the local rtp2httpd */
+	if (sock < 0 ||
+	    (iface && setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr,
+			sizeof(ifaddr)) < 0) ||
+	    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl,
+			sizeof(ttl)) < 0 ||
+	    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+			sizeof(loop)) < 0) {
+		fprintf(stderr, "Cannot set up socket: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	srandom(getpid());
+	ch = calloc(channels, sizeof(struct channel_s));
+	for (i = 0; i < channels; i++) {
+		ch[i].addr.sin_family = AF_INET;
+		ch[i].addr.sin_port = htons(port);
+		ch[i].addr.sin_addr.s_addr = htonl(ntohl(base.s_addr) + i);
+		ch[i].ssrc = random();
+	}
+
+	/* Datagrams of all channels are sent together, once per interval */
+	interval = (int64_t) DGRAM_LEN * 8 * 1000000000LL / (bitrate * 1000LL);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	next = start;
+	while (1) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000000000LL +
+			now.tv_nsec - start.tv_nsec;
+		if (elapsed >= (int64_t) seconds * 1000000000LL)
+			break;
+		now90k = tick * interval * 9 / 100000;
+		for (i = 0; i < channels; i++) {
+			fillDatagram(&ch[i], buf, now90k);
+			if (random() % 10000 < loss * 100) {
+				dropped++;
+				continue;
+			}
+			if (!ch[i].hasheld && random() % 10000 < reorder * 100) {
+				memcpy(ch[i].held, buf, DGRAM_LEN);
+				ch[i].hasheld = 1;
+				reordered++;
+				continue;
+			}
+			sendto(sock, buf, DGRAM_LEN, 0,
+				(struct sockaddr *) &ch[i].addr,
+				sizeof(ch[i].addr));
+			sent++;
+			if (ch[i].hasheld) {
+				sendto(sock, ch[i].held, DGRAM_LEN, 0,
+					(struct sockaddr *) &ch[i].addr,
+					sizeof(ch[i].addr));
+				ch[i].hasheld = 0;
+				sent++;
+			}
+		}
+		tick++;
+		next.tv_nsec += interval;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	printf("{\"channels\": %d, \"bitrate_kbps\": %d, \"seconds\": %d, "
+		"\"datagrams\": %lld, \"dropped\": %lld, \"reordered\": %lld}\n",
+		channels, bitrate, seconds, (long long) sent,
+		(long long) dropped, (long long) reordered);
+	return 0;
+}
@@ -0,0 +1,346 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Microbenchmarks of the request and packet hot paths.
+ *
+ * httpclients.c is included, so its static functions can be called
+ * directly. Every benchmark runs over a small corpus of realistic
+ * inputs for a fixed time and reports the time and the heap
+ * allocations per operation. Allocations are counted by replacing
+ * malloc and friends, which also catches the ones done inside libc.
+ */
+
+#include "httpclients.c"
+
+#include <fcntl.h>
+#include <getopt.h>
+
+/* Stand-ins for what rtp2httpd.c provides to the server */
+struct bindaddr_s *bindaddr = NULL;
+int clientcount = 0;
+
+void closeListeners(void) {
+}
+
+/* Allocation counters */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static uint64_t allocs, allocbytes;
+
+void *malloc(size_t size) {
+	allocs++;
+	allocbytes += size;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+	allocs++;
+	allocbytes += n * size;
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	allocs++;
+	allocbytes += size;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+	__libc_free(ptr);
+}
+
+/* Corpora */
+
+#define RTP_CORPUS 8
+static uint8_t rtpcorpus[RTP_CORPUS][1500];
+static int rtplen[RTP_CORPUS];
+
+/*
+ * RTP headers as seen from IPTV headends: plain, with CSRCs from
+ * mixers, with header extensions and with padding.
+ */
+static void rtpCorpus(void) {
+	static const struct {
+		int csrc, extwords, padding;
+	} shapes[RTP_CORPUS] = {
+		{ 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 }, { 1, 0, 0 },
+		{ 2, 1, 0 }, { 0, 3, 0 }, { 15, 0, 0 }, { 4, 2, 4 },
+	};
+	int i, off;
+	uint8_t *p;
+
+	for (i = 0; i < RTP_CORPUS; i++) {
+		p = rtpcorpus[i];
+		p[0] = 0x80 | shapes[i].csrc |
+			(shapes[i].extwords ? 0x10 : 0) |
+			(shapes[i].padding ? 0x20 : 0);
+		p[1] = 33;
+		p[2] = i;
+		p[3] = i * 7;
+		off = 12 + shapes[i].csrc * 4;
+		if (shapes[i].extwords) {
+			p[off] = 0xbe;
+			p[off+1] = 0xde;
+			p[off+2] = 0;
+			p[off+3] = shapes[i].extwords;
+			off += 4 + shapes[i].extwords * 4;
+		}
+		off += 7 * 188;
+		if (shapes[i].padding) {
+			off += shapes[i].padding;
+			p[off-1] = shapes[i].padding;
+		}
+		rtplen[i] = off;
+	}
+}
+
+/* udpxy URLs as sent by set-top boxes and players */
+static const char *udpxycorpus[] = {
+	"/rtp/239.1.1.1:1234",
+	"/udp/239.255.0.15:5000",
+	"/rtp/233.50.200.1:10000",
+	"/rtp/232.1.1.1@10.0.0.1:1234",
+	"/udp/239.1.2.3",
+	"/rtp/[ff15::1234]:5000",
+	"/rtp/239.1.1.1%3A1234",
+	"/udp/%5Bff05%3A%3A1%5D:1234",
+};
+#define UDPXY_CORPUS (sizeof(udpxycorpus) / sizeof(udpxycorpus[0]))
+
+static const char *servicecorpus[] = {
+	"ct1 MRTP 239.1.1.1 1234",
+	"ct2 MUDP 239.1.1.2 5000 bitrate=4000",
+	"nova MRTP 239.1.1.3 1234 timeshift=60 bitrate=12000",
+	"prima MRTP 10.0.0.1@232.1.1.4 1234 weight=2 pace=200",
+	"ipv6 MRTP ff15::1234 5000",
+	"hd MRTP 239.1.1.5 1234 hls=4 hlswindow=6",
+};
+#define SERVICE_CORPUS (sizeof(servicecorpus) / sizeof(servicecorpus[0]))
+
+/* Lookups of a 64 channel lineup, hits and misses */
+#define LINEUP 64
+static char lookupnames[LINEUP + 8][16];
+
+/* Benchmarks, each does one operation on corpus entry i */
+
+static int devnull;
+static volatile uint64_t sink;
+
+static void benchRtp(uint64_t i) {
+	uint8_t *payload;
+	uint16_t seqn;
+	int n = i % RTP_CORPUS;
+
+	sink += rtpPayload(rtpcorpus[n], rtplen[n], &payload, &seqn) + seqn;
+}
+
+static void benchArena(uint64_t i) {
+	uint8_t *payload;
+	uint16_t seqn;
+	uint32_t slab;
+	int n = i % RTP_CORPUS, k;
+
+	/* Receive, slice the payload and queue it to four clients */
+	slab = arenaAlloc();
+	memcpy(arenaData(slab), rtpcorpus[n], rtplen[n]);
+	sink += rtpPayload(arenaData(slab), rtplen[n], &payload, &seqn);
+	for (k = 0; k < 3; k++)
+		arenaRef(slab);
+	for (k = 0; k < 4; k++)
+		arenaUnref(slab);
+}
+
+static void benchUdpxy(uint64_t i) {
+	char url[64];
+	struct services_s *s;
+
+	/* It decodes the URL in place */
+	strcpy(url, udpxycorpus[i % UDPXY_CORPUS]);
+	s = udpxy_parse(url);
+	if (s) {
+		sink += s->service_type;
+		free(s->msrc);
+	}
+}
+
+static void benchLookup(uint64_t i) {
+	sink += (uintptr_t) findService(lookupnames[i % (LINEUP + 8)]);
+}
+
+static void benchHeaders(uint64_t i) {
+	static const char *extra[] = { NULL, NULL,
+		"Content-Length: 1048576\r\n", NULL };
+
+	headers(devnull, i % 4 == 3 ? STATUS_503 : STATUS_200,
+		i % 2 ? CONTENT_MPEGV : CONTENT_HTML, extra[i % 4]);
+}
+
+static void benchServiceLine(uint64_t i) {
+	char line[128];
+	struct services_s *s;
+
+	strcpy(line, servicecorpus[i % SERVICE_CORPUS]);
+	parseServicesSec(line);
+	/* Take it off again, so the list does not grow */
+	s = services;
+	if (s == NULL)
+		return;
+	services = s->next;
+	freeaddrinfo(s->addr);
+	if (s->msrc_addr)
+		freeaddrinfo(s->msrc_addr);
+	free(s->url);
+	free(s->msrc);
+	free(s);
+}
+
+static const struct bench_s {
+	const char *name;
+	void (*fn)(uint64_t i);
+} benches[] = {
+	{ "rtp_payload", benchRtp },
+	{ "arena_slice", benchArena },
+	{ "udpxy_parse", benchUdpxy },
+	{ "service_lookup", benchLookup },
+	{ "headers", benchHeaders },
+	{ "parse_service_line", benchServiceLine },
+	{ NULL, NULL }
+};
+
+static int64_t monoNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void usage(FILE *f, const char *prog) {
+	fprintf(f,
+"Usage: %s [options] [benchmark]...\n"
+"\n"
+"Options:\n"
+"\t-h --help            Show this help\n"
+"\t-t --time <ms>       Run each benchmark for ms (default 500)\n"
+"\t-j --json            Print results as JSON\n"
+"\t-l --list            List benchmarks\n",
+		prog);
+}
+
+int main(int argc, char *argv[]) {
+	const struct option longopts[] = {
+		{ "help",	no_argument, 0, 'h' },
+		{ "time",	required_argument, 0, 't' },
+		{ "json",	no_argument, 0, 'j' },
+		{ "list",	no_argument, 0, 'l' },
+		{ 0,		0, 0, 0}
+	};
+	int opt, option_index, json = 0, first = 1, k;
+	int64_t duration = 500, start, elapsed;
+	uint64_t i, batch, a0, b0;
+	const struct bench_s *b;
+	char line[64];
+
+	while ((opt = getopt_long(argc, argv, "ht:jl",
+			longopts, &option_index)) != -1) {
+		switch (opt) {
+			case 'h':
+				usage(stdout, argv[0]);
+				exit(EXIT_SUCCESS);
+			case 't':
+				duration = atoi(optarg);
+				break;
+			case 'j':
+				json = 1;
+				break;
+			case 'l':
+				for (b = benches; b->name; b++)
+					puts(b->name);
+				exit(EXIT_SUCCESS);
+			default:
+				usage(stderr, argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	conf_verbosity = LOG_FATAL;
+	devnull = open("/dev/null", O_WRONLY);
+	rtpCorpus();
+	arenaInit(64);
+	for (k = 0; k < LINEUP; k++) {
+		snprintf(line, sizeof(line), "ch%d MRTP 239.1.%d.%d 1234",
+				k, k / 250, k % 250 + 1);
+		parseServicesSec(line);
+		snprintf(lookupnames[k], sizeof(lookupnames[k]), "ch%d", k);
+	}
+	for (; k < LINEUP + 8; k++)
+		snprintf(lookupnames[k], sizeof(lookupnames[k]), "none%d", k);
+
+	if (json)
+		printf("{\"benchmarks\": [");
+	else
+		printf("%-20s %12s %12s %12s %12s\n", "BENCHMARK", "OPS",
+			"NS/OP", "ALLOCS/OP", "BYTES/OP");
+	for (b = benches; b->name; b++) {
+		if (optind < argc) {
+			for (k = optind; k < argc; k++)
+				if (strcmp(argv[k], b->name) == 0)
+					break;
+			if (k == argc)
+				continue;
+		}
+		/* Warm up, then run in growing batches until the time is up */
+		for (i = 0; i < 1000; i++)
+			b->fn(i);
+		a0 = allocs;
+		b0 = allocbytes;
+		i = 0;
+		batch = 100;
+		start = monoNs();
+		do {
+			uint64_t end = i + batch;
+			for (; i < end; i++)
+				b->fn(i);
+			batch *= 2;
+			elapsed = monoNs() - start;
+		} while (elapsed < duration * 1000000);
+
+		if (json)
+			printf("%s{\"name\": \"%s\", \"ops\": %llu, "
+				"\"ns_per_op\": %.2f, \"allocs_per_op\": %.3f, "
+				"\"bytes_per_op\": %.1f}", first ? "" : ", ",
+				b->name, (unsigned long long) i,
+				(double) elapsed / i,
+				(double) (allocs - a0) / i,
+				(double) (allocbytes - b0) / i);
+		else
+			printf("%-20s %12llu %12.2f %12.3f %12.1f\n", b->name,
+				(unsigned long long) i, (double) elapsed / i,
+				(double) (allocs - a0) / i,
+				(double) (allocbytes - b0) / i);
+		first = 0;
+	}
+	if (json)
+		printf("]}\n");
+	return 0;
+}
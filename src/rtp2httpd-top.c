@@ -0,0 +1,202 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * rtp2httpd-top - show live statistics of a running rtp2httpd,
+ * read from the memory mapped status file.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netdb.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+/* Previous byte counters to compute rates */
+static uint64_t *prevclient;
+static uint64_t prevgroup[STATS_GROUPS];
+
+static void usage(FILE *f, const char *prog) {
+	fprintf(f,
+"Usage: %s [options] <statusfile>\n"
+"\n"
+"Options:\n"
+"\t-h --help            Show this help\n"
+"\t-d --delay <s>       Refresh every s seconds (default 1)\n"
+"\t-n --iterations <n>  Exit after n refreshes\n"
+"\t-b --batch           Do not clear the screen between refreshes\n",
+		prog);
+}
+
+static void show(const struct stats_s *st, int delay, int batch) {
+	uint32_t i;
+	int64_t now = time(NULL);
+	const struct stats_client_s *c;
+	const struct stats_group_s *g;
+	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+	uint64_t bytes;
+	int32_t gi;
+
+	if (!batch)
+		printf("\033[H\033[2J");
+	printf(PACKAGE " pid %d, up %lld s, %llu connections, %llu rejected\n\n",
+		(int) st->pid, (long long) (now - st->start),
+		(unsigned long long) STATS_GET(st->accepted),
+		(unsigned long long) STATS_GET(st->rejected));
+
+	printf("%-7s %-30s %-24s %-16s %10s %10s %8s %8s\n",
+		"PID", "CLIENT", "GROUP", "SERVICE", "KBIT/S",
+		"PACKETS", "DROPS", "QUEUE");
+	for (i = 0; i < st->nclients; i++) {
+		c = &st->clients[i];
+		if (STATS_GET(c->state) != SLOT_USED) {
+			prevclient[i] = 0;
+			continue;
+		}
+		if (getnameinfo((const struct sockaddr *) &c->ss, sizeof(c->ss),
+				hbuf, sizeof(hbuf), sbuf, sizeof(sbuf),
+				NI_NUMERICHOST | NI_NUMERICSERV)) {
+			strcpy(hbuf, "?");
+			strcpy(sbuf, "?");
+		}
+		strncat(hbuf, ":", sizeof(hbuf) - strlen(hbuf) - 1);
+		strncat(hbuf, sbuf, sizeof(hbuf) - strlen(hbuf) - 1);
+		gi = STATS_GET(c->group);
+		bytes = STATS_GET(c->bytes);
+		printf("%-7d %-30.30s %-24.24s %-16.16s %10llu %10llu %8llu %8u\n",
+			(int) c->pid, hbuf,
+			gi >= 0 && gi < STATS_GROUPS ? st->groups[gi].group : "-",
+			c->url,
+			(unsigned long long) (bytes > prevclient[i] ?
+				(bytes - prevclient[i]) * 8 / 1000 / delay : 0),
+			(unsigned long long) STATS_GET(c->packets),
+			(unsigned long long) STATS_GET(c->drops),
+			STATS_GET(c->queue));
+		prevclient[i] = bytes;
+	}
+
+	printf("\n%-40s %7s %10s %12s %8s\n",
+		"GROUP", "CLIENTS", "KBIT/S", "PACKETS", "DROPS");
+	for (i = 0; i < STATS_GROUPS; i++) {
+		g = &st->groups[i];
+		if (STATS_GET(g->state) != SLOT_USED)
+			continue;
+		bytes = STATS_GET(g->bytes);
+		printf("%-40.40s %7u %10llu %12llu %8llu\n",
+			g->group, STATS_GET(g->clients),
+			(unsigned long long) (bytes > prevgroup[i] ?
+				(bytes - prevgroup[i]) * 8 / 1000 / delay : 0),
+			(unsigned long long) STATS_GET(g->packets),
+			(unsigned long long) STATS_GET(g->drops));
+		prevgroup[i] = bytes;
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+	const struct option longopts[] = {
+		{ "help",	no_argument, 0, 'h' },
+		{ "delay",	required_argument, 0, 'd' },
+		{ "iterations",	required_argument, 0, 'n' },
+		{ "batch",	no_argument, 0, 'b' },
+		{ 0,		0, 0, 0}
+	};
+	int opt, option_index;
+	int delay = 1, iterations = -1, batch = 0;
+	int fd;
+	struct stat sb;
+	struct stats_s *st;
+
+	while ((opt = getopt_long(argc, argv, "hd:n:b",
+			longopts, &option_index)) != -1) {
+		switch (opt) {
+			case 'h':
+				usage(stdout, argv[0]);
+				exit(EXIT_SUCCESS);
+			case 'd':
+				delay = atoi(optarg);
+				if (delay < 1)
+					delay = 1;
+				break;
+			case 'n':
+				iterations = atoi(optarg);
+				break;
+			case 'b':
+				batch = 1;
+				break;
+			default:
+				usage(stderr, argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (optind >= argc) {
+		usage(stderr, argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) < 0) {
+		fprintf(stderr, "Cannot open %s: %s\n", argv[optind],
+				strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (sb.st_size < sizeof(struct stats_s)) {
+		fprintf(stderr, "%s is not a status file\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	st = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (st == MAP_FAILED) {
+		fprintf(stderr, "Cannot map %s: %s\n", argv[optind],
+				strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (__atomic_load_n(&st->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+			st->version != STATS_VERSION ||
+			sizeof(struct stats_s) + st->nclients *
+			sizeof(struct stats_client_s) > sb.st_size) {
+		fprintf(stderr, "%s: unsupported status file format\n",
+				argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	prevclient = calloc(st->nclients, sizeof(uint64_t));
+	while (iterations != 0) {
+		show(st, delay, batch);
+		if (iterations > 0 && --iterations == 0)
+			break;
+		sleep(delay);
+	}
+	return 0;
+}
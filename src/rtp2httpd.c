@@ -25,14 +25,17 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <errno.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
 #include <string.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <time.h>
 
 
 #include "rtp2httpd.h"
@@ -46,7 +49,12 @@
 #define min(a,b) ((a)<(b) ? (a):(b))
 
 
-#define MAX_S 10
+/* Connections taken from one listener per wakeup at most */
+#define ACCEPT_BATCH 64
+/* Seconds the kernel holds a connection until the request arrives */
+#define DEFER_ACCEPT 5
+/* Pending TCP Fast Open requests per listener */
+#define FASTOPEN_QLEN 256
 
 /**
  * Linked list of clients
@@ -54,11 +62,17 @@
 struct client_s {
 	struct sockaddr_storage ss; /* Client host-port */
 	pid_t pid;
+	int slot; /* Index to the statistics segment */
 	struct client_s *next;
 };
 
 static struct client_s *clients;
 
+/* Listening sockets */
+static struct pollfd *s;
+static int *stls; /* HTTPS listener */
+static int maxs;
+
 
 /* GLOBALS */
 struct bindaddr_s *bindaddr = NULL;
@@ -68,24 +82,115 @@ int clientcount = 0;
 /* *** */
 
 /**
- * Logger function. Show the message if current verbosity is above
- * logged level.
- *
- * @param levem Message log level
- * @param format printf style format string
- * @returns Whatever printf returns
+ * Close all listening sockets. Used by forked processes.
+ */
+void closeListeners(void) {
+	int j;
+	for (j = 0; j < maxs; j++) close(s[j].fd);
+}
+
+/**
+ * Add a listening socket, and keep it for the next upgrade.
+ */
+static void addListener(int fd, int tls) {
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+	int r;
+
+	r = getsockname(fd, (struct sockaddr *) &ss, &len);
+	if (r == 0)
+		r = getnameinfo((struct sockaddr *) &ss, len,
+				hbuf, sizeof(hbuf),
+				sbuf, sizeof(sbuf),
+				NI_NUMERICHOST | NI_NUMERICSERV);
+	if (r) {
+		logger(LOG_ERROR, "getnameinfo failed: %s\n",
+				gai_strerror(r));
+	} else {
+		logger(LOG_INFO, "Listening on %s port %s%s\n",
+				hbuf, sbuf, tls ? " (HTTPS)" : "");
+	}
+
+	s = realloc(s, (maxs + 1) * sizeof(*s));
+	stls = realloc(stls, (maxs + 1) * sizeof(*stls));
+	if (s == NULL || stls == NULL) {
+		logger(LOG_FATAL, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	s[maxs].fd = fd;
+	s[maxs].events = POLLIN;
+	stls[maxs] = tls;
+	maxs++;
+	upgradeKeep(fd, "listener %d", tls);
+}
+
+/**
+ * Take over the clients of the image before an upgrade.
+ * Called with SIGCHLD blocked.
  */
-int logger(enum loglevel level, const char *format, ...) {
-	va_list ap;
-	int r=0;
-	//if (conf_verbosity >= level) {
-		va_start(ap, format);
-		r=vfprintf(stderr,format, ap);
-		va_end(ap);
-	//}
-	return r;
+static void adoptClients(void) {
+	struct addrinfo hints, *res;
+	struct client_s *newc;
+	const char *args;
+	char host[NI_MAXHOST], serv[NI_MAXSERV];
+	int pid, slot, n = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	while ((args = upgradeTake("client", NULL)) != NULL) {
+		if (sscanf(args, "%d %d %1024s %31s", &pid, &slot, host,
+				serv) != 4)
+			continue;
+		newc = malloc(sizeof(struct client_s));
+		memset(newc, 0, sizeof(struct client_s));
+		if (getaddrinfo(host, serv, &hints, &res) == 0) {
+			memcpy(&newc->ss, res->ai_addr, res->ai_addrlen);
+			freeaddrinfo(res);
+		}
+		newc->pid = pid;
+		/* Slots of a statistics segment not taken over are gone */
+		if (stats && slot >= 0 && (uint32_t) slot < stats->nclients &&
+		    stats->clients[slot].pid == pid)
+			newc->slot = slot;
+		else
+			newc->slot = -1;
+		newc->next = clients;
+		clients = newc;
+		n++;
+	}
+	args = upgradeTake("clientcount", NULL);
+	if (args)
+		clientcount = atoi(args);
+	if (n > 0)
+		logger(LOG_INFO, "Took over %d clients\n", n);
 }
 
+/**
+ * Execute the binary again, handing the listeners and children over.
+ * Returns only when that failed.
+ */
+static void upgrade(char *argv[], sigset_t *childset) {
+	struct client_s *cli;
+	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+
+	sigprocmask(SIG_BLOCK, childset, NULL);
+	for (cli = clients; cli; cli = cli->next) {
+		if (getnameinfo((struct sockaddr *) &cli->ss, sizeof(cli->ss),
+				hbuf, sizeof(hbuf), sbuf, sizeof(sbuf),
+				NI_NUMERICHOST | NI_NUMERICSERV)) {
+			strcpy(hbuf, "-");
+			strcpy(sbuf, "-");
+		}
+		upgradeKeep(-1, "client %d %d %s %s", (int) cli->pid,
+				cli->slot, hbuf, sbuf);
+	}
+	upgradeKeep(-1, "clientcount %d", clientcount);
+	feedersUpgrade();
+	logUpgrade();
+	upgradeExec(argv);
+	sigprocmask(SIG_UNBLOCK, childset, NULL);
+}
 
 void childhandler(int signum) { /* SIGCHLD handler */
 	int child;
@@ -97,6 +202,15 @@ void childhandler(int signum) { /* SIGCHLD handler */
 
 	while ( (child = waitpid (-1, &status, WNOHANG)) > 0){
 
+		if (logReaped(child))
+			continue;
+		joinReaped(child);
+		if (feederReaped(child)) {
+			logger(LOG_INFO, "Feeder %d finished (%d, %d)\n",
+				child, WEXITSTATUS(status), WIFSIGNALED(status));
+			continue;
+		}
+
 		for (cli = clients; cli; cli = cli->next) {
 			if (child == cli->pid)
 				break;
@@ -115,6 +229,8 @@ void childhandler(int signum) { /* SIGCHLD handler */
 					WIFSIGNALED(status));
 			}
 
+			statsFreeClient(cli->slot);
+
 			/* remove client from the list */
 			if (cli == clients) {
 				clients=cli->next;
@@ -144,32 +260,39 @@ int main(int argc, char *argv[]) {
 	struct bindaddr_s *bai;
 	struct sockaddr_storage client;
 	socklen_t client_len = sizeof(client);
-	int cls;
-	int r, i, j;
-	int s[MAX_S];
-	int maxs, nfds;
+	int cls, fd;
+	int r, i, n;
 	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-	fd_set rfd, rfd0;
+	time_t lastcheck = 0;
 	pid_t child;
 	struct client_s *newc;
 	const int on = 1;
 	sigset_t childset;
+	const char *args;
+	int upgraded;
 
+	sigemptyset(&childset);
 	sigaddset(&childset, SIGCHLD);
 
 	parseCmdLine(argc, argv);
+	upgraded = upgradeReceive();
 
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE;
 	maxs = 0;
-	nfds = -1;
+
+	/* The listeners stay the same across an upgrade */
+	while ((args = upgradeTake("listener", &fd)) != NULL) {
+		if (fd >= 0)
+			addListener(fd, atoi(args));
+	}
 
 	if (bindaddr == NULL) {
 		bindaddr = newEmptyBindaddr();
 	}
 
-	for (bai=bindaddr; bai; bai=bai->next) {
+	for (bai = maxs ? NULL : bindaddr; bai; bai=bai->next) {
 		r = getaddrinfo(bai->node, bai->service,
 				&hints, &res);
 		if (r) {
@@ -177,12 +300,13 @@ int main(int argc, char *argv[]) {
 			exit(EXIT_FAILURE);
 		}
 
-		for (ai = res; ai && maxs < MAX_S; ai = ai->ai_next) {
-			s[maxs] = socket(ai->ai_family, ai->ai_socktype,
+		for (ai = res; ai; ai = ai->ai_next) {
+			fd = socket(ai->ai_family, ai->ai_socktype |
+					SOCK_NONBLOCK | SOCK_CLOEXEC,
 					ai->ai_protocol);
-			if (s[maxs] < 0)
+			if (fd < 0)
 				continue;
-			r = setsockopt(s[maxs], SOL_SOCKET,
+			r = setsockopt(fd, SOL_SOCKET,
 					SO_REUSEADDR, &on, sizeof(on));
 			if (r) {
 				logger(LOG_ERROR, "SO_REUSEADDR "
@@ -191,7 +315,7 @@ int main(int argc, char *argv[]) {
 
 #ifdef IPV6_V6ONLY
 			if (ai->ai_family == AF_INET6) {
-				r = setsockopt(s[maxs], IPPROTO_IPV6,
+				r = setsockopt(fd, IPPROTO_IPV6,
 					IPV6_V6ONLY, &on, sizeof(on));
 				if (r) {
 					logger(LOG_ERROR, "IPV6_V6ONLY "
@@ -200,35 +324,35 @@ int main(int argc, char *argv[]) {
 			}
 #endif /* IPV6_V6ONLY */
 
-			r = bind(s[maxs], ai->ai_addr, ai->ai_addrlen);
+			r = bind(fd, ai->ai_addr, ai->ai_addrlen);
 			if (r) {
 				logger(LOG_ERROR, "Cannot bind: %s\n",
 						strerror(errno));
-				close(s[maxs]);
+				close(fd);
 				continue;
 			}
-			r = listen(s[maxs], 0);
+			/* Wake up only once the request is there to be read */
+			r = DEFER_ACCEPT;
+			if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+					&r, sizeof(r))) {
+				logger(LOG_ERROR, "TCP_DEFER_ACCEPT "
+				"failed: %s\n", strerror(errno));
+			}
+			/* Lets returning clients send the request with the SYN */
+			r = FASTOPEN_QLEN;
+			if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN,
+					&r, sizeof(r))) {
+				logger(LOG_DEBUG, "TCP_FASTOPEN "
+				"failed: %s\n", strerror(errno));
+			}
+			r = listen(fd, conf_backlog);
 			if (r) {
 				logger(LOG_ERROR, "Cannot listen: %s\n",
 						strerror(errno));
-				close(s[maxs]);
+				close(fd);
 				continue;
 			}
-			r = getnameinfo(ai->ai_addr, ai->ai_addrlen,
-					hbuf, sizeof(hbuf),
-					sbuf, sizeof(sbuf),
-					NI_NUMERICHOST | NI_NUMERICSERV);
-			if (r) {
-				logger(LOG_ERROR, "getnameinfo failed: %s\n",
-						gai_strerror(r));
-			} else {
-				logger(LOG_INFO, "Listening on %s port %s\n",
-						hbuf, sbuf);
-			}
-
-			if (s[maxs] > nfds)
-				nfds = s[maxs];
-			maxs++;
+			addListener(fd, bai->tls);
 		}
 		freeaddrinfo(res);
 	}
@@ -238,13 +362,14 @@ int main(int argc, char *argv[]) {
 		logger(LOG_FATAL, "No socket to listen!\n");
 		exit(EXIT_FAILURE);
 	}
-
-	FD_ZERO(&rfd0);
 	for (i = 0; i < maxs; i++) {
-		FD_SET(s[i], &rfd0);
+		if (stls[i]) {
+			tlsInit();
+			break;
+		}
 	}
 
-	if (conf_daemonise) {
+	if (conf_daemonise && !upgraded) {
 		logger(LOG_INFO, "Forking to background...\n");
 		if (daemon(1, 0) != 0) {
 			logger(LOG_FATAL, "Cannot fork: %s\n", strerror(errno));
@@ -253,30 +378,70 @@ int main(int argc, char *argv[]) {
 	}
 
 	signal(SIGCHLD, &childhandler);
+	signal(SIGUSR2, &upgradeRequest);
+	logInit();
+	statsInit();
+	resolveStart();
+
+	clusterInit();
+	recordInit();
+	relayInit();
+	sigprocmask(SIG_BLOCK, &childset, NULL);
+	adoptClients();
+	feedersStart();
+	upgradeDone();
+	/* Also lets through what an upgrade kept blocked across the exec */
+	sigprocmask(SIG_UNBLOCK, &childset, NULL);
 	while (1) {
-		rfd = rfd0;
-		r = select(nfds+1, &rfd, NULL, NULL, NULL);
+		if (upgradeRequested())
+			upgrade(argv, &childset);
+		r = poll(s, maxs, 1000);
 		if (r<0) {
 			if (errno == EINTR)
 				continue;
-			logger(LOG_FATAL,"select() failed: %s\n",
+			logger(LOG_FATAL,"poll() failed: %s\n",
 					strerror(errno));
 			exit(EXIT_FAILURE);
 		}
+		if (time(NULL) != lastcheck) { /* housekeeping */
+			lastcheck = time(NULL);
+			sigprocmask(SIG_BLOCK, &childset, NULL);
+			logCheck();
+			admitCheck();
+			clusterCheck();
+			resolveCheck();
+			feedersCheck();
+			sigprocmask(SIG_UNBLOCK, &childset, NULL);
+		}
 		for (i = 0; i < maxs; i++) {
-			if (FD_ISSET(s[i], &rfd)) {
-				cls = accept(s[i],
+			if (!(s[i].revents & POLLIN))
+				continue;
+			/* Drain the backlog, a bounded batch at a time so
+			 * no listener starves the others */
+			for (n = 0; n < ACCEPT_BATCH; n++) {
+				client_len = sizeof(client);
+				cls = accept4(s[i].fd,
 					(struct sockaddr*) &client,
-					&client_len);
+					&client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if (cls < 0)
+					break;
+				zapAccept();
+				if (!admitClient(cls, &client, stls[i])) {
+					close(cls);
+					continue;
+				}
 
 				/* We have to mask SIGCHLD before we add child to the list*/
 				sigprocmask(SIG_BLOCK, &childset, NULL);
 				clientcount++;
+				stats_slot = statsAllocClient(&client);
 				if ((child = fork())) { /* PARENT */
 					close(cls);
+					statsClientPid(stats_slot, child);
 					newc = malloc(sizeof(struct client_s));
 					newc->ss = client;
 					newc->pid = child;
+					newc->slot = stats_slot;
 					newc->next = clients;
 					clients = newc;
 
@@ -294,7 +459,11 @@ int main(int argc, char *argv[]) {
 					sigprocmask(SIG_UNBLOCK, &childset, NULL);
 
 				} else { /* CHILD */
-					for (j = 0; j < maxs; j++) close(s[j]);
+					closeListeners();
+					/* Clients do blocking I/O */
+					fcntl(cls, F_SETFL, 0);
+					if (stls[i])
+						cls = tlsAccept(cls);
 					clientService(cls);
 					exit(EXIT_SUCCESS);
 				}
@@ -24,6 +24,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
 
 
 #ifdef HAVE_CONFIG_H
@@ -46,15 +48,28 @@ enum loglevel {
 
 enum service_type {
 	SERVICE_MRTP = 0,
-	SERVICE_MUDP
+	SERVICE_MUDP,
+	SERVICE_HTTP,
+	SERVICE_RTSP,
+	SERVICE_FILE
 };
 
+/* Services pulled from a unicast upstream by their feeder */
+#define SERVICE_PULLED(s) ((s)->service_type == SERVICE_HTTP || \
+		(s)->service_type == SERVICE_RTSP)
+/* Services whose clients read the live stream from the ring of the
+ * feeder instead of receiving it themselves; paced ones need the
+ * datagrams */
+#define SERVICE_RING(s) (SERVICE_PULLED(s) || (conf_fanout && \
+		(s)->service_type <= SERVICE_MUDP && (s)->pace == 0))
+
 /*
  * Linked list of adresses to bind
  */
 struct bindaddr_s {
 	char *node;
 	char *service;
+	int tls; /* HTTPS listener */
 	struct bindaddr_s *next;
 };
 
@@ -64,19 +79,246 @@ struct bindaddr_s {
 struct services_s {
 	char *url;
 	char *msrc;
+	char *upstream; /* URL of HTTP and RTSP services */
+	char *file; /* TS file of FILE services */
+	char *slate; /* TS file played while the group is silent, or NULL */
+	char *ifname; /* interface the group is joined on, NULL = default */
+	int loop; /* FILE: start over at the end */
+	int speed; /* FILE: multiple of the PCR rate, 0 = unpaced */
 	enum service_type service_type;
-	struct addrinfo *addr;
+	struct addrinfo *addr; /* NULL until host is resolved */
 	struct addrinfo *msrc_addr;
+	char *host, *port; /* of addr when it is not numeric */
+	char *srchost, *srcport; /* of msrc_addr likewise */
+	int timeshift; /* minutes of stream kept in the ring, 0 = off */
+	int bitrate; /* expected bitrate in kbit/s, for buffer sizing */
+	int hls; /* HLS target segment duration in seconds, 0 = off */
+	int hlswindow; /* segments listed in the HLS playlist */
+	int weight; /* bandwidth share relative to other services */
+	int pace; /* playout delay in ms for paced output, 0 = off */
+	int maxclients; /* admitted clients at most, 0 = no limit */
+	int linger; /* seconds an on demand feeder outlives its last client */
+	int interleaved; /* RTSP: RTP in the TCP connection, not UDP */
+	uint64_t rate; /* measured bytes/s of a client, main process only */
 	struct services_s *next;
 };
 
+#define TS_PACKET_LEN 188
+#define TS_SYNC 0x47
+
+/*
+ * Memory mapped stream ring, see ring.c
+ */
+#define RING_MARGIN 16 /* Readers keep 1/16 of the ring away from writer */
+
+struct ring_index_s {
+	int64_t time; /* unix time in ms */
+	uint64_t pos; /* stream position */
+	uint32_t rap; /* position is a random access point */
+	uint32_t pad;
+};
+
+struct ring_hdr_s {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size; /* size of the data area */
+	uint64_t dataoff; /* file offset of the data area */
+	uint64_t extoff; /* file offset of the extension area */
+	uint64_t extlen;
+	uint32_t nindex;
+	pid_t writer;
+	int64_t created;
+	uint64_t head; /* bytes written since creation */
+	uint64_t indexhead; /* index entries written since creation */
+	uint32_t futex; /* bumped on each write, readers wait on it */
+	uint32_t waiters;
+	struct ring_index_s index[];
+};
+
+struct ring_s {
+	int fd;
+	struct ring_hdr_s *hdr;
+	uint8_t *data;
+	size_t maplen;
+	int64_t lastindex; /* writer only */
+};
+
+/*
+ * HLS segment table, kept in the extension area of the HLS ring
+ */
+#define HLS_SEGMENTS 32 /* segments remembered, more than any window */
+
+struct hls_segment_s {
+	uint64_t pos; /* ring position of the first byte */
+	uint32_t len;
+	uint32_t duration; /* in ms */
+};
+
+struct hls_index_s {
+	uint64_t seq; /* segments completed since the ring was created */
+	uint32_t target; /* target duration in seconds */
+	uint32_t window;
+	struct hls_segment_s seg[HLS_SEGMENTS];
+};
+
+/*
+ * Shared-memory statistics segment.
+ *
+ * The segment is created by the main process before any client is
+ * forked, so every child inherits the mapping. When statusfile is
+ * configured, it is backed by that file and can be watched by
+ * rtp2httpd-top. Children only ever touch their own client slot and
+ * their group slot, using relaxed atomic operations.
+ */
+#define STATS_MAGIC 0x52545048 /* "RTPH" */
+#define STATS_VERSION 6
+#define STATS_URL_LEN 64
+#define STATS_GROUP_LEN 160
+#define STATS_GROUPS 256
+#define STATS_SPARE_SLOTS 16
+#define STATS_ZAP 64
+#define STATS_MEMBERS 1024
+
+#define STATS_ADD(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+#define STATS_SUB(var, n) __atomic_fetch_sub(&(var), (n), __ATOMIC_RELAXED)
+#define STATS_GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+#define STATS_SET(var, n) __atomic_store_n(&(var), (n), __ATOMIC_RELAXED)
+
+enum stats_slot_state {
+	SLOT_FREE = 0,
+	SLOT_CLAIMED,
+	SLOT_USED
+};
+
+struct stats_client_s {
+	uint32_t state;
+	int32_t group; /* index to groups[] or -1 */
+	pid_t pid;
+	int64_t start; /* unix time of accept */
+	struct sockaddr_storage ss;
+	char url[STATS_URL_LEN];
+	uint64_t bytes;
+	uint64_t packets;
+	uint64_t drops;
+	uint32_t queue; /* unsent bytes in the socket send buffer */
+	uint32_t weight; /* share when shaped, 0 = not shaped */
+	uint64_t demand; /* bytes per second the client could use */
+};
+
+/*
+ * Log-linear (HDR-style) histogram of microseconds: exact below 8 us,
+ * then 8 sub-buckets per power of two up to 2^24 us, plus overflow.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_MAX_BITS 24
+#define HIST_BUCKETS (((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + 1)
+
+struct stats_hist_s {
+	uint64_t count;
+	uint64_t sum; /* microseconds */
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+/*
+ * Phases of a zap, timed from the accept of the connection
+ */
+enum zap_phase {
+	ZAP_REQUEST = 0,  /* request read and parsed */
+	ZAP_RESOLVED,     /* service found */
+	ZAP_JOINED,       /* multicast group joined */
+	ZAP_FIRST_PACKET, /* first datagram received */
+	ZAP_FIRST_BYTE,   /* first payload byte written to the client */
+	ZAP_FIRST_RAP,    /* first random access point written */
+	ZAP_PHASES
+};
+
+struct stats_zap_s {
+	uint32_t state;
+	char service[STATS_URL_LEN];
+	struct stats_hist_s phase[ZAP_PHASES];
+};
+
+/*
+ * Where a traced payload spends its time
+ */
+enum trace_stage {
+	TRACE_PROXY = 0, /* received by the kernel until written */
+	TRACE_SOCKET,    /* written until sent out of the socket */
+	TRACE_NETWORK,   /* sent until acknowledged by the client */
+	TRACE_STAGES
+};
+
+struct stats_group_s {
+	uint32_t state;
+	uint32_t clients;
+	char group[STATS_GROUP_LEN]; /* [source@]group:port */
+	int64_t start;
+	uint64_t bytes;
+	uint64_t packets;
+	uint64_t drops;
+	struct stats_hist_s trace[TRACE_STAGES];
+	uint32_t members; /* sockets joined to the group */
+	uint32_t joined; /* the first of them has joined */
+	uint64_t joins; /* membership reports caused, retries included */
+	uint64_t retries;
+	uint64_t joinfails;
+	struct stats_hist_s join[2]; /* to first packet, first and retries */
+};
+
+/*
+ * Process with a socket joined to a group. The main process drops the
+ * membership of one that dies without leaving.
+ */
+struct stats_member_s {
+	pid_t pid; /* 0 if free */
+	int32_t group; /* index to groups[] or -1 */
+};
+
+struct stats_s {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nclients; /* number of client slots */
+	uint32_t ngroups;
+	pid_t pid;
+	int64_t start;
+	uint64_t accepted;
+	uint64_t rejected;
+	int64_t jointurn; /* earliest time of the next join or leave, us */
+	uint32_t joinwaiting; /* joins of viewers waiting for their turn */
+	struct stats_group_s groups[STATS_GROUPS];
+	struct stats_zap_s zap[STATS_ZAP];
+	struct stats_member_s members[STATS_MEMBERS];
+	struct stats_client_s clients[];
+};
+
 /* GLOBAL CONFIGURATION VARIABLES */
 
 extern enum loglevel conf_verbosity;
 extern int conf_daemonise;
 extern int conf_udpxy;
 extern int conf_maxclients;
+extern int conf_backlog;
 extern char *conf_hostname;
+extern char *conf_statusfile;
+extern char *conf_timeshiftdir;
+extern char *conf_recorddir;
+extern char *conf_hlsdir;
+extern int conf_recordapi;
+extern int conf_relayapi;
+extern int conf_fanout;
+extern int conf_joinrate;
+extern int conf_pinworkers;
+extern int conf_clientrate;
+extern int conf_iprate;
+extern int conf_egressrate;
+extern char *conf_logfile;
+extern char *conf_tlscert;
+extern char *conf_tlskey;
+extern int conf_trace;
+extern char *conf_clusternode;
+extern int conf_admitrate;
+extern int conf_cpulimit;
+extern int conf_ipclients;
 
 /* GLOBALS */
 extern struct services_s *services;
@@ -87,14 +329,9 @@ extern int clientcount;
 /* rtp2httpd.c INTERFACE */
 
 /**
- * Logger function. Show the message if current verbosity is above
- * logged level.
- *
- * @param levem Message log level
- * @param format printf style format string
- * @returns Whatever printf returns
+ * Close all listening sockets. Used by forked processes.
  */
-int logger(enum loglevel level, const char *format, ...);
+void closeListeners(void);
 
 
 /* httpclients.c INTERFACE */
@@ -107,6 +344,18 @@ int logger(enum loglevel level, const char *format, ...);
  */
 void clientService(int s);
 
+/*
+ * Find a parameter in URL query string.
+ * @returns newly allocated value or NULL if not present
+ */
+char* queryParam(const char *query, const char *name);
+
+/* Find a configured service by its name */
+struct services_s* findService(const char *name);
+
+/* Complete 503 response with Retry-After, @returns its length */
+int overloadResponse(char *buf, size_t len, int retry);
+
 /* Return values of clientService() */
 #define RETVAL_CLEAN 0
 #define RETVAL_WRITE_FAILED 1
@@ -116,9 +365,341 @@ void clientService(int s);
 #define RETVAL_RTP_FAILED 5
 #define RETVAL_SOCK_READ_FAILED 6
 
+/* multicast.c INTERFACE */
+
+/*
+ * Open UDP socket and join the multicast group of the service.
+ * @returns socket or -1 on failure
+ */
+int openMcastSocket(const struct services_s *service);
+
+/*
+ * Leave the group and join it again, so that a new membership report
+ * goes out.
+ * @returns 0 on success
+ */
+int mcastRejoin(int sock, const struct services_s *service);
+
+/*
+ * Run the process on the CPUs serving the interrupts of the interface
+ * the service receives on, when pinworkers is set.
+ */
+void mcastPin(const struct services_s *service);
+
+/*
+ * Find payload of a RTP packet.
+ * @returns payload length or -1 for malformed packet
+ */
+int rtpPayload(uint8_t *buf, int len, uint8_t **payload, uint16_t *seqn);
+uint32_t rtpTimestamp(const uint8_t *buf);
+
+/* mpegts.c INTERFACE */
+
+int tsRandomAccess(const uint8_t *buf, size_t len);
+int tsPCR(const uint8_t *pkt, uint64_t *pcr);
+int tsPID(const uint8_t *pkt);
+int tsPMTPids(const uint8_t *pkt, int *pids, int maxpids);
+
+/* ring.c INTERFACE */
+
+int64_t nowMs(void);
+struct ring_s* ringCreate(const char *path, uint64_t size, uint32_t seconds,
+		size_t extlen);
+struct ring_s* ringOpen(const char *path);
+void ringClose(struct ring_s *r);
+void* ringExt(const struct ring_s *r);
+void ringWrite(struct ring_s *r, const uint8_t *buf, size_t len, int rap);
+uint64_t ringHead(const struct ring_s *r);
+uint64_t ringTail(const struct ring_s *r);
+uint64_t ringSeek(const struct ring_s *r, int64_t time);
+int ringWait(struct ring_s *r, uint64_t pos, int timeout_ms);
+
+/* feeder.c INTERFACE */
+
+/*
+ * Feeders are processes owned by the main process, which receive
+ * a service permanently and write it into a ring.
+ */
+char* ringPath(const struct services_s *service);
+void feedersStart(void);
+void feedersCheck(void);
+void feedersUpgrade(void);
+void feederEnsure(struct services_s *service);
+int feederReaped(pid_t pid);
+/* Called by clients */
+void feederDemand(const struct services_s *service);
+
+/* record.c INTERFACE */
+
+void recordSchedule(const char *service, int64_t start, int minutes,
+		const char *file);
+void recordInit(void);
+void recordsCheck(void);
+void recordFeederDied(pid_t pid);
+int recordControl(const char *query, FILE *f);
+
+/* Called by the feeder */
+int recordNeeded(const struct services_s *service);
+void recordTick(const struct services_s *service);
+int recordActive(void);
+void recordWrite(const uint8_t *buf, size_t len);
+
+/* log.c INTERFACE */
+
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_DEBUG
+#endif /* LOG_MAX_LEVEL */
+
+/**
+ * Logger function. Show the message if current verbosity is above
+ * logged level. The level is checked inline, so arguments of filtered
+ * messages are not evaluated and levels above LOG_MAX_LEVEL are
+ * compiled out.
+ *
+ * @param level Message log level
+ * @param format printf style format string
+ * @returns Length of the message, 0 if it was filtered
+ */
+#define logger(level, ...) \
+	((level) <= LOG_MAX_LEVEL && (level) <= conf_verbosity ? \
+	 logMessage((level), __VA_ARGS__) : 0)
+int logMessage(enum loglevel level, const char *format, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+/* Called by the main process */
+void logInit(void);
+void logCheck(void);
+void logUpgrade(void);
+int logReaped(pid_t pid);
+
+/* zap.c INTERFACE */
+/* Called by the main process right after accept, before the fork */
+void zapAccept(void);
+/* Called by clients */
+void zapMark(enum zap_phase phase);
+void zapService(const char *url);
+void zapSent(const uint8_t *buf, size_t len);
+void zapPrometheus(FILE *f);
+
+/* tls.c INTERFACE */
+/* Called by the main process, before any client is forked */
+void tlsInit(void);
+/*
+ * Do the TLS handshake on an accepted connection. Called by clients.
+ * @returns the socket to serve the client on, plaintext goes in and
+ * out of it
+ */
+int tlsAccept(int s);
+/* Whether the client socket itself encrypts, in the kernel */
+int tlsActive(void);
+/* Stream the request is read from, when tlsActive() */
+FILE* tlsRequest(void);
+
+/* cluster.c INTERFACE */
+/* Called by the main process */
+void clusterConfigure(const char *name, const char *host, const char *port);
+void clusterInit(void);
+void clusterCheck(void);
+/* Called by clients */
+const char* clusterRedirect(const char *service, const char *path,
+		const char *query);
+void clusterPrometheus(FILE *f);
+
+/* upstream.c INTERFACE */
+int upstreamParse(const char *url, char **host, char **port, char **path);
+/* Called by the feeder */
+int upstreamRetry(void);
+void upstreamFlowing(void);
+void upstreamFailed(const struct services_s *service, const char *why);
+int upstreamConnect(struct services_s *service);
+int upstreamRead(int *sock, const struct services_s *service,
+		uint8_t **data);
+
+/* file.c INTERFACE */
+/* Called by clients */
+void fileStream(int client, const struct services_s *service);
+void fileSlate(int client, const struct services_s *service, int sock);
+
+/* rtsp.c INTERFACE */
+/* Called by the feeder */
+int rtspConnect(struct services_s *service);
+int rtspRead(int *sock, const struct services_s *service, uint8_t **packet);
+void rtspTick(int *sock, const struct services_s *service);
+void rtspClose(int *sock);
+
+/* join.c INTERFACE */
+/* Called by clients and feeders instead of openMcastSocket() */
+int joinOpen(const struct services_s *service, int viewers);
+void joinPacket(void);
+int joinWait(void);
+void joinRetry(int sock);
+void joinPrometheus(FILE *f);
+/* Called by the main process */
+void joinReaped(pid_t pid);
+
+/* resolve.c INTERFACE */
+int resolveNumeric(const char *host, const char *port, int type,
+		struct addrinfo **res);
+/* Called by the main process */
+void resolveStart(void);
+void resolveCheck(void);
+/*
+ * Make sure the addresses of the service are known, looking up names
+ * not resolved yet.
+ * @returns 0 on success
+ */
+int serviceResolve(struct services_s *service);
+
+/* upgrade.c INTERFACE */
+/* SIGUSR2 handler, and whether it was called since last asked */
+void upgradeRequest(int signum);
+int upgradeRequested(void);
+void upgradeKeep(int fd, const char *format, ...)
+	__attribute__ ((format (printf, 2, 3)));
+const char* upgradeTake(const char *name, int *fd);
+void* sharedMap(const char *name, size_t len, int fd, int *fresh);
+/* Called by the main process */
+int upgradeReceive(void);
+void upgradeDone(void);
+void upgradeExec(char *argv[]);
+
+/* admit.c INTERFACE */
+/* Called by the main process */
+void admitCheck(void);
+int admitClient(int s, const struct sockaddr_storage *ss, int tls);
+
+/* trace.c INTERFACE */
+/* Called by clients, only the streaming ones trace */
+void traceStart(int sock, int client);
+int traceRecv(int sock, uint8_t *buf, size_t len);
+int traceSend(int client, const uint8_t *buf, size_t len);
+int traceClient(int client);
+
+/* arena.c INTERFACE */
+#define ARENA_SLAB 2048 /* bytes, fits a datagram */
+#define ARENA_NONE UINT32_MAX
+int arenaInit(uint32_t count);
+int arenaEnabled(void);
+uint32_t arenaAlloc(void);
+uint8_t* arenaData(uint32_t slab);
+void arenaRef(uint32_t slab);
+void arenaUnref(uint32_t slab);
+uint32_t arenaFree(void);
+
+/* pace.c INTERFACE */
+void paceInit(int client, int delay_ms);
+int paceEnabled(void);
+uint8_t* paceBuffer(int client, uint32_t *slab);
+void paceQueue(int client, uint32_t slab, const uint8_t *buf, size_t len,
+		uint32_t rtpts, int hasrtp);
+int paceRun(int client);
+
+/* shape.c INTERFACE */
+int sameAddress(const struct sockaddr_storage *a,
+		const struct sockaddr_storage *b);
+void shapeStart(int s, int weight);
+void shapeAcquire(size_t len);
+
+/* relay.c INTERFACE */
+/* Called by the main process */
+void relayConfigure(const char *service, const char *dest);
+void relayInit(void);
+void relaysCheck(void);
+int relayControl(const char *query, FILE *f);
+/* Called by the feeder */
+int relayNeeded(const struct services_s *service);
+void relayTick(const struct services_s *service);
+void relayWrite(const uint8_t *buf, size_t len);
+void relayFlush(void);
+
+/* hls.c INTERFACE */
+/* Called by the feeder */
+void hlsStart(const struct services_s *service);
+void hlsWrite(const uint8_t *buf, size_t len, int rap);
+/* Called by clients */
+int hlsOpen(const struct services_s *service);
+void hlsPlaylist(FILE *f);
+int hlsSegment(uint64_t seq, uint64_t *pos, size_t *len);
+void hlsSend(int client, uint64_t pos, size_t len);
+
+/* timeshift.c INTERFACE */
+
+#define TIMESHIFT_UNAVAILABLE -1
+#define TIMESHIFT_BADRANGE -2
+
+/*
+ * Find where a timeshifted client starts.
+ * @param offset seconds back from now, or 0 to use range
+ * @param range requested byte position, or -1
+ * @param pos set to the starting stream position
+ * @returns 0 or one of TIMESHIFT_ errors
+ */
+int timeshiftOpen(const struct services_s *service, long offset,
+		long long range, uint64_t *pos);
+/*
+ * Open the ring of a service fed on demand, waiting for the feeder to
+ * start, and find the live position to start at.
+ */
+int timeshiftLiveOpen(const struct services_s *service, uint64_t *pos);
+uint64_t timeshiftLive(void);
+void timeshiftStream(int client, uint64_t pos);
+
+/* status.c INTERFACE */
+
+extern struct stats_s *stats;
+extern int stats_slot;
+
+/*
+ * Create the statistics segment. Has to be called by the main
+ * process after the configuration is read and before forking.
+ */
+void statsInit(void);
+
+/* Claim/release a client slot, called by the main process */
+int statsAllocClient(const struct sockaddr_storage *ss);
+void statsClientPid(int slot, pid_t pid);
+void statsFreeClient(int slot);
+
+/*
+ * Bind the current child to a service. Finds or creates the slot
+ * of the multicast group the service joins.
+ */
+void statsSetService(const char *url, const struct services_s *service);
+/*
+ * Slot of the multicast group the service joins, without binding
+ * anything to it.
+ * @returns NULL without statistics or free slots
+ */
+struct stats_group_s* statsGroup(const struct services_s *service);
+
+/* Hot path counters of the current child */
+void statsPacket(size_t bytes);
+void statsDrops(unsigned int n);
+void statsTrace(enum trace_stage stage, int64_t us);
+void statsQueue(int s);
+
+/* Write udpxy-like HTML status page or Prometheus metrics */
+void statsHTML(FILE *f);
+void statsPrometheus(FILE *f);
+/* Escape a Prometheus label value */
+void labelEscape(FILE *f, const char *s);
+
+/* Latency histograms kept in the statistics segment */
+void histRecord(struct stats_hist_s *h, int64_t us);
+/* Value in microseconds below which the fraction q of samples lies */
+uint64_t histQuantile(const struct stats_hist_s *h, double q);
+/*
+ * Write one histogram with two labels as a Prometheus histogram or,
+ * with quantiles set, as a summary. HELP and TYPE are up to the caller.
+ */
+void histPrometheus(FILE *f, const char *name, const char *k1,
+		const char *v1, const char *k2, const char *v2,
+		const struct stats_hist_s *h, int quantiles);
+
 /* configfile.c INTERFACE */
 
 void parseCmdLine(int argc, char *argv[]);
+void parseServicesSec(char *line);
 struct bindaddr_s* newEmptyBindaddr();
 void freeBindaddr(struct bindaddr_s*);
 
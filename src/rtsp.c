@@ -0,0 +1,462 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * RTSP upstream of RTSP services.
+ *
+ * As with HTTP services, the feeder of the service holds the only
+ * session and all viewers read the ring it fills. The session is
+ * DESCRIBE, SETUP of the first media and PLAY; the RTP packets then go
+ * the way of those received from multicast. RTP comes over UDP, or
+ * interleaved in the RTSP connection when the service asks for it, the
+ * server refuses UDP or nothing arrives over UDP, as behind a NAT.
+ *
+ * The session is kept alive by an OPTIONS request every half of its
+ * timeout, and torn down once the feeder is not needed anymore, that is
+ * `linger` seconds after the last viewer left.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+/* Fits the largest interleaved frame */
+#define RTSP_BUFLEN (65535 + 4)
+#define RTSP_MAXHEADER 4096
+#define RTSP_DGRAMLEN 2000
+#define RTSP_TIMEOUT 5 /* seconds to wait for a response */
+#define RTSP_SESSION_TIMEOUT 60 /* when the server does not say */
+#define RTSP_NODATA 5 /* seconds without RTP before starting over */
+
+static int ctrl = -1;
+static int data = -1; /* UDP socket, -1 when interleaved */
+static int tcp = 0; /* interleaved, sticks once UDP did not work */
+static unsigned int cseq = 0;
+static char session[256] = "";
+static char control[1024];
+static int timeout;
+static time_t lastkeep, lastdata;
+static int gotdata;
+
+static uint8_t buf[RTSP_BUFLEN + 1];
+static size_t have = 0; /* bytes in buf */
+static size_t out = 0; /* of them handed out by the last read */
+static uint8_t dgram[RTSP_DGRAMLEN];
+
+static void consume(size_t n) {
+	memmove(buf, buf + n, have - n);
+	have -= n;
+}
+
+static int sendRequest(const char *method, const char *url,
+		const char *extra) {
+	char *req;
+	int n, r;
+
+	n = asprintf(&req, "%s %s RTSP/1.0\r\nCSeq: %u\r\n"
+		"User-Agent: " PACKAGE "/" VERSION "\r\n%s%s%s%s\r\n",
+		method, url, ++cseq, session[0] ? "Session: " : "", session,
+		session[0] ? "\r\n" : "", extra ? extra : "");
+	if (n < 0)
+		return -1;
+	r = send(ctrl, req, n, MSG_NOSIGNAL);
+	free(req);
+	return r == n ? 0 : -1;
+}
+
+/*
+ * Value of a header of the message at the start of buf
+ * @returns 1 when found
+ */
+static int header(const char *name, char *value, size_t len) {
+	const char *p = (const char *) buf, *eol;
+	size_t n = strlen(name);
+
+	while ((eol = strstr(p, "\r\n")) != NULL && eol != p) {
+		if (strncasecmp(p, name, n) == 0 && p[n] == ':') {
+			p += n + 1;
+			while (*p == ' ')
+				p++;
+			snprintf(value, len, "%.*s", (int) (eol - p), p);
+			return 1;
+		}
+		p = eol + 2;
+	}
+	return 0;
+}
+
+/*
+ * Length of the complete message at the start of buf
+ * @returns 0 while incomplete
+ */
+static size_t message(void) {
+	char *eoh, cl[16];
+	size_t len;
+
+	buf[have] = '\0';
+	eoh = strstr((char *) buf, "\r\n\r\n");
+	if (eoh == NULL)
+		return 0;
+	len = eoh + 4 - (char *) buf;
+	if (header("Content-Length", cl, sizeof(cl)))
+		len += strtoul(cl, NULL, 10);
+	return len <= have ? len : 0;
+}
+
+/*
+ * Wait for the response to the last request, skipping interleaved data
+ * before it. The response stays at the start of buf until the next
+ * call. Nothing follows it before PLAY, so the body is terminated.
+ * @returns its status code, or -1
+ */
+static int readResponse(char **body) {
+	size_t len;
+	int n, status = -1;
+
+	consume(out);
+	out = 0;
+	while (1) {
+		if (have >= 4 && buf[0] == '$' &&
+		    have >= 4 + (size_t) (buf[2] << 8 | buf[3])) {
+			consume(4 + (buf[2] << 8 | buf[3]));
+			continue;
+		}
+		if (have > 0 && buf[0] != '$' && (len = message()) > 0) {
+			sscanf((char *) buf, "RTSP/%*s %d", &status);
+			*body = strstr((char *) buf, "\r\n\r\n") + 4;
+			out = len;
+			return status;
+		}
+		if (have >= RTSP_BUFLEN)
+			return -1;
+		n = recv(ctrl, buf + have, RTSP_BUFLEN - have, 0);
+		if (n <= 0)
+			return -1;
+		have += n;
+	}
+}
+
+static int failed(const struct services_s *service, const char *why) {
+	upstreamFailed(service, why);
+	rtspClose(NULL);
+	return -1;
+}
+
+/*
+ * URL to SETUP: the control attribute of the first media in the SDP,
+ * relative to the base URL
+ */
+static void mediaControl(const char *sdp, const char *base) {
+	const char *m, *next, *a;
+	int n;
+
+	m = strncmp(sdp, "m=", 2) == 0 ? sdp : strstr(sdp, "\nm=");
+	a = m ? strstr(m, "a=control:") : NULL;
+	next = m ? strstr(m + 1, "\nm=") : NULL;
+	if (a == NULL || (next && a > next)) {
+		snprintf(control, sizeof(control), "%s", base);
+		return;
+	}
+	a += strlen("a=control:");
+	n = strcspn(a, "\r\n");
+	if (strncasecmp(a, "rtsp://", 7) == 0)
+		snprintf(control, sizeof(control), "%.*s", n, a);
+	else if (n == 1 && *a == '*')
+		snprintf(control, sizeof(control), "%s", base);
+	else if (snprintf(control, sizeof(control), "%s%s%.*s", base,
+			base[strlen(base) - 1] == '/' ? "" : "/", n, a) >=
+			(int) sizeof(control))
+		logger(LOG_ERROR, "RTSP control URL too long: %s\n", control);
+}
+
+/*
+ * Open the UDP socket for RTP on an even port, with the next one as the
+ * RTCP port to announce
+ * @returns the port, or -1
+ */
+static int openData(const struct services_s *service) {
+	struct sockaddr_storage ss;
+	socklen_t len;
+	int port = -1, i;
+
+	for (i = 0; i < 8 && port < 0; i++) {
+		data = socket(service->addr->ai_family, SOCK_DGRAM |
+			SOCK_CLOEXEC, 0);
+		if (data < 0)
+			return -1;
+		memset(&ss, 0, sizeof(ss));
+		ss.ss_family = service->addr->ai_family;
+		len = sizeof(ss);
+		if (bind(data, (struct sockaddr *) &ss,
+				service->addr->ai_addrlen) < 0 ||
+		    getsockname(data, (struct sockaddr *) &ss, &len) < 0)
+			break;
+		port = ntohs(ss.ss_family == AF_INET ?
+			((struct sockaddr_in *) &ss)->sin_port :
+			((struct sockaddr_in6 *) &ss)->sin6_port);
+		if (port % 2) {
+			close(data);
+			data = -1;
+			port = -1;
+		}
+	}
+	return port;
+}
+
+/*
+ * Set up and play a session of the service, unless still backing off.
+ * @returns the socket the RTP comes from, or -1
+ */
+int rtspConnect(struct services_s *service) {
+	struct timeval tv = { RTSP_TIMEOUT, 0 };
+	char base[1024], value[256], extra[128], *body, *p;
+	int status, port;
+
+	if (!upstreamRetry())
+		return -1;
+	if (serviceResolve(service) < 0) {
+		upstreamFailed(service, "cannot resolve");
+		return -1;
+	}
+	tcp = tcp || service->interleaved;
+	cseq = 0;
+	session[0] = '\0';
+	have = out = 0;
+
+	ctrl = socket(service->addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (ctrl < 0)
+		return failed(service, strerror(errno));
+	setsockopt(ctrl, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(ctrl, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (connect(ctrl, service->addr->ai_addr,
+			service->addr->ai_addrlen) < 0)
+		return failed(service, strerror(errno));
+
+	if (sendRequest("DESCRIBE", service->upstream,
+			"Accept: application/sdp\r\n") < 0 ||
+	    readResponse(&body) != 200)
+		return failed(service, "DESCRIBE failed");
+	if (!header("Content-Base", base, sizeof(base)) &&
+	    !header("Content-Location", base, sizeof(base)))
+		snprintf(base, sizeof(base), "%s", service->upstream);
+	mediaControl(body, base);
+
+	while (1) {
+		if (tcp) {
+			snprintf(extra, sizeof(extra), "Transport: "
+				"RTP/AVP/TCP;unicast;interleaved=0-1\r\n");
+		} else {
+			port = openData(service);
+			if (port < 0)
+				return failed(service, strerror(errno));
+			snprintf(extra, sizeof(extra), "Transport: "
+				"RTP/AVP;unicast;client_port=%d-%d\r\n",
+				port, port + 1);
+		}
+		if (sendRequest("SETUP", control, extra) < 0)
+			return failed(service, "SETUP failed");
+		status = readResponse(&body);
+		if (status == 200)
+			break;
+		if (tcp || status < 0)
+			return failed(service, "SETUP failed");
+		logger(LOG_INFO, "Upstream %s refused UDP, trying TCP\n",
+				service->upstream);
+		close(data);
+		data = -1;
+		tcp = 1;
+	}
+	if (!header("Session", value, sizeof(value)))
+		return failed(service, "no session");
+	p = strstr(value, ";timeout=");
+	timeout = p ? atoi(p + strlen(";timeout=")) : 0;
+	if (timeout < 2)
+		timeout = RTSP_SESSION_TIMEOUT;
+	value[strcspn(value, ";")] = '\0';
+	snprintf(session, sizeof(session), "%s", value);
+
+	if (sendRequest("PLAY", base, "Range: npt=0.000-\r\n") < 0 ||
+	    readResponse(&body) != 200)
+		return failed(service, "PLAY failed");
+	consume(out);
+	out = 0;
+
+	lastkeep = lastdata = time(NULL);
+	gotdata = 0;
+	logger(LOG_INFO, "Upstream %s playing over %s\n", service->upstream,
+			tcp ? "TCP" : "UDP");
+	return tcp ? ctrl : data;
+}
+
+static void gotData(void) {
+	lastdata = time(NULL);
+	if (!gotdata) {
+		gotdata = 1;
+		upstreamFlowing();
+	}
+}
+
+/*
+ * Read an RTP packet of the session without blocking. Closes the
+ * session and sets the socket to -1 when the server goes away.
+ * @returns the length of the packet, 0 when there is none
+ */
+int rtspRead(int *sock, const struct services_s *service, uint8_t **packet) {
+	size_t len;
+	const uint8_t *next;
+	int n;
+
+	if (!tcp) {
+		n = recv(data, dgram, sizeof(dgram), MSG_DONTWAIT);
+		if (n <= 0)
+			return 0;
+		gotData();
+		*packet = dgram;
+		return n;
+	}
+
+	consume(out);
+	out = 0;
+	while (1) {
+		if (have >= 4 && buf[0] == '$') {
+			len = buf[2] << 8 | buf[3];
+			if (have >= 4 + len) {
+				out = 4 + len;
+				if (buf[1] == 0 && len > 0) {
+					gotData();
+					*packet = buf + 4;
+					return len;
+				}
+				/* RTCP of the server */
+				consume(out);
+				out = 0;
+				continue;
+			}
+		} else if (have > 0 && buf[0] != '$') {
+			/* A response to a keepalive, or a request of the
+			 * server; anything else is skipped to the next frame */
+			if ((len = message()) > 0) {
+				consume(len);
+				continue;
+			}
+			if (have > RTSP_MAXHEADER) {
+				next = memchr(buf + 1, '$', have - 1);
+				consume(next ? next - buf : have);
+				continue;
+			}
+		}
+		n = recv(ctrl, buf + have, RTSP_BUFLEN - have, MSG_DONTWAIT);
+		if (n == 0 || (n < 0 && errno != EAGAIN &&
+		    errno != EWOULDBLOCK && errno != EINTR)) {
+			logger(LOG_ERROR, "Upstream %s closed: %s\n",
+				service->upstream, n ? strerror(errno) : "EOF");
+			rtspClose(sock);
+			return 0;
+		}
+		if (n < 0)
+			return 0;
+		have += n;
+	}
+}
+
+/*
+ * Keep the session alive and notice when it is not. Called by the
+ * feeder once a second.
+ */
+void rtspTick(int *sock, const struct services_s *service) {
+	char discard[512];
+	time_t now = time(NULL);
+	int n;
+
+	if (ctrl < 0)
+		return;
+	if (!tcp) {
+		/* Responses to keepalives, or the server going away */
+		while ((n = recv(ctrl, discard, sizeof(discard),
+				MSG_DONTWAIT)) > 0)
+			;
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+		    errno != EINTR)) {
+			logger(LOG_ERROR, "Upstream %s closed\n",
+				service->upstream);
+			rtspClose(sock);
+			return;
+		}
+	}
+	if (now - lastdata > RTSP_NODATA) {
+		if (!gotdata && !tcp) {
+			logger(LOG_ERROR, "Upstream %s: nothing over UDP, "
+				"trying TCP\n", service->upstream);
+			tcp = 1;
+		} else {
+			logger(LOG_ERROR, "Upstream %s: no data\n",
+				service->upstream);
+		}
+		rtspClose(sock);
+		return;
+	}
+	if (now - lastkeep >= timeout / 2) {
+		lastkeep = now;
+		sendRequest("OPTIONS", service->upstream, NULL);
+	}
+}
+
+/*
+ * Tear the session down, the server may limit how many there are
+ */
+void rtspClose(int *sock) {
+	struct timeval tv = { 1, 0 };
+	time_t deadline = time(NULL) + 1;
+
+	if (ctrl >= 0 && session[0] &&
+	    sendRequest("TEARDOWN", control, NULL) == 0) {
+		/* Closing with interleaved data unread would reset the
+		 * connection, and the server might never see the request */
+		shutdown(ctrl, SHUT_WR);
+		setsockopt(ctrl, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		while (recv(ctrl, buf, RTSP_BUFLEN, 0) > 0 &&
+		    time(NULL) <= deadline)
+			;
+	}
+	if (ctrl >= 0)
+		close(ctrl);
+	if (data >= 0)
+		close(data);
+	ctrl = data = -1;
+	session[0] = '\0';
+	have = out = 0;
+	if (sock)
+		*sock = -1;
+}
@@ -0,0 +1,248 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Bandwidth shaping of clients.
+ *
+ * Every client process enforces its own rate with a token bucket, and
+ * asks the kernel to pace the socket at the same rate. The rate is the
+ * smallest of the per client cap and the client's weighted share of the
+ * per subscriber IP and the global egress caps.
+ *
+ * The shares are computed by each client alone, from the weight and the
+ * demand every other client publishes in the statistics segment. The
+ * caps are divided max-min fairly: every client is set aside a small
+ * floor first, so none starves, then clients which need less than their
+ * share of the rest keep what they need, and what remains is split
+ * among the others in proportion to their weights. A cap too small for
+ * the floors is split evenly, so the rates never add up to more.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#define min(a,b) ((a)<(b) ? (a):(b))
+#define max(a,b) ((a)>(b) ? (a):(b))
+
+/* How often the rate is recomputed */
+#define SHAPE_PERIOD_MS 100
+/* Bucket depth, in time at the current rate */
+#define SHAPE_BURST_MS 100
+#define SHAPE_MIN_BURST (64*1024)
+/* Headroom a client gets above what it used last period */
+#define SHAPE_HEADROOM(r) ((r) + (r) / 4 + 8192)
+#define SHAPE_UNLIMITED UINT64_MAX
+/* Never starve a client completely, in bytes per second */
+#define SHAPE_MIN_RATE (16*1024)
+
+static int shaping = 0;
+static int sock = -1;
+static uint64_t rate; /* bytes per second */
+static uint64_t pacing;
+static double tokens;
+static int64_t lastfill, lastperiod;
+static uint64_t periodbytes;
+static int throttled;
+
+static int64_t monoUs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int sameAddress(const struct sockaddr_storage *a,
+		const struct sockaddr_storage *b) {
+	if (a->ss_family != b->ss_family)
+		return 0;
+	if (a->ss_family == AF_INET)
+		return ((struct sockaddr_in *) a)->sin_addr.s_addr ==
+			((struct sockaddr_in *) b)->sin_addr.s_addr;
+	if (a->ss_family == AF_INET6)
+		return memcmp(&((struct sockaddr_in6 *) a)->sin6_addr,
+			&((struct sockaddr_in6 *) b)->sin6_addr,
+			sizeof(struct in6_addr)) == 0;
+	return 0;
+}
+
+struct claim_s {
+	uint64_t demand;
+	uint32_t weight;
+};
+
+static int claimCmp(const void *a, const void *b) {
+	const struct claim_s *x = a, *y = b;
+	/* Order by demand per unit of weight */
+	double dx = (double) x->demand / x->weight;
+	double dy = (double) y->demand / y->weight;
+	return dx < dy ? -1 : dx > dy;
+}
+
+/*
+ * Max-min fair share of capacity for a client of the given weight
+ * and demand, among the claims (which include the client itself).
+ */
+static uint64_t fairShare(uint64_t capacity, struct claim_s *claims, int n,
+		uint32_t weight, uint64_t demand) {
+	int i;
+	uint64_t base;
+	double left, wleft = 0, level;
+
+	/* The floors come off the top, the rest is shared */
+	base = min(SHAPE_MIN_RATE, capacity / max(n, 1));
+	left = capacity - base * n;
+	for (i = 0; i < n; i++) {
+		claims[i].demand = claims[i].demand > base ?
+			claims[i].demand - base : 0;
+		wleft += claims[i].weight;
+	}
+	demand = demand > base ? demand - base : 0;
+	qsort(claims, n, sizeof(struct claim_s), claimCmp);
+	for (i = 0; i < n; i++) {
+		level = left / wleft;
+		if (claims[i].demand >= level * claims[i].weight)
+			break;
+		left -= claims[i].demand;
+		wleft -= claims[i].weight;
+	}
+	level = wleft > 0 ? left / wleft : left;
+	return base + min(demand, (uint64_t) (level * weight));
+}
+
+/*
+ * Recompute the rate of this client from the published claims
+ * @param elapsed microseconds since the last update
+ */
+static void shapeUpdate(int64_t elapsed) {
+	struct stats_client_s *me = &stats->clients[stats_slot];
+	struct stats_client_s *c;
+	struct claim_s *all, *ip;
+	int nall = 0, nip = 0;
+	uint32_t i, weight = me->weight;
+	uint64_t demand, newrate;
+
+	demand = throttled ? SHAPE_UNLIMITED :
+		SHAPE_HEADROOM(periodbytes * 1000000 / max(elapsed, 1));
+	STATS_SET(me->demand, demand);
+
+	newrate = conf_clientrate ? (uint64_t) conf_clientrate * 1000 / 8 :
+		SHAPE_UNLIMITED;
+	if (conf_egressrate || conf_iprate) {
+		all = alloca(stats->nclients * sizeof(struct claim_s));
+		ip = alloca(stats->nclients * sizeof(struct claim_s));
+		for (i = 0; i < stats->nclients; i++) {
+			c = &stats->clients[i];
+			if (STATS_GET(c->state) != SLOT_USED ||
+			    STATS_GET(c->weight) == 0)
+				continue;
+			all[nall].weight = STATS_GET(c->weight);
+			all[nall].demand = i == stats_slot ? demand :
+				STATS_GET(c->demand);
+			if (conf_iprate && sameAddress(&c->ss, &me->ss))
+				ip[nip++] = all[nall];
+			nall++;
+		}
+		if (conf_egressrate)
+			newrate = min(newrate, fairShare((uint64_t)
+				conf_egressrate * 1000 / 8, all, nall,
+				weight, demand));
+		if (conf_iprate)
+			newrate = min(newrate, fairShare((uint64_t)
+				conf_iprate * 1000 / 8, ip, nip,
+				weight, demand));
+	}
+	/* The floor is in the shares already, this only keeps it nonzero */
+	rate = max(newrate, 1);
+
+	/* Let the kernel pace the socket too, where fq is in use */
+	if (rate == SHAPE_UNLIMITED && pacing != 0) {
+		uint32_t r = UINT32_MAX;
+		setsockopt(sock, SOL_SOCKET, SO_MAX_PACING_RATE, &r, sizeof(r));
+		pacing = 0;
+	} else if (rate != SHAPE_UNLIMITED &&
+	    (rate > pacing + pacing / 8 || rate < pacing - pacing / 8)) {
+		uint32_t r = min(rate, UINT32_MAX - 1);
+		if (setsockopt(sock, SOL_SOCKET, SO_MAX_PACING_RATE,
+				&r, sizeof(r)) == 0)
+			pacing = rate;
+	}
+	periodbytes = 0;
+	throttled = 0;
+}
+
+/*
+ * Start shaping the client socket, if any cap is configured.
+ * @param weight share of the client relative to others
+ */
+void shapeStart(int s, int weight) {
+	if (!(conf_clientrate || conf_iprate || conf_egressrate) ||
+	    stats == NULL || stats_slot < 0)
+		return;
+	shaping = 1;
+	sock = s;
+	STATS_SET(stats->clients[stats_slot].demand, SHAPE_UNLIMITED);
+	STATS_SET(stats->clients[stats_slot].weight, (uint32_t) max(weight, 1));
+	lastfill = lastperiod = monoUs();
+	throttled = 1;
+	shapeUpdate(SHAPE_PERIOD_MS * 1000);
+	tokens = SHAPE_MIN_BURST;
+}
+
+/*
+ * Take len bytes worth of tokens, sleeping until there are enough.
+ * Called before each write to the client.
+ */
+void shapeAcquire(size_t len) {
+	int64_t now;
+	double burst;
+
+	if (!shaping)
+		return;
+	now = monoUs();
+	if (now - lastperiod >= SHAPE_PERIOD_MS * 1000) {
+		shapeUpdate(now - lastperiod);
+		lastperiod = now;
+	}
+	periodbytes += len;
+	if (rate == SHAPE_UNLIMITED)
+		return;
+
+	burst = max((double) rate * SHAPE_BURST_MS / 1000, SHAPE_MIN_BURST);
+	tokens = min(tokens + (double) (now - lastfill) * rate / 1000000,
+			burst);
+	lastfill = now;
+	tokens -= len;
+	if (tokens < 0) {
+		throttled = 1;
+		usleep((useconds_t) (-tokens * 1000000 / rate));
+	}
+}
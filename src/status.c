@@ -0,0 +1,615 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+#include <netdb.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+/* Sample the socket send queue once per this many packets */
+#define QUEUE_SAMPLE_MASK 0xFF
+
+struct stats_s *stats = NULL;
+int stats_slot = -1;
+
+static struct stats_group_s *mygroup = NULL;
+
+/*
+ * Create the statistics segment. Has to be called by the main
+ * process after the configuration is read and before forking.
+ */
+void statsInit(void) {
+	size_t len;
+	int fd = -1;
+	int fresh;
+	void *p;
+	uint32_t nclients;
+	int i;
+	char name[32];
+
+	nclients = conf_maxclients + STATS_SPARE_SLOTS;
+	len = sizeof(struct stats_s) +
+		nclients * sizeof(struct stats_client_s);
+
+	if (conf_statusfile) {
+		/* Sized and cleared below unless taken over */
+		fd = open(conf_statusfile, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			logger(LOG_ERROR, "Cannot create status file %s: %s\n",
+					conf_statusfile, strerror(errno));
+		}
+	}
+
+	/* Only a segment of the same layout is taken over */
+	snprintf(name, sizeof(name), "%s-%d",
+			conf_statusfile ? "statusfile" : "stats", STATS_VERSION);
+	p = sharedMap(name, len, fd, &fresh);
+	if (p == NULL)
+		return;
+	stats = p;
+	/* Upgraded, the children keep their slots */
+	if (!fresh)
+		return;
+	memset(p, 0, len);
+	stats->version = STATS_VERSION;
+	stats->nclients = nclients;
+	stats->ngroups = STATS_GROUPS;
+	stats->pid = getpid();
+	stats->start = time(NULL);
+	for (i = 0; i < STATS_MEMBERS; i++)
+		stats->members[i].group = -1;
+	/* Magic goes last, so readers never see half-initialised header */
+	__atomic_store_n(&stats->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+}
+
+/*
+ * Claim a client slot for a child that is about to be forked.
+ * @returns slot index or -1 if there is none left
+ */
+int statsAllocClient(const struct sockaddr_storage *ss) {
+	uint32_t i;
+	struct stats_client_s *c;
+
+	if (!stats)
+		return -1;
+	STATS_ADD(stats->accepted, 1);
+	for (i = 0; i < stats->nclients; i++) {
+		c = &stats->clients[i];
+		if (STATS_GET(c->state) != SLOT_FREE)
+			continue;
+		c->group = -1;
+		c->pid = 0;
+		c->start = time(NULL);
+		c->ss = *ss;
+		c->url[0] = '\0';
+		c->bytes = c->packets = c->drops = 0;
+		c->queue = 0;
+		c->weight = 0;
+		c->demand = 0;
+		__atomic_store_n(&c->state, SLOT_USED, __ATOMIC_RELEASE);
+		return i;
+	}
+	return -1;
+}
+
+void statsClientPid(int slot, pid_t pid) {
+	if (!stats || slot < 0)
+		return;
+	STATS_SET(stats->clients[slot].pid, pid);
+}
+
+void statsFreeClient(int slot) {
+	struct stats_client_s *c;
+	int32_t gi;
+
+	if (!stats || slot < 0)
+		return;
+	c = &stats->clients[slot];
+	gi = STATS_GET(c->group);
+	if (gi >= 0)
+		STATS_SUB(stats->groups[gi].clients, 1);
+	__atomic_store_n(&c->state, SLOT_FREE, __ATOMIC_RELEASE);
+}
+
+/*
+ * Find or create group slot. Slots are never released, so the counters
+ * are monotonic for the whole life of the daemon.
+ */
+static int findGroup(const char *name) {
+	int i;
+	uint32_t expected;
+	struct stats_group_s *g;
+
+	for (i = 0; i < STATS_GROUPS; i++) {
+		g = &stats->groups[i];
+		expected = SLOT_FREE;
+		if (__atomic_compare_exchange_n(&g->state, &expected,
+				SLOT_CLAIMED, 0, __ATOMIC_ACQUIRE,
+				__ATOMIC_RELAXED)) {
+			snprintf(g->group, sizeof(g->group), "%s", name);
+			g->start = time(NULL);
+			__atomic_store_n(&g->state, SLOT_USED, __ATOMIC_RELEASE);
+			return i;
+		}
+		/* Somebody else is just filling it in */
+		while (expected == SLOT_CLAIMED) {
+			usleep(100);
+			expected = __atomic_load_n(&g->state, __ATOMIC_ACQUIRE);
+		}
+		if (strcmp(g->group, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Find or create the slot of the multicast group the service joins.
+ * @returns its index or -1
+ */
+static int serviceGroup(const struct services_s *service) {
+	char hbuf[64], sbuf[16], shbuf[64]; /* numeric only */
+	char name[STATS_GROUP_LEN];
+	int r, gi;
+
+	if (service->service_type == SERVICE_FILE) {
+		/* The file stands for the group */
+		snprintf(name, sizeof(name), "%s", service->file);
+	} else {
+		r = getnameinfo(service->addr->ai_addr,
+				service->addr->ai_addrlen, hbuf, sizeof(hbuf),
+				sbuf, sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV);
+		if (r) {
+			logger(LOG_ERROR, "getnameinfo failed: %s\n",
+					gai_strerror(r));
+			return -1;
+		}
+		if (service->msrc && strcmp(service->msrc, "") != 0 &&
+				service->msrc_addr &&
+				getnameinfo(service->msrc_addr->ai_addr,
+					service->msrc_addr->ai_addrlen,
+					shbuf, sizeof(shbuf), NULL, 0,
+					NI_NUMERICHOST) == 0) {
+			snprintf(name, sizeof(name), "%s@%s:%s", shbuf, hbuf,
+					sbuf);
+		} else {
+			snprintf(name, sizeof(name), "%s:%s", hbuf, sbuf);
+		}
+		/* The same group on another interface is another group */
+		if (service->ifname)
+			snprintf(name + strlen(name), sizeof(name) -
+				strlen(name), "%%%s", service->ifname);
+	}
+
+	gi = findGroup(name);
+	if (gi < 0)
+		logger(LOG_ERROR, "No free group slot for %s\n", name);
+	return gi;
+}
+
+/*
+ * Bind the current child to a service. Finds or creates the slot
+ * of the multicast group the service joins.
+ */
+void statsSetService(const char *url, const struct services_s *service) {
+	struct stats_client_s *c = NULL;
+	int gi;
+
+	if (!stats)
+		return;
+	if (stats_slot >= 0) {
+		c = &stats->clients[stats_slot];
+		strncpy(c->url, url, sizeof(c->url) - 1);
+	}
+
+	gi = serviceGroup(service);
+	if (gi < 0)
+		return;
+	mygroup = &stats->groups[gi];
+	STATS_ADD(mygroup->clients, 1);
+	if (c)
+		STATS_SET(c->group, gi);
+}
+
+/*
+ * Slot of the multicast group the service joins, without binding
+ * anything to it.
+ * @returns NULL without statistics or free slots
+ */
+struct stats_group_s* statsGroup(const struct services_s *service) {
+	int gi;
+
+	if (!stats)
+		return NULL;
+	gi = serviceGroup(service);
+	return gi < 0 ? NULL : &stats->groups[gi];
+}
+
+void statsPacket(size_t bytes) {
+	if (stats_slot >= 0) {
+		STATS_ADD(stats->clients[stats_slot].bytes, bytes);
+		STATS_ADD(stats->clients[stats_slot].packets, 1);
+	}
+	if (mygroup) {
+		STATS_ADD(mygroup->bytes, bytes);
+		STATS_ADD(mygroup->packets, 1);
+	}
+}
+
+void statsDrops(unsigned int n) {
+	if (stats_slot >= 0)
+		STATS_ADD(stats->clients[stats_slot].drops, n);
+	if (mygroup)
+		STATS_ADD(mygroup->drops, n);
+}
+
+void statsTrace(enum trace_stage stage, int64_t us) {
+	if (mygroup)
+		histRecord(&mygroup->trace[stage], us);
+}
+
+/*
+ * Sample the amount of data waiting in the client socket. This costs
+ * a syscall, so it is done only once per QUEUE_SAMPLE_MASK+1 calls.
+ */
+void statsQueue(int s) {
+	static unsigned int calls = 0;
+	int q;
+
+	if (stats_slot < 0 || (calls++ & QUEUE_SAMPLE_MASK) != 0)
+		return;
+	if (ioctl(s, SIOCOUTQ, &q) == 0)
+		STATS_SET(stats->clients[stats_slot].queue, q);
+}
+
+static void clientAddress(const struct stats_client_s *c,
+		char *buf, size_t buflen) {
+	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+
+	if (getnameinfo((const struct sockaddr *) &c->ss, sizeof(c->ss),
+			hbuf, sizeof(hbuf), sbuf, sizeof(sbuf),
+			NI_NUMERICHOST | NI_NUMERICSERV)) {
+		snprintf(buf, buflen, "?");
+		return;
+	}
+	snprintf(buf, buflen, "%s:%s", hbuf, sbuf);
+}
+
+static void htmlEscape(FILE *f, const char *s) {
+	for (; *s; s++) {
+		switch (*s) {
+			case '<': fputs("&lt;", f); break;
+			case '>': fputs("&gt;", f); break;
+			case '&': fputs("&amp;", f); break;
+			case '"': fputs("&quot;", f); break;
+			default: fputc(*s, f);
+		}
+	}
+}
+
+void labelEscape(FILE *f, const char *s) {
+	for (; *s; s++) {
+		switch (*s) {
+			case '\\': fputs("\\\\", f); break;
+			case '"': fputs("\\\"", f); break;
+			case '\n': fputs("\\n", f); break;
+			default: fputc(*s, f);
+		}
+	}
+}
+
+static int bucketOf(uint64_t us) {
+	int e;
+
+	if (us < (1 << HIST_SUB_BITS))
+		return us;
+	e = 63 - __builtin_clzll(us);
+	if (e >= HIST_MAX_BITS)
+		return HIST_BUCKETS - 1;
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+		((us >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/* Upper bound of a bucket in microseconds, exclusive */
+static uint64_t bucketLimit(int b) {
+	int e, sub;
+
+	if (b < (1 << HIST_SUB_BITS))
+		return b + 1;
+	if (b == HIST_BUCKETS - 1)
+		return UINT64_MAX;
+	e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	sub = b & ((1 << HIST_SUB_BITS) - 1);
+	return (uint64_t) ((1 << HIST_SUB_BITS) + sub + 1) <<
+		(e - HIST_SUB_BITS);
+}
+
+void histRecord(struct stats_hist_s *h, int64_t us) {
+	if (us < 0)
+		us = 0;
+	STATS_ADD(h->buckets[bucketOf(us)], 1);
+	STATS_ADD(h->sum, (uint64_t) us);
+	STATS_ADD(h->count, 1);
+}
+
+uint64_t histQuantile(const struct stats_hist_s *h, double q) {
+	uint64_t total = 0, cum = 0, rank;
+	int b;
+
+	for (b = 0; b < HIST_BUCKETS; b++)
+		total += STATS_GET(h->buckets[b]);
+	if (total == 0)
+		return 0;
+	rank = q * total;
+	if (rank >= total)
+		rank = total - 1;
+	for (b = 0; b < HIST_BUCKETS - 1; b++) {
+		cum += STATS_GET(h->buckets[b]);
+		if (cum > rank)
+			break;
+	}
+	/* Report the top of the bucket, never below the true value */
+	return b == HIST_BUCKETS - 1 ? (uint64_t) 1 << HIST_MAX_BITS :
+		bucketLimit(b) - 1;
+}
+
+static void histLabels(FILE *f, const char *name, const char *suffix,
+		const char *k1, const char *v1, const char *k2, const char *v2) {
+	fprintf(f, "%s%s{%s=\"", name, suffix, k1);
+	labelEscape(f, v1);
+	fprintf(f, "\",%s=\"", k2);
+	labelEscape(f, v2);
+	fputc('"', f);
+}
+
+void histPrometheus(FILE *f, const char *name, const char *k1,
+		const char *v1, const char *k2, const char *v2,
+		const struct stats_hist_s *h, int quantiles) {
+	/* Bucket bounds of the exported histogram and quantiles of the summary */
+	static const double bounds[] = {
+		0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25,
+		0.5, 1, 2.5, 5, 10
+	};
+	static const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+	uint64_t cum = 0;
+	size_t k;
+	int b = 0;
+
+	if (quantiles) {
+		for (k = 0; k < sizeof(qs) / sizeof(qs[0]); k++) {
+			histLabels(f, name, "", k1, v1, k2, v2);
+			fprintf(f, ",quantile=\"%g\"} %.6f\n", qs[k],
+				histQuantile(h, qs[k]) / 1e6);
+		}
+	} else {
+		/* Fold the fine buckets into the exported ones */
+		for (k = 0; k < sizeof(bounds) / sizeof(bounds[0]); k++) {
+			while (b < HIST_BUCKETS && bucketLimit(b) <=
+					(uint64_t) (bounds[k] * 1e6))
+				cum += STATS_GET(h->buckets[b++]);
+			histLabels(f, name, "_bucket", k1, v1, k2, v2);
+			fprintf(f, ",le=\"%g\"} %llu\n", bounds[k],
+				(unsigned long long) cum);
+		}
+		histLabels(f, name, "_bucket", k1, v1, k2, v2);
+		fprintf(f, ",le=\"+Inf\"} %llu\n",
+			(unsigned long long) STATS_GET(h->count));
+	}
+	histLabels(f, name, "_sum", k1, v1, k2, v2);
+	fprintf(f, "} %.6f\n", STATS_GET(h->sum) / 1e6);
+	histLabels(f, name, "_count", k1, v1, k2, v2);
+	fprintf(f, "} %llu\n", (unsigned long long) STATS_GET(h->count));
+}
+
+/*
+ * Write udpxy-like HTML status page.
+ */
+void statsHTML(FILE *f) {
+	uint32_t i;
+	int64_t now = time(NULL), age;
+	char addr[NI_MAXHOST + NI_MAXSERV + 1];
+	struct stats_client_s *c;
+	struct stats_group_s *g;
+	int32_t gi;
+
+	fprintf(f, "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
+		"<html><head>\r\n"
+		"<title>" PACKAGE " status</title>\r\n"
+		"</head><body>\r\n"
+		"<h1>" PACKAGE " status</h1>\r\n");
+	if (!stats) {
+		fprintf(f, "<p>Statistics are not available.</p>\r\n"
+			"</body></html>\r\n");
+		return;
+	}
+	fprintf(f, "<p>Server process ID: %d, uptime %lld s, "
+		"active clients: %d</p>\r\n",
+		(int) stats->pid, (long long) (now - stats->start), clientcount);
+
+	fprintf(f, "<table border=\"1\">\r\n"
+		"<tr><th>Process ID</th><th>Source</th><th>Destination</th>"
+		"<th>Service</th><th>Throughput</th><th>Packets</th>"
+		"<th>Drops</th><th>Queue</th></tr>\r\n");
+	for (i = 0; i < stats->nclients; i++) {
+		c = &stats->clients[i];
+		if (STATS_GET(c->state) != SLOT_USED)
+			continue;
+		gi = STATS_GET(c->group);
+		clientAddress(c, addr, sizeof(addr));
+		age = now - c->start;
+		if (age < 1)
+			age = 1;
+		fprintf(f, "<tr><td>%d</td><td>", (int) c->pid);
+		htmlEscape(f, gi >= 0 ? stats->groups[gi].group : "-");
+		fprintf(f, "</td><td>%s</td><td>", addr);
+		htmlEscape(f, c->url);
+		fprintf(f, "</td><td>%llu kbit/s</td><td>%llu</td>"
+			"<td>%llu</td><td>%u</td></tr>\r\n",
+			(unsigned long long) STATS_GET(c->bytes) * 8 / 1000 / age,
+			(unsigned long long) STATS_GET(c->packets),
+			(unsigned long long) STATS_GET(c->drops),
+			STATS_GET(c->queue));
+	}
+	fprintf(f, "</table>\r\n");
+
+	fprintf(f, "<h2>Groups</h2>\r\n<table border=\"1\">\r\n"
+		"<tr><th>Group</th><th>Clients</th><th>Bytes</th>"
+		"<th>Packets</th><th>Drops</th></tr>\r\n");
+	for (i = 0; i < STATS_GROUPS; i++) {
+		g = &stats->groups[i];
+		if (STATS_GET(g->state) != SLOT_USED)
+			continue;
+		fprintf(f, "<tr><td>");
+		htmlEscape(f, g->group);
+		fprintf(f, "</td><td>%u</td><td>%llu</td><td>%llu</td>"
+			"<td>%llu</td></tr>\r\n",
+			STATS_GET(g->clients),
+			(unsigned long long) STATS_GET(g->bytes),
+			(unsigned long long) STATS_GET(g->packets),
+			(unsigned long long) STATS_GET(g->drops));
+	}
+	fprintf(f, "</table>\r\n"
+		"<hr>\r\n"
+		"<address>Server " PACKAGE " version " VERSION "</address>\r\n"
+		"</body></html>\r\n");
+}
+
+/*
+ * Write statistics in Prometheus text exposition format.
+ */
+void statsPrometheus(FILE *f) {
+	uint32_t i;
+	char addr[NI_MAXHOST + NI_MAXSERV + 1];
+	struct stats_client_s *c;
+	struct stats_group_s *g;
+	static const char *gcounters[] = { "bytes", "packets", "drops" };
+	static const char *ghelp[] = {
+		"Payload bytes forwarded from the group.",
+		"Packets forwarded from the group.",
+		"Packets lost in the group (RTP sequence gaps)."
+	};
+	static const char *stages[TRACE_STAGES] = {
+		"proxy", "socket", "network"
+	};
+	int k;
+
+	if (!stats)
+		return;
+	fprintf(f, "# HELP rtp2httpd_start_time_seconds Start time of the daemon.\n"
+		"# TYPE rtp2httpd_start_time_seconds gauge\n"
+		"rtp2httpd_start_time_seconds %lld\n",
+		(long long) stats->start);
+	fprintf(f, "# HELP rtp2httpd_connections_total Accepted connections.\n"
+		"# TYPE rtp2httpd_connections_total counter\n"
+		"rtp2httpd_connections_total %llu\n",
+		(unsigned long long) STATS_GET(stats->accepted));
+	fprintf(f, "# HELP rtp2httpd_rejected_total Connections refused "
+		"because of overload.\n"
+		"# TYPE rtp2httpd_rejected_total counter\n"
+		"rtp2httpd_rejected_total %llu\n",
+		(unsigned long long) STATS_GET(stats->rejected));
+
+	fprintf(f, "# HELP rtp2httpd_group_clients Clients watching the group.\n"
+		"# TYPE rtp2httpd_group_clients gauge\n");
+	for (i = 0; i < STATS_GROUPS; i++) {
+		g = &stats->groups[i];
+		if (STATS_GET(g->state) != SLOT_USED)
+			continue;
+		fprintf(f, "rtp2httpd_group_clients{group=\"");
+		labelEscape(f, g->group);
+		fprintf(f, "\"} %u\n", STATS_GET(g->clients));
+	}
+	for (k = 0; k < 3; k++) {
+		fprintf(f, "# HELP rtp2httpd_group_%s_total %s\n"
+			"# TYPE rtp2httpd_group_%s_total counter\n",
+			gcounters[k], ghelp[k], gcounters[k]);
+		for (i = 0; i < STATS_GROUPS; i++) {
+			g = &stats->groups[i];
+			if (STATS_GET(g->state) != SLOT_USED)
+				continue;
+			fprintf(f, "rtp2httpd_group_%s_total{group=\"",
+					gcounters[k]);
+			labelEscape(f, g->group);
+			fprintf(f, "\"} %llu\n", (unsigned long long)
+				(k == 0 ? STATS_GET(g->bytes) :
+				 k == 1 ? STATS_GET(g->packets) :
+				 STATS_GET(g->drops)));
+		}
+	}
+
+	fprintf(f, "# HELP rtp2httpd_trace_seconds Time traced payloads spend "
+		"in the proxy, the socket and the network.\n"
+		"# TYPE rtp2httpd_trace_seconds summary\n");
+	for (i = 0; i < STATS_GROUPS; i++) {
+		g = &stats->groups[i];
+		if (STATS_GET(g->state) != SLOT_USED)
+			continue;
+		for (k = 0; k < TRACE_STAGES; k++) {
+			if (STATS_GET(g->trace[k].count) == 0)
+				continue;
+			histPrometheus(f, "rtp2httpd_trace_seconds", "group",
+				g->group, "stage", stages[k], &g->trace[k], 1);
+		}
+	}
+
+	fprintf(f, "# HELP rtp2httpd_client_bytes_total Bytes sent to the client.\n"
+		"# TYPE rtp2httpd_client_bytes_total counter\n");
+	for (i = 0; i < stats->nclients; i++) {
+		c = &stats->clients[i];
+		if (STATS_GET(c->state) != SLOT_USED || c->url[0] == '\0')
+			continue;
+		clientAddress(c, addr, sizeof(addr));
+		fprintf(f, "rtp2httpd_client_bytes_total{pid=\"%d\","
+			"client=\"%s\",service=\"", (int) c->pid, addr);
+		labelEscape(f, c->url);
+		fprintf(f, "\"} %llu\n",
+			(unsigned long long) STATS_GET(c->bytes));
+	}
+	fprintf(f, "# HELP rtp2httpd_client_queue_bytes Data waiting in "
+		"the client socket.\n"
+		"# TYPE rtp2httpd_client_queue_bytes gauge\n");
+	for (i = 0; i < stats->nclients; i++) {
+		c = &stats->clients[i];
+		if (STATS_GET(c->state) != SLOT_USED || c->url[0] == '\0')
+			continue;
+		clientAddress(c, addr, sizeof(addr));
+		fprintf(f, "rtp2httpd_client_queue_bytes{pid=\"%d\","
+			"client=\"%s\",service=\"", (int) c->pid, addr);
+		labelEscape(f, c->url);
+		fprintf(f, "\"} %u\n", STATS_GET(c->queue));
+	}
+	joinPrometheus(f);
+	zapPrometheus(f);
+	clusterPrometheus(f);
+}
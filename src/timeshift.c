@@ -0,0 +1,181 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/sendfile.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#define min(a,b) ((a)<(b) ? (a):(b))
+
+/* Largest piece handed to one sendfile() call */
+#define TIMESHIFT_CHUNK (256*1024)
+/* Give up when the ring does not grow for this long */
+#define TIMESHIFT_TIMEOUT_MS 5000
+
+/* Wait this long for an on demand feeder to start */
+#define TIMESHIFT_START_MS 8000
+
+static struct ring_s *ring = NULL;
+static const struct services_s *myservice = NULL;
+
+/*
+ * Find where a timeshifted client starts.
+ * @param offset seconds back from now, or 0 to use range
+ * @param range requested byte position, or -1
+ * @param pos set to the starting stream position
+ * @returns 0 or one of TIMESHIFT_ errors
+ */
+int timeshiftOpen(const struct services_s *service, long offset,
+		long long range, uint64_t *pos) {
+	char *path;
+
+	path = ringPath(service);
+	if (path == NULL)
+		return TIMESHIFT_UNAVAILABLE;
+	ring = ringOpen(path);
+	if (ring == NULL) {
+		logger(LOG_ERROR, "Timeshift ring %s not available\n", path);
+		free(path);
+		return TIMESHIFT_UNAVAILABLE;
+	}
+	free(path);
+	myservice = service;
+
+	if (range >= 0) {
+		if (range < ringTail(ring) || range > ringHead(ring))
+			return TIMESHIFT_BADRANGE;
+		*pos = range;
+	} else {
+		*pos = ringSeek(ring, nowMs() + offset * 1000);
+	}
+	logger(LOG_DEBUG, "Timeshift start at %llu, live at %llu\n",
+			(unsigned long long) *pos,
+			(unsigned long long) ringHead(ring));
+	return 0;
+}
+
+int timeshiftLiveOpen(const struct services_s *service, uint64_t *pos) {
+	char *path;
+	int64_t deadline = nowMs() + TIMESHIFT_START_MS;
+
+	path = ringPath(service);
+	if (path == NULL)
+		return TIMESHIFT_UNAVAILABLE;
+	while (1) {
+		feederDemand(service);
+		ring = ringOpen(path);
+		if (ring) {
+			if (kill(ring->hdr->writer, 0) == 0 && ringHead(ring) > 0)
+				break;
+			ringClose(ring);
+			ring = NULL;
+		}
+		if (nowMs() > deadline) {
+			logger(LOG_ERROR, "Stream of %s not available\n",
+					service->url);
+			free(path);
+			return TIMESHIFT_UNAVAILABLE;
+		}
+		usleep(200000);
+	}
+	free(path);
+	myservice = service;
+	/* Start at the last random access point */
+	*pos = ringSeek(ring, nowMs());
+	return 0;
+}
+
+/*
+ * Current live position of the opened ring
+ */
+uint64_t timeshiftLive(void) {
+	return ringHead(ring);
+}
+
+/*
+ * Stream the ring from pos onwards. The client receives the ring
+ * as fast as it can take it, until it catches up with the live head.
+ */
+void timeshiftStream(int client, uint64_t pos) {
+	struct pollfd pfd;
+	uint64_t head, size = ring->hdr->size;
+	off_t off;
+	size_t chunk;
+	ssize_t n;
+	int64_t lastdata = nowMs();
+	time_t lastdemand = 0;
+
+	pfd.fd = client;
+	pfd.events = POLLIN | POLLRDHUP;
+
+	while (1) {
+		/* Keep an on demand feeder running while watched */
+		if (time(NULL) != lastdemand) {
+			lastdemand = time(NULL);
+			feederDemand(myservice);
+		}
+		if (pos < ringTail(ring)) {
+			/* Overrun by the writer, skip to the oldest data */
+			logger(LOG_INFO, "Timeshift client fell behind\n");
+			statsDrops(1);
+			pos = ringSeek(ring, 0);
+			continue;
+		}
+		head = ringHead(ring);
+		if (pos >= head) {
+			/* Client written stg, or conn. lost */
+			if (poll(&pfd, 1, 0) > 0)
+				exit(RETVAL_WRITE_FAILED);
+			if (ringWait(ring, pos, 1000)) {
+				lastdata = nowMs();
+			} else if (nowMs() - lastdata > TIMESHIFT_TIMEOUT_MS) {
+				exit(RETVAL_SOCK_READ_FAILED);
+			}
+			continue;
+		}
+
+		chunk = min(head - pos, size - pos % size);
+		chunk = min(chunk, TIMESHIFT_CHUNK);
+		shapeAcquire(chunk);
+		off = ring->hdr->dataoff + pos % size;
+		n = sendfile(client, ring->fd, &off, chunk);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			exit(RETVAL_WRITE_FAILED);
+		pos += n;
+		statsPacket(n);
+		statsQueue(client);
+	}
+}
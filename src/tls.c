@@ -0,0 +1,253 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * HTTPS listeners.
+ *
+ * The handshake is done by OpenSSL in the client process. The session
+ * keys are then handed to the kernel (kTLS), so the socket encrypts
+ * whatever is written or sendfile()d into it and the rest of the code
+ * does not need to know about TLS at all. Only the request is read
+ * through OpenSSL.
+ *
+ * When the kernel cannot take the keys (no tls module, unsupported
+ * cipher), a helper process encrypts in userspace and the client is
+ * served through a socket pair instead.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif /* HAVE_OPENSSL */
+
+/* Seconds a client has to complete the handshake */
+#define TLS_HANDSHAKE_TIMEOUT 10
+/* Plaintext moved by the userspace helper at once, one record */
+#define TLS_BUFLEN 16384
+
+static int active = 0;
+
+#ifdef HAVE_OPENSSL
+
+static SSL_CTX *ctx = NULL;
+static SSL *ssl = NULL;
+
+static const char* tlsError(void) {
+	return ERR_error_string(ERR_get_error(), NULL);
+}
+
+/*
+ * Create the server context, shared by all clients
+ */
+void tlsInit(void) {
+	const char *key = conf_tlskey ? conf_tlskey : conf_tlscert;
+
+	if (conf_tlscert == NULL) {
+		logger(LOG_FATAL, "HTTPS listener needs tlscert\n");
+		exit(EXIT_FAILURE);
+	}
+	ctx = SSL_CTX_new(TLS_server_method());
+	if (ctx == NULL) {
+		logger(LOG_FATAL, "Cannot create TLS context: %s\n",
+				tlsError());
+		exit(EXIT_FAILURE);
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+	/* Ciphers the kernel can take over */
+	SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20");
+	/* Tickets would have to be sent after the keys are in the kernel,
+	 * and every request is a new process anyway */
+	SSL_CTX_set_num_tickets(ctx, 0);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, conf_tlscert) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+	    SSL_CTX_check_private_key(ctx) != 1) {
+		logger(LOG_FATAL, "Cannot load TLS certificate %s: %s\n",
+				conf_tlscert, tlsError());
+		exit(EXIT_FAILURE);
+	}
+	logger(LOG_INFO, "TLS certificate %s loaded\n", conf_tlscert);
+}
+
+/*
+ * Move data between the client and the socket pair, encrypting in
+ * userspace. Runs in the helper process until either side closes.
+ */
+static void tlsPump(int s, int plain) {
+	uint8_t buf[TLS_BUFLEN];
+	struct pollfd pfd[2];
+	int n;
+
+	signal(SIGPIPE, SIG_IGN);
+	SSL_clear_mode(ssl, SSL_MODE_AUTO_RETRY);
+	pfd[0].fd = plain;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = s;
+	pfd[1].events = POLLIN;
+
+	while (1) {
+		pfd[0].revents = pfd[1].revents = 0;
+		if (SSL_pending(ssl) == 0 && poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfd[0].revents) {
+			n = read(plain, buf, sizeof(buf));
+			if (n <= 0 || SSL_write(ssl, buf, n) <= 0)
+				break;
+		}
+		if (pfd[1].revents || SSL_pending(ssl) > 0) {
+			n = SSL_read(ssl, buf, sizeof(buf));
+			if (n <= 0) {
+				if (SSL_get_error(ssl, n) == SSL_ERROR_WANT_READ)
+					continue;
+				break;
+			}
+			if (write(plain, buf, n) != n)
+				break;
+		}
+	}
+	SSL_shutdown(ssl);
+	exit(RETVAL_CLEAN);
+}
+
+/*
+ * Serve the client through a socket pair, with a helper process
+ * doing the encryption.
+ */
+static int tlsProxy(int s) {
+	int sp[2];
+	pid_t child;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) < 0) {
+		logger(LOG_ERROR, "socketpair failed: %s\n", strerror(errno));
+		exit(RETVAL_WRITE_FAILED);
+	}
+	/* The helper is not interesting for us */
+	signal(SIGCHLD, SIG_IGN);
+	child = fork();
+	if (child < 0) {
+		logger(LOG_ERROR, "Cannot fork TLS helper: %s\n",
+				strerror(errno));
+		exit(RETVAL_WRITE_FAILED);
+	}
+	if (child == 0) {
+		close(sp[0]);
+		tlsPump(s, sp[1]);
+	}
+	close(sp[1]);
+	close(s);
+	SSL_free(ssl);
+	ssl = NULL;
+	return sp[0];
+}
+
+int tlsAccept(int s) {
+	struct timeval tv;
+
+	tv.tv_sec = TLS_HANDSHAKE_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	ssl = SSL_new(ctx);
+	if (ssl == NULL || SSL_set_fd(ssl, s) != 1) {
+		logger(LOG_ERROR, "Cannot create TLS session: %s\n",
+				tlsError());
+		exit(RETVAL_READ_FAILED);
+	}
+	if (SSL_accept(ssl) != 1) {
+		logger(LOG_DEBUG, "TLS handshake failed: %s\n", tlsError());
+		exit(RETVAL_READ_FAILED);
+	}
+
+	tv.tv_sec = 0;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+		logger(LOG_DEBUG, "%s %s, encrypting in kernel\n",
+				SSL_get_version(ssl), SSL_get_cipher(ssl));
+		active = 1;
+		return s;
+	}
+	logger(LOG_DEBUG, "%s %s, kernel TLS not available, encrypting "
+			"in userspace\n", SSL_get_version(ssl),
+			SSL_get_cipher(ssl));
+	return tlsProxy(s);
+}
+
+static ssize_t tlsRead(void *cookie, char *buf, size_t size) {
+	int n = SSL_read(ssl, buf, size);
+
+	return n > 0 ? n : 0;
+}
+
+FILE* tlsRequest(void) {
+	cookie_io_functions_t io = { tlsRead, NULL, NULL, NULL };
+
+	return fopencookie(NULL, "r", io);
+}
+
+#else /* HAVE_OPENSSL */
+
+void tlsInit(void) {
+	logger(LOG_FATAL, "HTTPS listener configured, but " PACKAGE
+			" was built without OpenSSL\n");
+	exit(EXIT_FAILURE);
+}
+
+int tlsAccept(int s) {
+	return s;
+}
+
+FILE* tlsRequest(void) {
+	return NULL;
+}
+
+#endif /* HAVE_OPENSSL */
+
+/*
+ * @returns 1 if the client socket itself does TLS, in the kernel
+ */
+int tlsActive(void) {
+	return active;
+}
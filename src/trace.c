@@ -0,0 +1,274 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Packet latency tracing.
+ *
+ * One in conf_trace datagrams is followed through the client process
+ * using kernel timestamps: SO_TIMESTAMPNS gives the time the multicast
+ * socket received it, SO_TIMESTAMPING the times the payload left the
+ * client socket and was acknowledged by the client. The TX timestamps
+ * come back on the error queue of the client socket, keyed by the
+ * offset of the last byte of the write (SOF_TIMESTAMPING_OPT_ID), so
+ * all writes go through here to keep count of the offset.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+/* Samples waiting for their TX timestamps, must be a power of two */
+#define TRACE_PENDING 64
+
+struct trace_sample_s {
+	uint32_t key; /* offset of the last byte */
+	int64_t rx;   /* ns, CLOCK_REALTIME like the kernel timestamps */
+	int64_t written;
+	int64_t sent;
+};
+
+static int enabled = 0;
+static int txstamps = 0;
+static uint32_t calls = 0;
+static int64_t lastrx = 0; /* of the sampled datagram, or 0 */
+static uint32_t offset = 0; /* bytes written since enabling */
+static struct trace_sample_s pending[TRACE_PENDING];
+static uint32_t npending = 0;
+
+static int64_t realNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Enable timestamps on the multicast and client sockets.
+ */
+void traceStart(int sock, int client) {
+	int on = 1, domain;
+	socklen_t len = sizeof(domain);
+	unsigned int flags = SOF_TIMESTAMPING_SOFTWARE |
+		SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+	if (conf_trace <= 0)
+		return;
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+		logger(LOG_ERROR, "Cannot enable receive timestamps: %s\n",
+				strerror(errno));
+		return;
+	}
+	enabled = 1;
+	/* A TLS helper behind a socketpair has no TCP timestamps to give */
+	if (getsockopt(client, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0 ||
+			(domain != AF_INET && domain != AF_INET6))
+		return;
+	if (setsockopt(client, SOL_SOCKET, SO_TIMESTAMPING,
+			&flags, sizeof(flags)) < 0) {
+		logger(LOG_DEBUG, "Cannot enable send timestamps: %s\n",
+				strerror(errno));
+		return;
+	}
+	txstamps = 1;
+}
+
+/*
+ * Receive a datagram, noting its kernel timestamp when it is sampled.
+ */
+int traceRecv(int sock, uint8_t *buf, size_t len) {
+	char control[CMSG_SPACE(sizeof(struct timespec))];
+	struct iovec iov = { buf, len };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct timespec *ts;
+	int r;
+
+	lastrx = 0;
+	if (!enabled || calls++ % conf_trace != 0)
+		return recv(sock, buf, len, 0);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	r = recvmsg(sock, &msg, 0);
+	if (r < 0)
+		return r;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+				cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			ts = (struct timespec *) CMSG_DATA(cmsg);
+			lastrx = (int64_t) ts->tv_sec * 1000000000LL +
+				ts->tv_nsec;
+		}
+	}
+	return r;
+}
+
+/*
+ * Write all data to the client, asking for TX timestamps of the write
+ * when the datagram was sampled.
+ * @returns 0 when tracing is off and the caller has to write itself
+ */
+int traceSend(int client, const uint8_t *buf, size_t len) {
+	char control[CMSG_SPACE(sizeof(uint32_t))];
+	struct iovec iov = { (void *) buf, len };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct trace_sample_s *t = NULL;
+	size_t written = 0;
+	ssize_t actual;
+	int64_t now;
+
+	if (!enabled)
+		return 0;
+	if (lastrx && txstamps) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SO_TIMESTAMPING;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+		*(uint32_t *) CMSG_DATA(cmsg) = SOF_TIMESTAMPING_TX_SOFTWARE |
+			SOF_TIMESTAMPING_TX_ACK;
+		actual = sendmsg(client, &msg, MSG_NOSIGNAL);
+		if (actual <= 0)
+			exit(RETVAL_WRITE_FAILED);
+		written = actual;
+		offset += actual;
+		/* The timestamps carry the offset of the last byte of it */
+		t = &pending[npending++ & (TRACE_PENDING - 1)];
+		t->key = offset - 1;
+		t->rx = lastrx;
+		t->sent = 0;
+	}
+	while (written < len) {
+		actual = write(client, buf + written, len - written);
+		if (actual <= 0)
+			exit(RETVAL_WRITE_FAILED);
+		written += actual;
+		offset += actual;
+	}
+	if (lastrx) {
+		now = realNs();
+		statsTrace(TRACE_PROXY, (now - lastrx) / 1000);
+		if (t)
+			t->written = now;
+		else
+			logger(LOG_DEBUG, "Trace: proxy %lld us\n",
+				(long long) (now - lastrx) / 1000);
+	}
+	return 1;
+}
+
+static void traceStamp(uint32_t key, uint32_t type, int64_t ts) {
+	struct trace_sample_s *t = NULL;
+	uint32_t i;
+
+	for (i = 0; i < TRACE_PENDING && i < npending; i++) {
+		t = &pending[(npending - 1 - i) & (TRACE_PENDING - 1)];
+		if (t->key == key && t->rx)
+			break;
+		t = NULL;
+	}
+	if (t == NULL)
+		return;
+	if (type == SCM_TSTAMP_SND) {
+		t->sent = ts;
+		statsTrace(TRACE_SOCKET, (ts - t->written) / 1000);
+	} else if (type == SCM_TSTAMP_ACK && t->sent) {
+		statsTrace(TRACE_NETWORK, (ts - t->sent) / 1000);
+		logger(LOG_DEBUG, "Trace: offset %u proxy %lld us socket %lld us "
+			"network %lld us\n", key,
+			(long long) (t->written - t->rx) / 1000,
+			(long long) (t->sent - t->written) / 1000,
+			(long long) (ts - t->sent) / 1000);
+		t->rx = 0;
+	}
+}
+
+/*
+ * Collect TX timestamps from the error queue of the client socket.
+ * select() reports the socket readable when they arrive.
+ * @returns 1 when that was the only reason for the socket to be
+ * readable, 0 when the client closed the connection or sent something
+ */
+int traceClient(int client) {
+	char control[512];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct scm_timestamping *tss;
+	struct sock_extended_err *serr;
+	int64_t ts;
+	char c;
+	int n = 0;
+
+	if (!txstamps)
+		return 0;
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(client, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+		n++;
+		tss = NULL;
+		serr = NULL;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+				cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+					cmsg->cmsg_type == SCM_TIMESTAMPING)
+				tss = (struct scm_timestamping *) CMSG_DATA(cmsg);
+			else if ((cmsg->cmsg_level == SOL_IP &&
+					cmsg->cmsg_type == IP_RECVERR) ||
+					(cmsg->cmsg_level == SOL_IPV6 &&
+					cmsg->cmsg_type == IPV6_RECVERR))
+				serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+		}
+		if (tss == NULL || serr == NULL ||
+				serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+			continue;
+		ts = (int64_t) tss->ts[0].tv_sec * 1000000000LL +
+			tss->ts[0].tv_nsec;
+		traceStamp(serr->ee_data, serr->ee_info, ts);
+	}
+	if (n == 0)
+		return 0;
+	/* Anything else pending, a hangup or a request? */
+	return recv(client, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+		(errno == EAGAIN || errno == EWOULDBLOCK);
+}
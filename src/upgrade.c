@@ -0,0 +1,392 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Binary upgrade.
+ *
+ * On SIGUSR2 the main process executes its binary again, which may
+ * have been replaced in the meantime, and hands the new image what it
+ * needs to carry on: the listening sockets, the segments shared with
+ * its children and the list of those children. Being the same process,
+ * it stays the parent of every client and feeder, which keep streaming
+ * through the upgrade untouched and are reaped by the new image. New
+ * connections wait in the backlog of the listeners while it starts.
+ *
+ * The state goes over a UNIX socket pair: its one message carries the
+ * descriptors and a memfd with a record per line, the name of the
+ * record, the index of its descriptor or -1, and its arguments. Only
+ * the end of the new image survives the exec, its number is in the
+ * environment. Records with a descriptor are kept from the start,
+ * records without one describe the moment of the exec and are written
+ * right before it.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#define UPGRADE_ENV "RTP2HTTPD_UPGRADE"
+/* Descriptors of one SCM_RIGHTS message, the state included */
+#define UPGRADE_MAXFDS 250
+#define UPGRADE_LINE 1024
+
+struct record_s {
+	char *line; /* name and arguments */
+	int fd;
+	int taken;
+};
+
+/* To hand over on the next exec */
+static struct record_s *kept = NULL;
+static int nkept = 0;
+/* Handed over by the previous image */
+static struct record_s *given = NULL;
+static int ngiven = 0;
+
+static volatile sig_atomic_t requested = 0;
+
+/* SIGUSR2 handler */
+void upgradeRequest(int signum) {
+	(void) signum;
+	requested = 1;
+}
+
+int upgradeRequested(void) {
+	int r = requested;
+	requested = 0;
+	return r;
+}
+
+/*
+ * Hand a record over to the next image
+ * @param fd descriptor going with it, which stays open, or -1
+ */
+void upgradeKeep(int fd, const char *format, ...) {
+	char line[UPGRADE_LINE];
+	va_list ap;
+
+	va_start(ap, format);
+	vsnprintf(line, sizeof(line), format, ap);
+	va_end(ap);
+	kept = realloc(kept, (nkept + 1) * sizeof(struct record_s));
+	if (kept == NULL || (kept[nkept].line = strdup(line)) == NULL) {
+		logger(LOG_FATAL, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	kept[nkept].fd = fd;
+	nkept++;
+}
+
+/*
+ * Take the next record of the given name handed over by the previous
+ * image.
+ * @param fd set to its descriptor, which is the caller's now, or -1
+ * @returns its arguments or NULL when there are no more
+ */
+const char* upgradeTake(const char *name, int *fd) {
+	size_t len = strlen(name);
+	int i;
+
+	for (i = 0; i < ngiven; i++) {
+		if (given[i].taken || strncmp(given[i].line, name, len) ||
+		    (given[i].line[len] != ' ' && given[i].line[len] != '\0'))
+			continue;
+		given[i].taken = 1;
+		if (fd)
+			*fd = given[i].fd;
+		else if (given[i].fd >= 0)
+			close(given[i].fd);
+		return given[i].line[len] ? given[i].line + len + 1 : "";
+	}
+	if (fd)
+		*fd = -1;
+	return NULL;
+}
+
+/*
+ * Map a segment shared with the children, the one of the previous
+ * image when it handed over one of the same name and size.
+ * @param fd file to back a new segment, closed in any case, or -1
+ * @param fresh set to 1 when the segment is new, to be initialised
+ * @returns the segment or NULL
+ */
+void* sharedMap(const char *name, size_t len, int fd, int *fresh) {
+	const char *args;
+	void *p;
+	int old;
+
+	*fresh = 1;
+	while ((args = upgradeTake(name, &old)) != NULL) {
+		if (old >= 0 && strtoull(args, NULL, 10) == len) {
+			p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+					old, 0);
+			if (p != MAP_FAILED) {
+				*fresh = 0;
+				if (fd >= 0)
+					close(fd);
+				upgradeKeep(old, "%s %zu", name, len);
+				return p;
+			}
+		}
+		if (old >= 0)
+			close(old);
+	}
+
+	if (fd < 0)
+		fd = memfd_create(name, MFD_CLOEXEC);
+	if (fd >= 0 && ftruncate(fd, len) < 0) {
+		logger(LOG_ERROR, "Cannot size %s: %s\n", name,
+				strerror(errno));
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0) {
+		/* Cannot be handed over, but works */
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	} else {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if (p == MAP_FAILED) {
+		logger(LOG_ERROR, "Cannot map %s: %s\n", name,
+				strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	if (fd >= 0)
+		upgradeKeep(fd, "%s %zu", name, len);
+	return p;
+}
+
+/*
+ * Read what the previous image handed over, if this one was started
+ * by an upgrade.
+ * @returns 1 if it was
+ */
+int upgradeReceive(void) {
+	char *env, *end, *line, *nl, byte;
+	char cbuf[CMSG_SPACE(UPGRADE_MAXFDS * sizeof(int))];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	int sock, fds[UPGRADE_MAXFDS], nfds = 0, idx, i;
+	FILE *f;
+	char buf[UPGRADE_LINE + 16];
+
+	env = getenv(UPGRADE_ENV);
+	if (env == NULL)
+		return 0;
+	sock = strtol(env, &end, 10);
+	unsetenv(UPGRADE_ENV);
+	if (*end != '\0' || sock < 0)
+		return 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) {
+		logger(LOG_ERROR, "Cannot receive upgrade state: %s\n",
+				strerror(errno));
+		close(sock);
+		return 0;
+	}
+	close(sock);
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS) {
+			nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+		}
+	}
+	if (nfds == 0 || (msg.msg_flags & MSG_CTRUNC)) {
+		logger(LOG_ERROR, "Upgrade state incomplete\n");
+		for (i = 0; i < nfds; i++)
+			close(fds[i]);
+		return 0;
+	}
+
+	/* The state comes first */
+	f = fdopen(fds[0], "r");
+	if (f == NULL) {
+		logger(LOG_ERROR, "Cannot read upgrade state: %s\n",
+				strerror(errno));
+		for (i = 0; i < nfds; i++)
+			close(fds[i]);
+		return 0;
+	}
+	rewind(f);
+	while (fgets(buf, sizeof(buf), f)) {
+		nl = strchr(buf, '\n');
+		if (nl)
+			*nl = '\0';
+		idx = strtol(buf, &line, 10);
+		if (*line != ' ')
+			continue;
+		given = realloc(given, (ngiven + 1) * sizeof(struct record_s));
+		if (given == NULL || (given[ngiven].line = strdup(line + 1))
+				== NULL) {
+			logger(LOG_FATAL, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		given[ngiven].fd = idx > 0 && idx < nfds ? fds[idx] : -1;
+		given[ngiven].taken = 0;
+		if (given[ngiven].fd >= 0)
+			fds[idx] = -1;
+		ngiven++;
+	}
+	fclose(f);
+	for (i = 1; i < nfds; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+	logger(LOG_INFO, "Upgraded, took over %d records\n", ngiven);
+	return 1;
+}
+
+/*
+ * Drop what nobody took over. Called once all modules had a look.
+ */
+void upgradeDone(void) {
+	int i;
+
+	for (i = 0; i < ngiven; i++) {
+		if (given[i].taken)
+			continue;
+		logger(LOG_DEBUG, "Upgrade record %s not taken over\n",
+				given[i].line);
+		if (given[i].fd >= 0)
+			close(given[i].fd);
+	}
+	for (i = 0; i < ngiven; i++)
+		free(given[i].line);
+	free(given);
+	given = NULL;
+	ngiven = 0;
+}
+
+/* Forget the records written for an exec that failed */
+static void dropMoment(void) {
+	int i, n = 0;
+
+	for (i = 0; i < nkept; i++) {
+		if (kept[i].fd < 0)
+			free(kept[i].line);
+		else
+			kept[n++] = kept[i];
+	}
+	nkept = n;
+}
+
+/*
+ * Execute the binary again, handing everything kept over to it. The
+ * caller keeps SIGCHLD blocked and has kept the records of the moment.
+ * Returns only when that failed, carrying on as before.
+ */
+void upgradeExec(char *argv[]) {
+	char cbuf[CMSG_SPACE(UPGRADE_MAXFDS * sizeof(int))];
+	char env[16], byte = 'U';
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	int sv[2] = { -1, -1 }, fds[UPGRADE_MAXFDS], nfds = 1, state, i;
+
+	logger(LOG_INFO, "Upgrading to %s\n", argv[0]);
+	state = memfd_create("upgrade", MFD_CLOEXEC);
+	if (state < 0) {
+		logger(LOG_ERROR, "Cannot create upgrade state: %s\n",
+				strerror(errno));
+		dropMoment();
+		return;
+	}
+	fds[0] = state;
+	for (i = 0; i < nkept; i++) {
+		if (kept[i].fd >= 0 && nfds == UPGRADE_MAXFDS) {
+			logger(LOG_ERROR, "Too many descriptors to hand "
+				"over\n");
+			goto fail;
+		}
+		dprintf(state, "%d %s\n", kept[i].fd >= 0 ? nfds : -1,
+				kept[i].line);
+		if (kept[i].fd >= 0)
+			fds[nfds++] = kept[i].fd;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		logger(LOG_ERROR, "Cannot create upgrade socket: %s\n",
+				strerror(errno));
+		goto fail;
+	}
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	if (sendmsg(sv[0], &msg, 0) != 1) {
+		logger(LOG_ERROR, "Cannot send upgrade state: %s\n",
+				strerror(errno));
+		goto fail;
+	}
+
+	/* The one descriptor crossing the exec by itself */
+	if (fcntl(sv[1], F_SETFD, 0) < 0)
+		goto fail;
+	snprintf(env, sizeof(env), "%d", sv[1]);
+	setenv(UPGRADE_ENV, env, 1);
+	execvp(argv[0], argv);
+	logger(LOG_ERROR, "Cannot execute %s: %s\n", argv[0],
+			strerror(errno));
+	unsetenv(UPGRADE_ENV);
+
+fail:
+	if (sv[0] >= 0) {
+		close(sv[0]);
+		close(sv[1]);
+	}
+	close(state);
+	dropMoment();
+}
@@ -0,0 +1,231 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * HTTP upstream of HTTP services.
+ *
+ * The feeder of the service holds the only connection to the upstream
+ * and writes the stream into the ring of the service, the clients read
+ * the ring like a timeshift client at the live edge. The connection is
+ * made again when it fails, backing off exponentially as long as the
+ * upstream does not send anything. RTSP services share the backoff.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+/* Reads of whole TS packets, about 7 datagrams worth of each */
+#define UPSTREAM_BUFLEN (TS_PACKET_LEN * 7 * 32)
+#define UPSTREAM_TIMEOUT 5 /* seconds to connect and get the headers */
+#define UPSTREAM_BACKOFF_MAX 30
+
+static uint8_t buf[UPSTREAM_BUFLEN];
+static size_t have = 0; /* bytes in buf */
+static size_t out = 0; /* of them handed out by the last read */
+static time_t retry = 0;
+static int backoff = 1;
+
+/*
+ * Whether to connect now. Each attempt doubles the wait before the
+ * next one, until the upstream is found flowing.
+ */
+int upstreamRetry(void) {
+	if (time(NULL) < retry)
+		return 0;
+	retry = time(NULL) + backoff;
+	backoff = backoff * 2 > UPSTREAM_BACKOFF_MAX ?
+		UPSTREAM_BACKOFF_MAX : backoff * 2;
+	return 1;
+}
+
+void upstreamFlowing(void) {
+	retry = 0;
+	backoff = 1;
+}
+
+void upstreamFailed(const struct services_s *service, const char *why) {
+	logger(LOG_ERROR, "Upstream %s: %s, retrying in %d s\n",
+		service->upstream, why, (int) (retry - time(NULL)));
+}
+
+/*
+ * Split http://host[:port][/path] or rtsp://... into its parts. Caller
+ * frees them.
+ * @returns 0 on success
+ */
+int upstreamParse(const char *url, char **host, char **port, char **path) {
+	const char *h, *end, *p, *defport;
+
+	if (strncasecmp(url, "http://", 7) == 0)
+		defport = "80";
+	else if (strncasecmp(url, "rtsp://", 7) == 0)
+		defport = "554";
+	else
+		return -1;
+	h = url + 7;
+	p = index(h, '/');
+	if (p == NULL)
+		p = h + strlen(h);
+	if (*h == '[') { /* [v6]:port */
+		end = index(h, ']');
+		if (end == NULL || end > p)
+			return -1;
+		*host = strndup(h + 1, end - h - 1);
+		end++;
+	} else {
+		end = memchr(h, ':', p - h);
+		if (end == NULL)
+			end = p;
+		*host = strndup(h, end - h);
+	}
+	*port = *end == ':' ? strndup(end + 1, p - end - 1) : strdup(defport);
+	*path = strdup(*p ? p : "/");
+	return 0;
+}
+
+/*
+ * Connect to the upstream of the service and read the response header,
+ * unless still backing off.
+ * @returns the connected socket or -1
+ */
+int upstreamConnect(struct services_s *service) {
+	struct addrinfo *ai;
+	struct timeval tv = { UPSTREAM_TIMEOUT, 0 };
+	char *host, *port, *path, *req, *eoh;
+	int sock, n, status = 0;
+
+	if (!upstreamRetry())
+		return -1;
+	if (serviceResolve(service) < 0) {
+		upstreamFailed(service, "cannot resolve");
+		return -1;
+	}
+	ai = service->addr;
+
+	if (upstreamParse(service->upstream, &host, &port, &path) < 0)
+		return -1;
+	n = asprintf(&req, "GET %s HTTP/1.0\r\nHost: %s%s%s\r\n"
+		"User-Agent: " PACKAGE "/" VERSION "\r\n\r\n", path, host,
+		strcmp(port, "80") ? ":" : "", strcmp(port, "80") ? port : "");
+	free(host);
+	free(port);
+	free(path);
+	if (n < 0)
+		return -1;
+
+	sock = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		free(req);
+		return -1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (connect(sock, ai->ai_addr, ai->ai_addrlen) < 0 ||
+	    send(sock, req, n, MSG_NOSIGNAL) != n) {
+		upstreamFailed(service, strerror(errno));
+		free(req);
+		close(sock);
+		return -1;
+	}
+	free(req);
+
+	/* Read the header, whatever follows it is the stream */
+	have = out = 0;
+	while (1) {
+		n = recv(sock, buf + have, sizeof(buf) - have - 1, 0);
+		if (n <= 0)
+			break;
+		have += n;
+		buf[have] = '\0';
+		eoh = strstr((char *) buf, "\r\n\r\n");
+		if (eoh == NULL && have < sizeof(buf) - 1)
+			continue;
+		sscanf((char *) buf, "HTTP/%*s %d", &status);
+		if (eoh == NULL || status != 200)
+			break;
+		eoh += 4;
+		have -= eoh - (char *) buf;
+		memmove(buf, eoh, have);
+		tv.tv_sec = 0;
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		logger(LOG_INFO, "Upstream %s connected\n", service->upstream);
+		return sock;
+	}
+	upstreamFailed(service, status ? "bad status" : "no response");
+	have = 0;
+	close(sock);
+	return -1;
+}
+
+/*
+ * Read from the upstream without blocking. Closes the socket and sets
+ * it to -1 when the upstream goes away.
+ * @param data set to whole TS packets read
+ * @returns their length, 0 when there are none
+ */
+int upstreamRead(int *sock, const struct services_s *service,
+		uint8_t **data) {
+	size_t start = 0, whole;
+	ssize_t n;
+
+	memmove(buf, buf + out, have - out);
+	have -= out;
+	out = 0;
+	if (have < sizeof(buf)) {
+		n = recv(*sock, buf + have, sizeof(buf) - have, MSG_DONTWAIT);
+		if (n == 0 || (n < 0 && errno != EAGAIN &&
+		    errno != EWOULDBLOCK && errno != EINTR)) {
+			logger(LOG_ERROR, "Upstream %s closed: %s\n",
+				service->upstream, n ? strerror(errno) : "EOF");
+			close(*sock);
+			*sock = -1;
+			have = out = 0;
+			return 0;
+		}
+		if (n > 0) {
+			have += n;
+			upstreamFlowing();
+		}
+	}
+	/* Find the packet boundary again if the stream lost it */
+	while (start + TS_PACKET_LEN < have && (buf[start] != TS_SYNC ||
+	    buf[start + TS_PACKET_LEN] != TS_SYNC))
+		start++;
+	whole = buf[start] == TS_SYNC ?
+		(have - start) / TS_PACKET_LEN * TS_PACKET_LEN : 0;
+	*data = buf + start;
+	out = start + whole;
+	return whole;
+}
@@ -0,0 +1,151 @@
+/*
+ *  RTP2HTTP Proxy - Multicast RTP stream to UNICAST HTTP translator
+ *
+ *  Copyright (C) 2008-2010 Ondrej Caletka <o.caletka@sh.cvut.cz>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program (see the file COPYING included with this
+ *  distribution); if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Zap latency.
+ *
+ * The main process notes the time of accept before forking, the client
+ * then marks each phase of the zap once. Marks made before the service
+ * is known are kept until it is, then all of them go into histograms of
+ * the service in the statistics segment, shared by all clients of it.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include "rtp2httpd.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+static const char *phases[ZAP_PHASES] = {
+	"request", "resolved", "joined", "first_packet", "first_byte",
+	"first_rap"
+};
+
+static int64_t accepted;
+static int64_t marks[ZAP_PHASES]; /* microseconds since accept, or -1 */
+static unsigned int marked;
+static struct stats_zap_s *myzap = NULL;
+
+static int64_t monoUs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void zapAccept(void) {
+	int i;
+
+	accepted = monoUs();
+	for (i = 0; i < ZAP_PHASES; i++)
+		marks[i] = -1;
+	marked = 0;
+}
+
+/*
+ * Note that the client reached a phase. Only the first time counts.
+ */
+void zapMark(enum zap_phase phase) {
+	if (marked & (1 << phase) || accepted == 0)
+		return;
+	marked |= 1 << phase;
+	marks[phase] = monoUs() - accepted;
+	if (myzap)
+		histRecord(&myzap->phase[phase], marks[phase]);
+}
+
+/*
+ * Bind the client to the histograms of the service and record the
+ * phases reached so far.
+ */
+void zapService(const char *url) {
+	struct stats_zap_s *z;
+	uint32_t expected;
+	int i;
+
+	if (!stats || myzap)
+		return;
+	for (i = 0; i < STATS_ZAP && myzap == NULL; i++) {
+		z = &stats->zap[i];
+		expected = SLOT_FREE;
+		if (__atomic_compare_exchange_n(&z->state, &expected,
+				SLOT_CLAIMED, 0, __ATOMIC_ACQUIRE,
+				__ATOMIC_RELAXED)) {
+			snprintf(z->service, sizeof(z->service), "%s", url);
+			__atomic_store_n(&z->state, SLOT_USED, __ATOMIC_RELEASE);
+			myzap = z;
+			break;
+		}
+		while (expected == SLOT_CLAIMED) {
+			usleep(100);
+			expected = __atomic_load_n(&z->state, __ATOMIC_ACQUIRE);
+		}
+		if (strcmp(z->service, url) == 0)
+			myzap = z;
+	}
+	if (myzap == NULL)
+		return;
+	for (i = 0; i < ZAP_PHASES; i++) {
+		if (marks[i] >= 0)
+			histRecord(&myzap->phase[i], marks[i]);
+	}
+}
+
+/*
+ * Note data written to the client, marking the first byte and the
+ * first random access point.
+ */
+void zapSent(const uint8_t *buf, size_t len) {
+	if (marked & (1 << ZAP_FIRST_RAP))
+		return;
+	zapMark(ZAP_FIRST_BYTE);
+	if (tsRandomAccess(buf, len) >= 0)
+		zapMark(ZAP_FIRST_RAP);
+}
+
+/*
+ * Write the histograms in Prometheus text exposition format
+ */
+void zapPrometheus(FILE *f) {
+	struct stats_zap_s *z;
+	int i, p;
+
+	fprintf(f, "# HELP rtp2httpd_zap_seconds Time from accept to each "
+		"phase of a zap.\n"
+		"# TYPE rtp2httpd_zap_seconds histogram\n");
+	for (i = 0; i < STATS_ZAP; i++) {
+		z = &stats->zap[i];
+		if (STATS_GET(z->state) != SLOT_USED)
+			continue;
+		for (p = 0; p < ZAP_PHASES; p++) {
+			if (STATS_GET(z->phase[p].count) == 0)
+				continue;
+			histPrometheus(f, "rtp2httpd_zap_seconds", "service",
+				z->service, "phase", phases[p], &z->phase[p], 0);
+		}
+	}
+}